@@ -25,15 +25,29 @@
 #include <unistd.h>
 #include <sys/mman.h>
 #include <string.h>
+#include <time.h>
 #include <pthread.h>
 #include <sched.h>
+#include <poll.h>
+#include <limits.h>
+#include <sys/ioctl.h>
+#include <sys/eventfd.h>
+#include <sys/syscall.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <errno.h>
+#include <linux/futex.h>
+#include <linux/gpio.h>
 
 #include "dgtpicom.h"
 #include "dgtpicom_dgt3000.h"
 
-int ww;
 char piModel;
 
+#ifndef DGTPICOM_NO_MAIN
+int ww;
+
 // while loop
 void *wl(void *x) {
     int e;
@@ -51,7 +65,7 @@ void *wl(void *x) {
             bug.sendTotal++;
             #endif
         } else {
-            usleep(10000);
+            clockSleep(10000);
         }
     return 0;
 }
@@ -60,9 +74,34 @@ int main (int argc, char *argv[]) {
     int e;
     char but,tim;
 
+    // decode a capture, no clock needed
+    if (argc==3 && strcmp(argv[1],"-c")==0)
+        return captureDecode(argv[2]);
+
+    // replay a recording, no clock needed
+    if (argc==3 && strcmp(argv[1],"-r")==0) {
+        dgtpicom_replay_report_t r;
+
+        e=dgtpicom_replay(argv[2], &r);
+        if (e<0)
+            return e;
+        printf("commands=%d failed=%d retries=%d latency p50=%dus p99=%dus\n",
+                r.commands, r.failed, r.retries, r.latencyP50, r.latencyP99);
+        printf("rx packets=%d errors=%d, sends unmatched=%d skipped=%d, %.3fs\n",
+                r.rxPackets, r.rxErrors, r.unmatched, r.skipped, (float)r.duration/1000000);
+        return ERROR_OK;
+    }
+
     // get direct acces to the perhicels
     if (dgtpicom_init()) return ERROR_MEM;
 
+    // compare the time sources, no clock needed
+    if (argc==2 && strcmp(argv[1],"-t")==0) {
+        e=timerBench();
+        dgtpicom_stop();
+        return e;
+    }
+
     // configure dgt3000 for mode 25
     e = dgtpicom_configure();
     if (e<0)
@@ -101,41 +140,41 @@ int main (int argc, char *argv[]) {
         if ( argv[1][0]=='~' ) {
             dgtpicom_set_text("DGT PI",beep,ldots,rdots);
             while(1) {
-                usleep(1000000);
+                clockSleep(1000000);
                 dgtpicom_set_text(" DGT PI",0,ldots,rdots);
-                usleep(1000000);
+                clockSleep(1000000);
                 dgtpicom_set_text("  DGT PI",0,ldots,rdots);
-                usleep(1000000);
+                clockSleep(1000000);
                 dgtpicom_set_text("   DGT PI",0,ldots,rdots);
-                usleep(1000000);
+                clockSleep(1000000);
                 dgtpicom_set_text("    DGT PI",0,ldots,rdots);
-                usleep(1000000);
+                clockSleep(1000000);
                 dgtpicom_set_text("     DGT PI",0,ldots,rdots);
-                usleep(1000000);
+                clockSleep(1000000);
                 dgtpicom_set_text("    DGT PI",0,ldots,rdots);
-                usleep(1000000);
+                clockSleep(1000000);
                 dgtpicom_set_text("   DGT PI",0,ldots,rdots);
-                usleep(1000000);
+                clockSleep(1000000);
                 dgtpicom_set_text("  DGT PI",0,ldots,rdots);
-                usleep(1000000);
+                clockSleep(1000000);
                 dgtpicom_set_text(" DGT PI",0,ldots,rdots);
-                usleep(1000000);
+                clockSleep(1000000);
                 dgtpicom_set_text("DGT PI",0,ldots,rdots);
             }
         } else if ( argv[1][0]=='*' ){
             while(1) {
                 if ( dgtpicom_set_text("  DGT PI  -",beep,ldots,rdots) != ERROR_OK )
                     i2cReset();
-                usleep(200000);
+                clockSleep(200000);
                 if ( dgtpicom_set_text("  DGT PI  ||",beep,ldots,rdots) != ERROR_OK )
                     i2cReset();
-                usleep(200000);
+                clockSleep(200000);
                 if ( dgtpicom_set_text("  DGT PI  |",beep,ldots,rdots) != ERROR_OK )
                     i2cReset();
-                usleep(200000);
+                clockSleep(200000);
                 if ( dgtpicom_set_text("  DGT PI  /",beep,ldots,rdots) != ERROR_OK )
                     i2cReset();
-                usleep(200000);
+                clockSleep(200000);
             }
         } else {
             // try three times to end and set de display
@@ -145,11 +184,12 @@ int main (int argc, char *argv[]) {
 
     } else {
         #ifdef debug
-        printf("  %.3f ",(float)*timer()/1000000);
+        printf("  %.3f ",(float)timer()/1000000);
         printf("started\n");
-        usleep(10000);
+        clockSleep(10000);
         ww=1;
         pthread_t w;
+        dgtClock->spawn();
         pthread_create(&w, NULL, wl, NULL);
         #else
         if ( dgtpicom_off(1) < 0 )
@@ -157,7 +197,7 @@ int main (int argc, char *argv[]) {
         #endif
         but=tim=0;
         while(1) {
-            if (dgtpicom_get_button_message(&but,&tim)) {
+            if (dgtpicom_wait_button_message(&but,&tim,-1)) {
                 if (but&0x40) {
                     if (ww)
                         ww=0;
@@ -167,203 +207,231 @@ int main (int argc, char *argv[]) {
                 if (but==0x20) {
                     break;
                 }
-                printf("%.3f ",(float)*timer()/1000000);
+                printf("%.3f ",(float)timer()/1000000);
                 printf("button=%02x, time=%d\n",but,tim);
             }
-
-            usleep(10000);
         }
     }
 
     dgtpicom_stop();
 
     #ifdef debug
-    printf("%.3f ",(float)*timer()/1000000);
+    printf("%.3f ",(float)timer()/1000000);
     printf("After %d messages:\n",bug.sendTotal);
-    printf("Send failed: display=%d, endDisplay=%d, changeState=%d, setCC=%d, setNRun=%d\n",
-                bug.displaySF, bug.endDisplaySF, bug.changeStateSF, bug.setCCSF, bug.setNRunSF);
-    printf("Ack failed : display=%d, endDisplay=%d, changeState=%d, setCC=%d, setNRun=%d\n",
-                bug.displayAF, bug.endDisplayAF, bug.changeStateAF, bug.setCCAF, bug.setNRunAF);
-    printf("Recieve Errors: timeout=%d, wrongAdr=%d, bufferFull=%d, sizeMismatch=%d, CRCFault=%d\n",
-            bug.rxTimeout, bug.rxWrongAdr, bug.rxBufferFull, bug.rxSizeMismatch, bug.rxCRCFault);
+    statsWrite(stdout, &stats);
     printf("Max recieve buffer size=%d\n",bug.rxMaxBuf);
     #endif
 
     // succes?
     return ERROR_OK;
 }
+#endif
+
+// Select the hardware backend.
+int dgtpicom_set_backend(int b) {
+    if (b==DGTPICOM_BACKEND_HW)
+        backend=&dgtBackendHw;
+    else if (b==DGTPICOM_BACKEND_EMU)
+        backend=&dgtBackendEmu;
+    else
+        return ERROR_MEM;
+    return ERROR_OK;
+}
+
+// Select the time source.
+int dgtpicom_set_clock(int c) {
+    if (c!=DGTPICOM_CLOCK_REAL && c!=DGTPICOM_CLOCK_VIRTUAL)
+        return ERROR_MEM;
+    clockMode=c;
+    return ERROR_OK;
+}
+
+// Select how init and stop treat the hardware.
+int dgtpicom_set_start(int start) {
+    if (start!=DGTPICOM_START_RESET && start!=DGTPICOM_START_ATTACH)
+        return ERROR_MEM;
+    startMode=start;
+    return ERROR_OK;
+}
+
+// Select how the receive thread finds new messages.
+int dgtpicom_set_receive_mode(int mode) {
+    if (mode!=DGTPICOM_RX_POLL && mode!=DGTPICOM_RX_ADAPTIVE && mode!=DGTPICOM_RX_EVENT)
+        return ERROR_MEM;
+    receiveMode=mode;
+    return ERROR_OK;
+}
 
 // Get direct access to BCM2708/9 chip.
 int dgtpicom_init() {
-    int memfd;
-    uint32_t base;
-    void *gpio_map, *timer_map, *i2c_slave_map, *i2c_master_map;
+    int i;
+    char *env;
     struct sched_param params;
+    struct timespec start, end;
+
+    // the time source is only known after the backend opened
+    clock_gettime(CLOCK_MONOTONIC, &start);
 
     memset(&dgtRx,0,sizeof(dgtReceive_t));
+    memset(&buttonRing,0,sizeof(buttonRing_t));
+    memset(&timeControl,0,sizeof(timeControl_t));
+    memset(&rxSched,0,sizeof(rxSchedule_t));
+    memset(&clockState,0,sizeof(clockState_t));
+    memset(&displayShadow,0,sizeof(displayShadow_t));
+    memset(&programShadow,0,sizeof(programShadow_t));
+    linkState(0);
+    memset(&commandQueue,0,sizeof(commandQueue_t));
+    memset(ackTable,0,sizeof(ackTable));
+    commandRunning=0;
+    memset(&stats,0,sizeof(dgtpicom_stats_t));
+    memset(&capture,0,sizeof(capture_t));
+    rxSched.interval=RX_POLL_MIN;
+    rxSched.ceiling=RX_POLL_MAX;
     #ifdef debug
     memset(&bug,0,sizeof(debug_t));
     #endif
 
-    piModel = checkPiModel();
-    if (piModel==4)
-        base=0xfe000000;
-    else if (piModel==1)
-        base=0x20000000;
-    else
-        base=0x3f000000;
+    // dgtpicom_replay() chose its backend already
+    env = getenv("DGTPICOM_BACKEND");
+    if (env!=NULL && strcmp(env,"emu")==0 && backend==&dgtBackendHw)
+        backend=&dgtBackendEmu;
 
-    memfd = open("/dev/mem",O_RDWR|O_SYNC);
-    if(memfd < 0) {
+    // virtual time only makes sense on the emulated bus
+    env = getenv("DGTPICOM_CLOCK");
+    if (env!=NULL && strcmp(env,"virtual")==0)
+        clockMode=DGTPICOM_CLOCK_VIRTUAL;
+    if (clockMode==DGTPICOM_CLOCK_VIRTUAL && backend!=&dgtBackendEmu) {
         #ifdef debug
-        printf("/dev/mem open error, run as root\n");
+        printf("Error, virtual time needs the emulator\n");
         #endif
         return ERROR_MEM;
     }
+    dgtClock=clockMode==DGTPICOM_CLOCK_VIRTUAL ? &dgtClockVirtual : &dgtClockReal;
 
-    gpio_map = mmap(NULL, 4096, PROT_READ|PROT_WRITE, MAP_SHARED, memfd, GPIO_BASE+base);
-    timer_map = mmap(NULL, 4096, PROT_READ|PROT_WRITE, MAP_SHARED, memfd, TIMER_BASE+base);
-    i2c_slave_map = mmap(NULL, 4096, PROT_READ|PROT_WRITE, MAP_SHARED, memfd, I2C_SLAVE_BASE+base);
-    i2c_master_map = mmap(NULL, 4096, PROT_READ|PROT_WRITE, MAP_SHARED, memfd, I2C_MASTER_BASE+base);
-
-    close(memfd);
-
-    if( gpio_map == MAP_FAILED || timer_map == MAP_FAILED || i2c_slave_map == MAP_FAILED || i2c_master_map == MAP_FAILED) {
-        #ifdef debug
-        printf("Map failed\n");
-        #endif
-        return ERROR_MEM;
-    }
+    // record the session for dgtpicom_replay()
+    env = getenv("DGTPICOM_RECORD");
+    if (env!=NULL && backend!=&dgtBackendReplay)
+        backend=recordStart(env, backend);
 
-    // GPIO pointers
-    gpio =  (volatile unsigned *)gpio_map;
-    gpioset = gpio + 7;     // set bit register offset 28
-    gpioclr = gpio + 10;    // clr bit register
-    gpioin = gpio + 13;     // read all bits register
+    env = getenv("DGTPICOM_START");
+    if (env!=NULL && strcmp(env,"attach")==0)
+        startMode=DGTPICOM_START_ATTACH;
 
-    // timer pointer
-    timerh = (u_int32_t *)((char *)timer_map + 4);
-    timerl = (u_int32_t *)((char *)timer_map + 8);
+    env = getenv("DGTPICOM_CAPTURE");
+    capturePath[0]=0;
+    if (env!=NULL && strlen(env)<sizeof(capturePath))
+        strcpy(capturePath, env);
 
-    // i2c slave pointers
-    i2cSlave = (volatile unsigned *)i2c_slave_map;
-    i2cSlaveRSR = i2cSlave + 1;
-    i2cSlaveSLV = i2cSlave + 2;
-    i2cSlaveCR = i2cSlave + 3;
-    i2cSlaveFR = i2cSlave + 4;
+    if (backend->open(&piModel))
+        return ERROR_MEM;
 
-    // i2c master pointers
-    i2cMaster = (volatile unsigned *)i2c_master_map;
-    i2cMasterS = i2cMaster + 1;
-    i2cMasterDLEN = i2cMaster + 2;
-    i2cMasterA = i2cMaster + 3;
-    i2cMasterFIFO = i2cMaster + 4;
-    i2cMasterDiv = i2cMaster + 5;
-    i2cMasterDel = i2cMaster + 6;
-
-    // check wiring
-    // configured as an output? probably in use for something else
-    if ((*gpio & 0x1c0) == 0x40) {
-        #ifdef debug
-        printf("Error, GPIO02 configured as output, in use? We asume not a DGTPI\n");
-        #endif
-        return ERROR_LINES;
-    }
-    if ((*gpio & 0xe00) == 0x200) {
-        #ifdef debug
-        printf("Error, GPIO03 configured as output, in use? We asume not a DGTPI\n");
-        #endif
-        return ERROR_LINES;
-    }
-    if  (piModel==4)
-    {
-        if ((*(gpio+1) & 0x07) == 0x01) {
-            #ifdef debug
-            printf("Error, GPIO10 configured as output, in use? We asume not a DGTPI\n");
-            #endif
-            return ERROR_LINES;
-        }
-        if ((*(gpio+1) & 0x38) == 0x08) {
-            #ifdef debug
-            printf("Error, GPIO11 configured as output, in use? We asume not a DGTPI\n");
-            #endif
-            return ERROR_LINES;
-        }
-    }
-    else
-    {
-        if ((*(gpio+1) & 0x07000000) == 0x01000000) {
-            #ifdef debug
-            printf("Error, GPIO18 configured as output, in use? We asume not a DGTPI\n");
-            #endif
-            return ERROR_LINES;
-        }
-        if ((*(gpio+1) & 0x38000000) == 0x08000000) {
-            #ifdef debug
-            printf("Error, GPIO19 configured as output, in use? We asume not a DGTPI\n");
-            #endif
-            return ERROR_LINES;
-        }
-    }
-    // pinmode GPIO2,GPIO3=input
-    *gpio &= 0xfffff03f;
-    if  (piModel==4)
-    {
-        // pinmode GPIO10,GPIO11=input
-        *(gpio+1) &= 0xffffffc0;
-    }
-    else
-    {
-        // pinmode GPIO18,GPIO19=input
-        *(gpio+1) &= 0xc0ffffff;
-    }
-    usleep(1);
-    // all pins hi through pullup?
-    if  (piModel==4)
-    {
-        if ((*gpioin & 0x0c0c)!=0x0c0c) {
-            #ifdef debug
-            printf("Error, pin(s) low, shortcircuit, or no connection?\n");
-            #endif
-            return ERROR_LINES;
-        }
-    }
-    else
-    {
-        if ((*gpioin & 0xc000c)!=0xc000c) {
-            #ifdef debug
-            printf("Error, pin(s) low, shortcircuit, or no connection?\n");
-            #endif
-            return ERROR_LINES;
-        }
+    // a process before us may have left everything set up
+    attached=startMode==DGTPICOM_START_ATTACH && i2cAttach();
+    if (attached) {
+        // most likely still in mode 25, the first command will tell
+        linkState(DGTPICOM_LINK_READY);
+    } else {
+        i=i2cCheckWiring();
+        if (i)
+            return initFail(i);
+        i2cReset();
     }
-    i2cReset();
+    #ifdef debug
+    printf("%s\n", attached ? "Attached to the I2C hardware" : "Reset the I2C hardware");
+    #endif
 
     // set to I2CMaster destination adress
-    *i2cMasterA=8;
+    WR(REG_MST_A, 8);
+
+    // consumers can select/poll on this for clock events
+    if (clockEventFd<0)
+        clockEventFd=eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
 
     dgtRx.on=1;
 
-    pthread_create(&receiveThread, NULL, dgt3000Receive, NULL);
+    dgtClock->spawn();
+    if (pthread_create(&receiveThread, NULL, dgt3000Receive, NULL)) {
+        dgtRx.on=0;
+        return initFail(ERROR_MEM);
+    }
 
     // give thread max priority
     params.sched_priority = sched_get_priority_max(SCHED_FIFO);
     pthread_setschedparam(receiveThread, SCHED_FIFO, &params);
 
+    // the command worker owns the I2C master from now on
+    for (i=0; i<PRIO_COUNT; i++) {
+        commandQueue.head[i]=-1;
+        commandQueue.tail[i]=-1;
+    }
+    commandQueue.display=-1;
+    commandQueue.on=1;
+    dgtClock->spawn();
+    if (pthread_create(&commandThread, NULL, commandWorker, NULL)) {
+        commandQueue.on=0;
+        __atomic_store_n(&dgtRx.on, 0, __ATOMIC_RELEASE);
+        pthread_join(receiveThread, NULL);
+        return initFail(ERROR_MEM);
+    }
+
+    // statistics for monitoring
+    env = getenv("DGTPICOM_STATS_SOCKET");
+    if (env!=NULL && statsSocket<0)
+        statsOpen(env);
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    stats.initTime=(end.tv_sec-start.tv_sec)*1000000 + (end.tv_nsec-start.tv_nsec)/1000;
+    #ifdef debug
+    printf("init took %uus\n", stats.initTime);
+    #endif
+
     return ERROR_OK;
 }
 
-// Configure the dgt3000.
-int dgtpicom_configure() {
-    int e;
+// undo what dgtpicom_init() did after the backend opened
+int initFail(int e) {
+    #ifdef debug
+    printf("init failed %d\n", e);
+    #endif
+    if (clockEventFd>=0)
+        close(clockEventFd);
+    clockEventFd=-1;
+    attached=0;
+    backend->close();
+    return e;
+}
+
+// configure the dgt3000, run by the command worker
+int commandConfigure() {
+    int e = ERROR_DEADLINE;
     int wakeCount = 0;
     int setCCCount = 0;
     int resetCount = 0;
+    int link;
+
+    // nothing to send to a clock that is known to be in mode 25
+    if (linkGet()==DGTPICOM_LINK_READY) {
+        STAT_INC(stats.configureSkipped);
+        return ERROR_OK;
+    }
 
     // get the clock into the right state
     while (1) {
-        // set to mode 25 and run
-        e=dgt3000Mode25();
+        // no time left for another try?
+        if (!commandAfford(COST_MODE25))
+            return e;
+
+        // start where the link state says the clock is, a clock known to
+        // be off is woken and one that just woke up gets central control
+        // without asking for mode 25 first
+        link=linkGet();
+        if ((link&DGTPICOM_LINK_OFF) && wakeCount==0)
+            e=ERROR_SILENT;
+        else if (link==DGTPICOM_LINK_AWAKE && setCCCount==0)
+            e=ERROR_NACK;
+        else
+            // set to mode 25 and run
+            e=dgt3000Mode25();
         if (e==ERROR_NACK || e==ERROR_NOACK) {
             // no postive ack, not in cc
             // set central controll
@@ -373,13 +441,15 @@ int dgtpicom_configure() {
             if (setCCCount>3) {
                 #ifdef debug
                 ERROR_PIN_HI;
-                printf("%.3f ",(float)*timer()/1000000);
+                printf("%.3f ",(float)timer()/1000000);
                 printf("sending setCentralControll failed three times\n\n");
                 ERROR_PIN_LO;
                 #endif
                 return e;
             }
-            usleep(10000);
+            if (!commandAfford(10000 + COST_SET_CC + COST_MODE25))
+                return e;
+            clockSleep(10000);
             dgt3000SetCC();
         } else if (e==ERROR_TIMEOUT) {
             // timeout, line stay low -> reset i2c
@@ -387,7 +457,7 @@ int dgtpicom_configure() {
             if (resetCount>1) {
                 #ifdef debug
                 ERROR_PIN_HI;
-                printf("%.3f ",(float)*timer()/1000000);
+                printf("%.3f ",(float)timer()/1000000);
                 printf("I2C error, remove jack plug\n\n");
                 ERROR_PIN_LO;
                 #endif
@@ -396,7 +466,9 @@ int dgtpicom_configure() {
             i2cReset();
             continue;
         } else if (e==ERROR_CST || e==ERROR_LINES) {
-            // message not acked, probably collision
+            // message not acked, probably collision, give it time to end
+            if (commandDeadline)
+                clockSleep(RETRY_BACKOFF);
             continue;
         } else if (e==ERROR_SILENT) {
             // message not acked, probably clock off -> wake
@@ -406,12 +478,14 @@ int dgtpicom_configure() {
             if (wakeCount>3) {
                 #ifdef debug
                 ERROR_PIN_HI;
-                printf("%.3f ",(float)*timer()/1000000);
+                printf("%.3f ",(float)timer()/1000000);
                 printf("sending wake command failed three times\n");
                 ERROR_PIN_LO;
                 #endif
                 return e;
             }
+            if (!commandAfford(COST_WAKE + COST_MODE25))
+                return e;
             dgt3000Wake();
             continue;
         } else {
@@ -422,35 +496,30 @@ int dgtpicom_configure() {
     return ERROR_OK;
 }
 
-// send set and run command to dgt3000
-int dgtpicom_set_and_run(char lr, char lh, char lm, char ls,
-                         char rr, char rh, char rm, char rs) {
-    int e;
+// send set and run command to dgt3000, run by the command worker
+int commandSetNRun(char srm[]) {
+    int e = ERROR_DEADLINE;
     int sendCount = 0;
 
-    setnrun[4]=lh;
-    setnrun[5]=((lm/10)<<4) | (lm%10);
-    setnrun[6]=((ls/10)<<4) | (ls%10);
-    setnrun[7]=rh;
-    setnrun[8]=((rm/10)<<4) | (rm%10);
-    setnrun[9]=((rs/10)<<4) | (rs%10);
-    setnrun[10]=lr | (rr<<2);
-
-    crc_calc(setnrun);
+    // the clock already runs like this, nothing to send
+    if (clockShadowMatch(srm)) {
+        STAT_INC(stats.setAndRunElided);
+        return ERROR_OK;
+    }
 
     while (1) {
         sendCount++;
-        if (sendCount>3) {
+        if (!commandRetry(e, sendCount, COST_SET_AND_RUN)) {
             #ifdef debug
             ERROR_PIN_HI;
-            printf("%.3f ",(float)*timer()/1000000);
-            printf("sending SetNRun failed three times on error%d\n\n",e);
+            printf("%.3f ",(float)timer()/1000000);
+            printf("sending SetNRun failed %d times on error%d\n\n",sendCount-1,e);
             ERROR_PIN_LO;
             #endif
             return e;
         }
 
-        e=dgt3000SetNRun(setnrun);
+        e=dgt3000SetNRun(srm);
 
         // succes?
         if (e==ERROR_OK)
@@ -458,89 +527,91 @@ int dgtpicom_set_and_run(char lr, char lh, char lm, char ls,
     }
 }
 
-// Send set and run command to the dgt3000 with current clock values.
-int dgtpicom_run(char lr, char rr) {
-    return dgtpicom_set_and_run(
-                lr,
-                dgtRx.time[0],
-                ((dgtRx.time[1]&0xf0)>>4)*10 + (dgtRx.time[1]&0x0f),
-                ((dgtRx.time[2]&0xf0)>>4)*10 + (dgtRx.time[2]&0x0f),
-                rr,
-                dgtRx.time[3],
-                ((dgtRx.time[4]&0xf0)>>4)*10 + (dgtRx.time[4]&0x0f),
-                ((dgtRx.time[5]&0xf0)>>4)*10 + (dgtRx.time[5]&0x0f));
-}
-
-// Set a text message on the DGT3000.
-int dgtpicom_set_text(char text[], char beep, char ld, char rd) {
-    int i,e;
+// set a text message on the DGT3000, run by the command worker
+int commandText(char dm[]) {
+    int e = ERROR_DEADLINE;
     int sendCount = 0;
 
-    for (i=0;i<11;i++) {
-        if(text[i]==0) break;
-        display[i+4]=text[i];
-    }
-
-    for (;i<11;i++) {
-        display[i+4]=32;
+    // already displayed? compare all but the beep (16) and crc, a beep is
+    // always sent
+    if (dm[16]==0 && __atomic_load_n(&displayShadow.state, __ATOMIC_ACQUIRE)==DISPLAY_SHOWING
+            && memcmp(displayShadow.packet, dm, 16)==0
+            && memcmp(displayShadow.packet+17, dm+17, 3)==0) {
+        displayShadow.stats.hits++;
+        return ERROR_OK;
     }
+    displayShadow.stats.misses++;
 
-    display[16]=beep;
-    display[18]=ld;
-    display[19]=rd;
+    // nothing to end when the display is idle
+    if (__atomic_load_n(&displayShadow.state, __ATOMIC_ACQUIRE)==DISPLAY_IDLE) {
+        displayShadow.stats.endDisplaySkipped++;
+    } else {
+        while (1) {
+            // a lever press shouldn't wait for the display
+            commandPreempt();
 
-    crc_calc(display);
+            sendCount++;
+            if (!commandRetry(e, sendCount, COST_END_DISPLAY + COST_DISPLAY)) {
+                #ifdef debug
+                ERROR_PIN_HI;
+                printf("%.3f ",(float)timer()/1000000);
+                printf("sending clear display failed %d times on error%d\n\n",sendCount-1,e);
+                ERROR_PIN_LO;
+                #endif
+                return e;
+            }
 
-    while (1) {
-        sendCount++;
-        if (sendCount>3) {
-            #ifdef debug
-            ERROR_PIN_HI;
-            printf("%.3f ",(float)*timer()/1000000);
-            printf("sending clear display failed three times on error%d\n\n",e);
-            ERROR_PIN_LO;
-            #endif
-            return e;
+            e=dgt3000EndDisplay();
+            // succes?
+            if (e==ERROR_OK)
+                break;
         }
-
-        e=dgt3000EndDisplay();
-        // succes?
-        if (e==ERROR_OK)
-            break;
     }
 
     sendCount=0;
     while (1) {
+        commandPreempt();
+
         sendCount++;
-        if (sendCount>3) {
+        if (!commandRetry(e, sendCount, COST_DISPLAY)) {
             #ifdef debug
             ERROR_PIN_HI;
-            printf("%.3f ",(float)*timer()/1000000);
-            printf("sending display command failed three times on error%d\n\n",e);
+            printf("%.3f ",(float)timer()/1000000);
+            printf("sending display command failed %d times on error%d\n\n",sendCount-1,e);
             ERROR_PIN_LO;
             #endif
             return e;
         }
         // succes?
-        e=dgt3000Display(display);
+        e=dgt3000Display(dm);
         if (e==ERROR_OK)
             break;
+        // display was busy after all, end it first
+        if (e==ERROR_NACK)
+            dgt3000EndDisplay();
     }
     return ERROR_OK;
 }
 
-// End a text message on the DGT3000 an return to clock mode.
-int dgtpicom_end_text() {
-    int e;
+// end a text message on the DGT3000 an return to clock mode, run by the
+// command worker
+int commandEndText() {
+    int e = ERROR_DEADLINE;
     int sendCount = 0;
 
+    // already in clock mode
+    if (__atomic_load_n(&displayShadow.state, __ATOMIC_ACQUIRE)==DISPLAY_IDLE) {
+        displayShadow.stats.endDisplaySkipped++;
+        return ERROR_OK;
+    }
+
     while (1) {
         sendCount++;
-        if (sendCount>3) {
+        if (!commandRetry(e, sendCount, COST_END_DISPLAY)) {
             #ifdef debug
             ERROR_PIN_HI;
-            printf("%.3f ",(float)*timer()/1000000);
-            printf("sending end display failed three times on error%d\n\n",e);
+            printf("%.3f ",(float)timer()/1000000);
+            printf("sending end display failed %d times on error%d\n\n",sendCount-1,e);
             ERROR_PIN_LO;
             #endif
             return e;
@@ -553,108 +624,576 @@ int dgtpicom_end_text() {
     }
 }
 
-// Put the last received time message in time[].
-void dgtpicom_get_time(char time[]) {
-    time[0]=dgtRx.time[0];
-    time[1]=((dgtRx.time[1]&0xf0)>>4)*10 + (dgtRx.time[1]&0x0f);
-    time[2]=((dgtRx.time[2]&0xf0)>>4)*10 + (dgtRx.time[2]&0x0f);
-    time[3]=dgtRx.time[3];
-    time[4]=((dgtRx.time[4]&0xf0)>>4)*10 + (dgtRx.time[4]&0x0f);
-    time[5]=((dgtRx.time[5]&0xf0)>>4)*10 + (dgtRx.time[5]&0x0f);
+// Configure the dgt3000.
+int dgtpicom_configure() {
+    return commandWait(commandSubmit(CMD_CONFIGURE, NULL, 0, 0), -1);
 }
 
-// Get a button message from the buffer returns number of messages in
-// the buffer or recieve error if one occured.
-int dgtpicom_get_button_message(char *buttons, char *time) {
-    int e=dgtRx.error;
-    dgtRx.error=0;
-    if (e<0)
-        return e;
+// Configure the dgt3000 within budget us.
+int dgtpicom_configure_timed(int budget) {
+    return commandTimed(CMD_CONFIGURE, NULL, 0, budget);
+}
 
-    //button availible?
-    if(dgtRx.buttonStart != dgtRx.buttonEnd) {
-        *buttons=dgtRx.buttonPres[dgtRx.buttonStart];
-        *time=dgtRx.buttonTime[dgtRx.buttonStart];
-        dgtRx.buttonStart=(dgtRx.buttonStart+1)%DGTRX_BUTTON_BUFFER_SIZE;
-        return (dgtRx.buttonEnd-dgtRx.buttonStart)%DGTRX_BUTTON_BUFFER_SIZE + 1;
-    } else {
-        return ERROR_OK;
-    }
+// Send set and run command to the dgt3000.
+int dgtpicom_set_and_run(char lr, char lh, char lm, char ls,
+                         char rr, char rh, char rm, char rs) {
+    return commandWait(dgtpicom_set_and_run_async(lr, lh, lm, ls, rr, rh, rm, rs), -1);
 }
 
-// Return the current button state.
-int dgtpicom_get_button_state() {
-    return dgtRx.lastButtonState;
+// Queue a set and run command.
+int dgtpicom_set_and_run_async(char lr, char lh, char lm, char ls,
+                               char rr, char rh, char rm, char rs) {
+    char srm[sizeof(setnrun)];
+
+    // the time control owns the clock
+    if (__atomic_load_n(&timeControl.mode, __ATOMIC_RELAXED)!=DGTPICOM_TC_OFF)
+        return ERROR_ARG;
+    setNRunPacket(srm, lr, lh, lm, ls, rr, rh, rm, rs);
+    return commandSubmit(CMD_SET_AND_RUN, srm, sizeof(srm), 0);
 }
 
-// Turn off the dgt3000.
-int dgtpicom_off(char returnMode) {
-    int e;
+// Send set and run command to the dgt3000 within budget us.
+int dgtpicom_set_and_run_timed(char lr, char lh, char lm, char ls,
+                               char rr, char rh, char rm, char rs, int budget) {
+    char srm[sizeof(setnrun)];
 
-    mode25[4]=32+returnMode;
-    crc_calc(mode25);
+    if (__atomic_load_n(&timeControl.mode, __ATOMIC_RELAXED)!=DGTPICOM_TC_OFF)
+        return ERROR_ARG;
+    setNRunPacket(srm, lr, lh, lm, ls, rr, rh, rm, rs);
+    return commandTimed(CMD_SET_AND_RUN, srm, sizeof(srm), budget);
+}
 
-    mode25[4]=0;
-    crc_calc(mode25);
+// Send set and run command to the dgt3000 with current clock values.
+int dgtpicom_run(char lr, char rr) {
+    return commandWait(dgtpicom_run_async(lr, rr), -1);
+}
 
+// Queue a set and run command with current clock values.
+int dgtpicom_run_async(char lr, char rr) {
+    char t[6];
 
-    // send mode 25 message
-    e=i2cSend(mode25,0x00);
+    dgtpicom_get_time(t);
+    return dgtpicom_set_and_run_async(lr, t[0], t[1], t[2], rr, t[3], t[4], t[5]);
+}
 
-    // send succesful?
-    if (e<0) {
-        #ifdef debug
-        bug.changeStateSF++;
-        #endif
-        return e;
-    }
+// Send set and run command with current clock values within budget us.
+int dgtpicom_run_timed(char lr, char rr, int budget) {
+    char t[6];
 
-    return ERROR_OK;
+    dgtpicom_get_time(t);
+    return dgtpicom_set_and_run_timed(lr, t[0], t[1], t[2], rr, t[3], t[4], t[5], budget);
 }
 
-// Disable the I2C hardware.
-void dgtpicom_stop() {
-    // stop listening to broadcasts
-    *i2cSlaveSLV=16;
+// Send a timing program to the dgt3000.
+int dgtpicom_set_program(char program[], int length) {
+    return commandWait(dgtpicom_set_program_async(program, length), -1);
+}
 
-    // stop thread
-    dgtRx.on=0;
+// Queue a program command.
+int dgtpicom_set_program_async(char program[], int length) {
+    char pm[COMMAND_DATA_LENGTH];
 
-    // wait for thread to finish
-    pthread_join(receiveThread, NULL);
+    if (length<0 || length>DGTPICOM_PROGRAM_LENGTH)
+        return ERROR_ARG;
+    programPacket(pm, program, length);
+    return commandSubmit(CMD_PROGRAM, pm, pm[2], 0);
+}
 
-    // disable i2cSlave device
-    *i2cSlaveCR=0;
+// Get the program the dgt3000 acknowledged last.
+int dgtpicom_get_program(char program[]) {
+    int length;
 
-    // pinmode GPIO2,GPIO3=input
-    *gpio &= 0xfffff03f;
-    if (piModel==4)
-    {
-        // pinmode GPIO10,GPIO11=input
-        *(gpio+1) &= 0xffffffc0;
-    }
-    else
-    {
-        // pinmode GPIO18,GPIO19=input
-        *(gpio+1) &= 0xc0ffffff;
-    }
+    pthread_mutex_lock(&commandMutex);
+    length=__atomic_load_n(&programShadow.length, __ATOMIC_RELAXED);
+    memcpy(program, programShadow.data, length);
+    pthread_mutex_unlock(&commandMutex);
+    return length;
 }
 
-// send a wake command to the dgt3000
-int dgt3000Wake() {
+// Let the receive thread run the time control.
+int dgtpicom_tc_start(int mode, int left, int right, int increment, char toMove) {
+    char srm[TC_SETNRUN_LENGTH];
+    int handle;
+
+    if ((mode!=DGTPICOM_TC_FISCHER && mode!=DGTPICOM_TC_BRONSTEIN)
+            || left<0 || right<0 || increment<0)
+        return ERROR_ARG;
+    if (left>TC_MAX_TIME)
+        left=TC_MAX_TIME;
+    if (right>TC_MAX_TIME)
+        right=TC_MAX_TIME;
+    if (increment>TC_MAX_TIME)
+        increment=TC_MAX_TIME;
+
+    // a lever set and run queued after ours is newer
+    pthread_mutex_lock(&tcMutex);
+    pthread_mutex_lock(&receiveMutex);
+    timeControl.mode=mode;
+    timeControl.time[0]=left*1000;
+    timeControl.time[1]=right*1000;
+    timeControl.increment=increment*1000;
+    timeControl.toMove=toMove ? 1 : 0;
+    timeControl.over=0;
+    timeControl.moveStart=timer();
+    timeControl.posted=0;
+    tcSetAndRun(srm);
+    pthread_mutex_unlock(&receiveMutex);
+    handle=commandSubmit(CMD_SET_AND_RUN, srm, sizeof(srm), 0);
+    pthread_mutex_unlock(&tcMutex);
+
+    return commandWait(handle, -1);
+}
+
+// Stop reacting to the lever.
+void dgtpicom_tc_stop() {
+    pthread_mutex_lock(&receiveMutex);
+    timeControl.mode=DGTPICOM_TC_OFF;
+    pthread_mutex_unlock(&receiveMutex);
+}
+
+// Get a move timed by the time control.
+int dgtpicom_tc_get_move(dgtpicom_tc_move_t *move) {
+    unsigned start, end;
+
+    start=timeControl.start;
+    end=__atomic_load_n(&timeControl.end, __ATOMIC_ACQUIRE);
+    if (start==end)
+        return 0;
+    *move=timeControl.move[start%DGTRX_TC_MOVES];
+    __atomic_store_n(&timeControl.start, start+1, __ATOMIC_RELEASE);
+    return end-start;
+}
+
+// Set a text message on the DGT3000.
+int dgtpicom_set_text(char text[], char beep, char ld, char rd) {
+    return commandWait(dgtpicom_set_text_async(text, beep, ld, rd), -1);
+}
+
+// Queue a text message, replaces a display update that is still queued.
+int dgtpicom_set_text_async(char text[], char beep, char ld, char rd) {
+    char dm[sizeof(display)];
+
+    textPacket(dm, text, beep, ld, rd);
+    return commandSubmit(CMD_TEXT, dm, sizeof(dm), 0);
+}
+
+// Set a text message on the DGT3000 within budget us.
+int dgtpicom_set_text_timed(char text[], char beep, char ld, char rd, int budget) {
+    char dm[sizeof(display)];
+
+    textPacket(dm, text, beep, ld, rd);
+    return commandTimed(CMD_TEXT, dm, sizeof(dm), budget);
+}
+
+// End a text message on the DGT3000 an return to clock mode.
+int dgtpicom_end_text() {
+    return commandWait(dgtpicom_end_text_async(), -1);
+}
+
+// Queue an end text, replaces a display update that is still queued.
+int dgtpicom_end_text_async() {
+    return commandSubmit(CMD_END_TEXT, NULL, 0, 0);
+}
+
+// End a text message on the DGT3000 within budget us.
+int dgtpicom_end_text_timed(int budget) {
+    return commandTimed(CMD_END_TEXT, NULL, 0, budget);
+}
+
+// Wait for a queued command to finish.
+int dgtpicom_wait(int handle, int timeOut) {
+    return commandWait(handle, timeOut);
+}
+
+// Turn off the dgt3000.
+int dgtpicom_off(char returnMode) {
+    return commandWait(commandSubmit(CMD_OFF, &returnMode, 1, 0), -1);
+}
+
+// Put the last received time message in time[].
+void dgtpicom_get_time(char time[]) {
+    dgtpicom_clock_state_t state;
+
+    dgtpicom_get_clock_state(&state);
+    memcpy(time, state.time, 6);
+}
+
+// Get a consistent copy of the last clock state.
+int dgtpicom_get_clock_state(dgtpicom_clock_state_t *state) {
+    unsigned seq, count;
+
+    do {
+        seq=clockStateBegin();
+        count=clockState.count;
+        if (count==0)
+            memset(state, 0, sizeof(dgtpicom_clock_state_t));
+        else
+            *state=clockState.history[(count-1)%DGTRX_TIME_HISTORY_SIZE];
+    } while (clockStateRetry(seq));
+
+    return count;
+}
+
+// Get the clock time now from the anchors of the last time messages.
+int dgtpicom_get_clock_time(dgtpicom_clock_time_t *t) {
+    dgtpicom_clock_state_t state;
+    timeAnchor_t anchor[2];
+    u_int64_t flagFall;
+    unsigned seq, count;
+    int i;
+
+    do {
+        seq=clockStateBegin();
+        count=clockState.count;
+        if (count!=0)
+            state=clockState.history[(count-1)%DGTRX_TIME_HISTORY_SIZE];
+        anchor[0]=clockState.anchor[0];
+        anchor[1]=clockState.anchor[1];
+        flagFall=clockState.flagFall;
+    } while (clockStateRetry(seq));
+
+    memset(t, 0, sizeof(dgtpicom_clock_time_t));
+    if (count==0)
+        return 0;
+
+    t->seq=state.seq;
+    t->at=timer();
+    t->flagFall=flagFall;
+    for (i=0;i<2;i++) {
+        t->time[i]=clockTimeAt(&anchor[i], t->at);
+        t->run[i]=anchor[i].run;
+        t->flag[i]=(i ? state.rightFlag : state.leftFlag)
+                   || (anchor[i].run==1 && t->time[i]==0);
+    }
+    return count;
+}
+
+// Get the time messages received after since.
+int dgtpicom_get_time_history(unsigned since, dgtpicom_clock_state_t states[], int max) {
+    unsigned seq, count, first;
+    int n;
+
+    if (max<=0)
+        return 0;
+
+    do {
+        seq=clockStateBegin();
+        count=clockState.count;
+
+        // oldest we still have, a seq from before init is newer than all
+        first=since;
+        if (first>count)
+            first=count;
+        if (count-first>DGTRX_TIME_HISTORY_SIZE)
+            first=count-DGTRX_TIME_HISTORY_SIZE;
+        if (count-first>(unsigned)max)
+            first=count-max;
+
+        for (n=0; first+n<count; n++)
+            states[n]=clockState.history[(first+n)%DGTRX_TIME_HISTORY_SIZE];
+    } while (clockStateRetry(seq));
+
+    return n;
+}
+
+// Get a button message from the buffer returns number of messages in
+// the buffer or recieve error if one occured.
+int dgtpicom_get_button_message(char *buttons, char *time) {
+    unsigned start, end;
+    int e=__atomic_exchange_n(&dgtRx.error, 0, __ATOMIC_ACQ_REL);
+    if (e<0)
+        return e;
+
+    //button availible?
+    start=buttonRing.start;
+    end=__atomic_load_n(&buttonRing.end, __ATOMIC_ACQUIRE);
+    if(start != end) {
+        *buttons=buttonRing.event[start%DGTRX_BUTTON_BUFFER_SIZE].buttons;
+        *time=buttonRing.event[start%DGTRX_BUTTON_BUFFER_SIZE].time;
+        __atomic_store_n(&buttonRing.start, start+1, __ATOMIC_RELEASE);
+        return end-start;
+    } else {
+        return ERROR_OK;
+    }
+}
+
+// Wait for a button message.
+int dgtpicom_wait_button_message(char *buttons, char *time, int timeOut) {
+    int e, seq;
+    u_int64_t now, end=0;
+
+    if (timeOut>0)
+        end=timer()+timeOut;
+
+    __atomic_add_fetch(&buttonRing.waiters, 1, __ATOMIC_SEQ_CST);
+    while (1) {
+        seq=__atomic_load_n(&buttonRing.seq, __ATOMIC_SEQ_CST);
+        e=dgtpicom_get_button_message(buttons, time);
+        if (e!=0 || timeOut==0)
+            break;
+        // nothing will arrive any more
+        if (!__atomic_load_n(&dgtRx.on, __ATOMIC_ACQUIRE)) {
+            e=ERROR_MEM;
+            break;
+        }
+        if (timeOut<0) {
+            futexWait(&buttonRing.seq, seq, -1);
+        } else {
+            now=timer();
+            if (now>=end)
+                break;
+            futexWait(&buttonRing.seq, seq, end-now);
+        }
+    }
+    __atomic_sub_fetch(&buttonRing.waiters, 1, __ATOMIC_SEQ_CST);
+    return e;
+}
+
+// Get display cache statistics.
+void dgtpicom_get_display_stats(dgtpicom_display_stats_t *stats) {
+    *stats=displayShadow.stats;
+    stats->coalesced=commandQueue.coalesced;
+    stats->preempted=commandQueue.preempted;
+}
+
+// Get a file descriptor that is readable when there are clock events.
+int dgtpicom_get_event_fd() {
+    return clockEventFd;
+}
+
+// Get receive thread statistics.
+void dgtpicom_get_rx_stats(dgtpicom_rx_stats_t *rxStats) {
+    clockid_t clock;
+    struct timespec t;
+
+    rxStats->overruns=__atomic_load_n(&stats.rxOverruns, __ATOMIC_RELAXED);
+    rxStats->maxFifoLevel=rxSched.maxFifo;
+    if (receiveMode==DGTPICOM_RX_POLL) {
+        rxStats->pollInterval=RX_POLL_INTERVAL;
+        rxStats->avgPollInterval=RX_POLL_INTERVAL;
+        rxStats->polls=0;
+        rxStats->pollTime=0;
+    } else {
+        rxStats->pollInterval=receiveMode==DGTPICOM_RX_EVENT ? 0 : rxSched.interval;
+        rxStats->avgPollInterval=rxSched.polls ? rxSched.sleepTotal/rxSched.polls : 0;
+        rxStats->polls=rxSched.polls;
+        rxStats->pollTime=rxSched.sleepTotal;
+    }
+
+    // thread cpu clock, only while the thread runs
+    rxStats->cpuTime=0;
+    if (dgtRx.on && pthread_getcpuclockid(receiveThread, &clock)==0
+            && clock_gettime(clock, &t)==0)
+        rxStats->cpuTime=(long long)t.tv_sec*1000000+t.tv_nsec/1000;
+}
+
+// Replay a recorded session against a stand-in for the I2C hardware.
+int dgtpicom_replay(const char *path, dgtpicom_replay_report_t *r) {
+    char data[COMMAND_DATA_LENGTH];
+    int handle[PRIO_COUNT];
+    unsigned latency[DGTPICOM_STATS_BUCKETS];
+    dgtpicom_stats_t s;
+    int i, j, type, length, e;
+    unsigned total, n;
+    u_int64_t start;
+    const dgtBackend_t *chosen=backend;
+
+    memset(r,0,sizeof(dgtpicom_replay_report_t));
+    if (replayLoad(path))
+        return ERROR_MEM;
+    backend=&dgtBackendReplay;
+    e=dgtpicom_init();
+    if (e) {
+        backend=chosen;
+        return e;
+    }
+
+    // queue the commands when the recording reaches them
+    start=timer();
+    for (i=0; i<PRIO_COUNT; i++)
+        handle[i]=0;
+    while ((length=replayNextCommand(&type, data))>=0) {
+        e=commandSubmit(type, data, length, 0);
+        if (e>0)
+            handle[commandPriority(type)]=e;
+        r->commands++;
+    }
+    for (i=0; i<PRIO_COUNT; i++)
+        if (handle[i]>0)
+            dgtpicom_wait(handle[i], -1);
+    r->duration=timer()-start;
+
+    dgtpicom_get_stats(&s);
+    replayCounts(&r->unmatched, &r->skipped);
+    dgtpicom_stop();
+    // a later dgtpicom_init() uses the backend of before
+    backend=chosen;
+
+    memset(latency,0,sizeof(latency));
+    for (i=0; i<DGTPICOM_STATS_COMMANDS; i++) {
+        for (j=1; j<DGTPICOM_STATS_ERRORS; j++)
+            r->failed+=s.command[i].results[j];
+        r->retries+=s.command[i].retries;
+        for (j=0; j<DGTPICOM_STATS_BUCKETS; j++)
+            latency[j]+=s.command[i].latency[j];
+    }
+    for (total=0, j=0; j<DGTPICOM_STATS_BUCKETS; j++)
+        total+=latency[j];
+    for (n=0, j=0; j<DGTPICOM_STATS_BUCKETS; j++) {
+        n+=latency[j];
+        if (r->latencyP50==0 && n*2>=total && total)
+            r->latencyP50=(1<<j)-1;
+        if (r->latencyP99==0 && n*100>=total*99 && total)
+            r->latencyP99=(1<<j)-1;
+    }
+    r->rxPackets=s.rxPackets;
+    r->rxErrors=s.rxTimeouts+s.rxTooLarge+s.rxWrongAdr+s.rxBufferFull
+            +s.rxSizeMismatch+s.rxCRCFaults;
+    return ERROR_OK;
+}
+
+// Get statistics of commands, messages and receive errors.
+void dgtpicom_get_stats(dgtpicom_stats_t *s) {
+    unsigned *from=(unsigned *)&stats, *to=(unsigned *)s;
+    unsigned i;
+
+    // counters are not taken at one moment, one may be ahead of another
+    for (i=0; i<sizeof(dgtpicom_stats_t)/sizeof(unsigned); i++)
+        to[i]=__atomic_load_n(&from[i], __ATOMIC_RELAXED);
+}
+
+// Return the current button state.
+int dgtpicom_get_button_state() {
+    return dgtRx.lastButtonState;
+}
+
+// Return what we know about the clock.
+int dgtpicom_get_link_state() {
+    return linkGet();
+}
+
+// send a program to the dgt3000, run by the command worker
+int commandProgram(char pm[]) {
+    int e = ERROR_DEADLINE;
+    int sendCount = 0;
+
+    while (1) {
+        sendCount++;
+        if (!commandRetry(e, sendCount, COST_PROGRAM)) {
+            #ifdef debug
+            ERROR_PIN_HI;
+            printf("%.3f ",(float)timer()/1000000);
+            printf("sending Program failed %d times on error%d\n\n",sendCount-1,e);
+            ERROR_PIN_LO;
+            #endif
+            return e;
+        }
+
+        e=dgt3000Program(pm);
+
+        // succes?
+        if (e==ERROR_OK) {
+            pthread_mutex_lock(&commandMutex);
+            memcpy(programShadow.data, pm+4, pm[2]-5);
+            __atomic_store_n(&programShadow.length, pm[2]-5, __ATOMIC_RELAXED);
+            pthread_mutex_unlock(&commandMutex);
+            return ERROR_OK;
+        }
+    }
+}
+
+// turn off the dgt3000, run by the command worker
+int commandOff(char returnMode) {
+    int e;
+
+    mode25[4]=32+returnMode;
+    crc_calc(mode25);
+
+    mode25[4]=0;
+    crc_calc(mode25);
+
+    displayState(DISPLAY_UNKNOWN);
+
+    // send mode 25 message
+    e=i2cSend(mode25,0x00);
+
+    // send succesful?
+    if (e<0) {
+        return e;
+    }
+
+    linkState(DGTPICOM_LINK_OFF);
+    return ERROR_OK;
+}
+
+// Disable the I2C hardware.
+void dgtpicom_stop() {
+    // send what is still queued and stop the command worker
+    pthread_mutex_lock(&commandMutex);
+    commandQueue.on=0;
+    commandKick();
+    pthread_mutex_unlock(&commandMutex);
+    pthread_join(commandThread, NULL);
+
+    statsClose();
+
+    // stop listening to broadcasts
+    WR(REG_SLV_SLV, 16);
+
+    // stop thread
+    __atomic_store_n(&dgtRx.on, 0, __ATOMIC_RELEASE);
+
+    // wait for thread to finish
+    pthread_join(receiveThread, NULL);
+
+    // wake the readers still waiting for a button
+    buttonNotify();
+
+    if (clockEventFd>=0)
+        close(clockEventFd);
+    clockEventFd=-1;
+    attached=0;
+
+    // leave it all set up for the process that takes over
+    if (startMode==DGTPICOM_START_ATTACH) {
+        backend->close();
+        return;
+    }
+
+    // disable i2cSlave device
+    WR(REG_SLV_CR, 0);
+
+    // pinmode GPIO2,GPIO3=input
+    WR(REG_GPFSEL0, RD(REG_GPFSEL0) & 0xfffff03f);
+    if (piModel==4)
+    {
+        // pinmode GPIO10,GPIO11=input
+        WR(REG_GPFSEL1, RD(REG_GPFSEL1) & 0xffffffc0);
+    }
+    else
+    {
+        // pinmode GPIO18,GPIO19=input
+        WR(REG_GPFSEL1, RD(REG_GPFSEL1) & 0xc0ffffff);
+    }
+
+    backend->close();
+}
+
+// send a wake command to the dgt3000
+int dgt3000Wake() {
     int e;
     u_int64_t t;
 
     // send wake
-    *i2cMasterA=40;
+    WR(REG_MST_A, 40);
     e=i2cSend(ping,0x00);
-    *i2cMasterA=8;
+    WR(REG_MST_A, 8);
 
     // succes? -> error. Wake messages should never get an Ack
     if (e==ERROR_OK) {
         #ifdef debug
         ERROR_PIN_HI;
-        printf("%.3f ",(float)*timer()/1000000);
+        printf("%.3f ",(float)timer()/1000000);
         printf("sending wake command failed, received Ack, this should never hapen\n");
         ERROR_PIN_LO;
         #endif
@@ -662,16 +1201,16 @@ int dgt3000Wake() {
     }
 
     // Get Hello message (in max 10ms, usualy 5ms)
-    t=*timer()+10000;
-    while (*timer()<t) {
+    t=timer()+commandBudget(10000);
+    while (timer()<t) {
         if (dgtRx.hello==1)
             return ERROR_OK;
-        usleep(100);
+        clockSleep(100);
     }
 
     #ifdef debug
     ERROR_PIN_HI;
-    printf("%.3f ",(float)*timer()/1000000);
+    printf("%.3f ",(float)timer()/1000000);
     printf("sending wake command failed, no hello\n");
     ERROR_PIN_LO;
     #endif
@@ -682,6 +1221,7 @@ int dgt3000Wake() {
 // send set central controll command to dgt3000
 int dgt3000SetCC() {
     int e;
+    char status;
 
     // send setCC, error? retry
     e=i2cSend(centralControll,0x10);
@@ -690,8 +1230,7 @@ int dgt3000SetCC() {
     if (e<0) {
         #ifdef debug
         ERROR_PIN_HI;
-        bug.setCCSF++;
-        printf("%.3f ",(float)*timer()/1000000);
+        printf("%.3f ",(float)timer()/1000000);
         printf("sending SetCentralControll command failed, sending failed\n");
         ERROR_PIN_LO;
         #endif
@@ -700,14 +1239,13 @@ int dgt3000SetCC() {
 
     // listen to our own adress and get Reply
 
-    e=dgt3000GetAck(0x10,0x0f,10000);
+    e=dgt3000GetAck(0x10,0x0f,commandBudget(10000),&status);
 
     // ack received?
     if (e<0) {
         #ifdef debug
         ERROR_PIN_HI;
-        bug.setCCAF++;
-        printf("%.3f ",(float)*timer()/1000000);
+        printf("%.3f ",(float)timer()/1000000);
         printf("sending SetCentralControll command failed, no ack\n");
         ERROR_PIN_LO;
         #endif
@@ -715,12 +1253,15 @@ int dgt3000SetCC() {
     }
 
     // is positive ack?
-    if ((dgtRx.ack[1]&8) == 8)
+    if ((status&8) == 8) {
+        linkAdd(DGTPICOM_LINK_AWAKE | DGTPICOM_LINK_CC);
         return ERROR_OK;
+    }
+    linkState(DGTPICOM_LINK_AWAKE);
 
     #ifdef debug
     ERROR_PIN_HI;
-    printf("%.3f ",(float)*timer()/1000000);
+    printf("%.3f ",(float)timer()/1000000);
     printf("sending SetCentralControll command failed, negative ack, clock running\n");
     ERROR_PIN_LO;
     #endif
@@ -732,6 +1273,7 @@ int dgt3000SetCC() {
 // send set mode 25 to dgt3000
 int dgt3000Mode25() {
     int e;
+    char status;
 
     mode25[4]=57;
     crc_calc(mode25);
@@ -743,8 +1285,7 @@ int dgt3000Mode25() {
     if (e<0) {
         #ifdef debug
         ERROR_PIN_HI;
-        bug.changeStateSF++;
-        printf("%.3f ",(float)*timer()/1000000);
+        printf("%.3f ",(float)timer()/1000000);
         printf("sending mode25 command failed, sending failed\n");
         ERROR_PIN_LO;
         #endif
@@ -752,25 +1293,28 @@ int dgt3000Mode25() {
     }
 
     // listen to our own adress an get Reply
-    e=dgt3000GetAck(0x10,0x0b,10000);
+    e=dgt3000GetAck(0x10,0x0b,commandBudget(10000),&status);
 
     // ack received?
     if (e<0) {
         #ifdef debug
         ERROR_PIN_HI;
-        bug.changeStateAF++;
-        printf("%.3f ",(float)*timer()/1000000);
+        printf("%.3f ",(float)timer()/1000000);
         printf("sending mode25 command failed, no ack\n");
         ERROR_PIN_LO;
         #endif
         return e;
     }
 
-    if (dgtRx.ack[1]==8) return ERROR_OK;
+    if (status==8) {
+        linkState(DGTPICOM_LINK_READY);
+        return ERROR_OK;
+    }
+    linkState(DGTPICOM_LINK_AWAKE);
 
     #ifdef debug
     ERROR_PIN_HI;
-    printf("%.3f ",(float)*timer()/1000000);
+    printf("%.3f ",(float)timer()/1000000);
     printf("sending mode25 command failed, negative ack, not in Central Controll\n");
     ERROR_PIN_LO;
     #endif
@@ -779,9 +1323,58 @@ int dgt3000Mode25() {
     return ERROR_NACK;
 }
 
+// send a program to dgt3000
+int dgt3000Program(char pm[]) {
+    int e;
+    char status;
+
+    e=i2cSend(pm,0x10);
+
+    // send succesful?
+    if (e<0) {
+        #ifdef debug
+        ERROR_PIN_HI;
+        printf("%.3f ",(float)timer()/1000000);
+        printf("sending Program command failed, sending failed\n");
+        ERROR_PIN_LO;
+        #endif
+        return e;
+    }
+
+    // listen to our own adress an get Reply
+    e=dgt3000GetAck(0x10,0x09,commandBudget(10000),&status);
+
+    // ack received?
+    if (e<0) {
+        #ifdef debug
+        ERROR_PIN_HI;
+        printf("%.3f ",(float)timer()/1000000);
+        printf("sending Program command failed, no ack\n");
+        ERROR_PIN_LO;
+        #endif
+        return e;
+    }
+
+    // Positive Ack?
+    if (status==8)
+        return ERROR_OK;
+
+    #ifdef debug
+    ERROR_PIN_HI;
+    printf("%.3f ",(float)timer()/1000000);
+    printf("sending Program command failed, not in central control\n");
+    ERROR_PIN_LO;
+    #endif
+    return ERROR_NACK;
+}
+
 // send end display to dgt3000 to clear te display
 int dgt3000EndDisplay() {
     int e;
+    char status;
+
+    // until acked we don't know what the clock shows
+    displayState(DISPLAY_UNKNOWN);
 
     // send end Display
     e=i2cSend(endDisplay,0x10);
@@ -790,8 +1383,7 @@ int dgt3000EndDisplay() {
     if (e<0) {
         #ifdef debug
         ERROR_PIN_HI;
-        bug.endDisplaySF++;
-        printf("%.3f ",(float)*timer()/1000000);
+        printf("%.3f ",(float)timer()/1000000);
         printf("sending end display command failed, sending failed\n");
         ERROR_PIN_LO;
         #endif
@@ -799,17 +1391,18 @@ int dgt3000EndDisplay() {
     }
 
     // get fast Reply = already empty
-    e=dgt3000GetAck(0x10,0x07,1200);
+    e=dgt3000GetAck(0x10,0x07,commandBudget(1200),&status);
 
     // display already empty
     if (e==ERROR_OK) {
-        if ((dgtRx.ack[1]&0x07) == 0x05) {
+        if ((status&0x07) == 0x05) {
+            displayState(DISPLAY_IDLE);
             return ERROR_OK;
         } else {
             #ifdef debug
             ERROR_PIN_HI;
-            printf("%.3f ",(float)*timer()/1000000);
-            printf("sending end display command failed, negative specific ack:%02x\n",dgtRx.ack[1]);
+            printf("%.3f ",(float)timer()/1000000);
+            printf("sending end display command failed, negative specific ack:%02x\n",status);
             ERROR_PIN_LO;
             #endif
             return ERROR_NACK;
@@ -817,14 +1410,13 @@ int dgt3000EndDisplay() {
     }
 
     //get slow broadcast Reply = display changed
-    e=dgt3000GetAck(0x00,0x07,10000);
+    e=dgt3000GetAck(0x00,0x07,commandBudget(10000),&status);
 
     // ack received?
     if (e<0) {
         #ifdef debug
         ERROR_PIN_HI;
-        bug.endDisplayAF++;
-        printf("%.3f ",(float)*timer()/1000000);
+        printf("%.3f ",(float)timer()/1000000);
         printf("sending end display command failed, no ack\n");
         ERROR_PIN_LO;
         #endif
@@ -832,13 +1424,15 @@ int dgt3000EndDisplay() {
     }
 
     // display emptied
-    if ((dgtRx.ack[1]&0x07) == 0x00)
+    if ((status&0x07) == 0x00) {
+        displayState(DISPLAY_IDLE);
         return ERROR_OK;
+    }
 
     #ifdef debug
     ERROR_PIN_HI;
-    printf("%.3f ",(float)*timer()/1000000);
-    printf("sending end display command failed, negative broadcast ack:%02x\n",dgtRx.ack[1]);
+    printf("%.3f ",(float)timer()/1000000);
+    printf("sending end display command failed, negative broadcast ack:%02x\n",status);
     ERROR_PIN_LO;
     #endif
 
@@ -848,6 +1442,9 @@ int dgt3000EndDisplay() {
 // send display command to dgt3000
 int dgt3000Display(char dm[]) {
     int e;
+    char status;
+
+    displayState(DISPLAY_UNKNOWN);
 
     // send the message
     e=i2cSend(dm,0x00);
@@ -856,8 +1453,7 @@ int dgt3000Display(char dm[]) {
     if (e<0) {
         #ifdef debug
         ERROR_PIN_HI;
-        bug.displaySF++;
-        printf("%.3f ",(float)*timer()/1000000);
+        printf("%.3f ",(float)timer()/1000000);
         printf("sending display command failed, sending failed\n");
         ERROR_PIN_LO;
         #endif
@@ -865,14 +1461,13 @@ int dgt3000Display(char dm[]) {
     }
 
     // get (broadcast) reply
-    e=dgt3000GetAck(0x00,0x06,10000);
+    e=dgt3000GetAck(0x00,0x06,commandBudget(10000),&status);
 
     // no reply
     if (e<0) {
         #ifdef debug
         ERROR_PIN_HI;
-        bug.displayAF++;
-        printf("%.3f ",(float)*timer()/1000000);
+        printf("%.3f ",(float)timer()/1000000);
         printf("sending display command failed, no ack\n");
         ERROR_PIN_LO;
         #endif
@@ -880,31 +1475,35 @@ int dgt3000Display(char dm[]) {
     }
 
     // nack, already displaying message
-    if ((dgtRx.ack[1]&0xf3)==0x23) {
+    if ((status&0xf3)==0x23) {
         #ifdef debug
         ERROR_PIN_HI;
-        printf("%.3f ",(float)*timer()/1000000);
+        printf("%.3f ",(float)timer()/1000000);
         printf("sending display command failed, display already busy\n");
         ERROR_PIN_LO;
         #endif
         return ERROR_NACK;
     }
 
+    memcpy(displayShadow.packet, dm, dm[2]);
+    displayState(DISPLAY_SHOWING);
     return ERROR_OK;
 }
 
 // send set and run command to dgt3000
 int dgt3000SetNRun(char srm[]) {
     int e;
+    char status;
 
+    // time messages don't show it until it is acked
+    __atomic_store_n(&clockState.shadowFrom, UINT_MAX, __ATOMIC_RELAXED);
     e=i2cSend(srm,0x10);
 
     // send succesful?
     if (e<0) {
         #ifdef debug
         ERROR_PIN_HI;
-        bug.setNRunSF++;
-        printf("%.3f ",(float)*timer()/1000000);
+        printf("%.3f ",(float)timer()/1000000);
         printf("sending SetNRun command failed, sending failed\n");
         ERROR_PIN_LO;
         #endif
@@ -912,14 +1511,13 @@ int dgt3000SetNRun(char srm[]) {
     }
 
     // listen to our own adress an get Reply
-    e=dgt3000GetAck(0x10,0x0a,10000);
+    e=dgt3000GetAck(0x10,0x0a,commandBudget(10000),&status);
 
     // ack received?
     if (e<0) {
         #ifdef debug
         ERROR_PIN_HI;
-        bug.setNRunAF++;
-        printf("%.3f ",(float)*timer()/1000000);
+        printf("%.3f ",(float)timer()/1000000);
         printf("sending SetNRun command failed, no ack\n");
         ERROR_PIN_LO;
         #endif
@@ -927,13 +1525,16 @@ int dgt3000SetNRun(char srm[]) {
     }
 
     // Positive Ack?
-    if (dgtRx.ack[1]==8)
+    if (status==8) {
+        linkAdd(DGTPICOM_LINK_READY);
         return ERROR_OK;
+    }
 
     // nack
+    __atomic_fetch_and(&linkShadow, ~DGTPICOM_LINK_MODE25, __ATOMIC_RELEASE);
     #ifdef debug
     ERROR_PIN_HI;
-    printf("%.3f ",(float)*timer()/1000000);
+    printf("%.3f ",(float)timer()/1000000);
     printf("sending SetNRun command failed, not in mode 25\n");
     ERROR_PIN_LO;
     #endif
@@ -943,7 +1544,7 @@ int dgt3000SetNRun(char srm[]) {
 // check for messages from dgt3000
 void *dgt3000Receive(void *a) {
     char rm[RECEIVE_BUFFER_LENGTH];
-    int e;
+    int e, fr, active;
     #ifdef debug2
     int i;
     #endif
@@ -953,12 +1554,23 @@ void *dgt3000Receive(void *a) {
     #endif
 
     dgtRx.buttonRepeatTime = 0;
+    dgtRx.flagTime = 0;
 
     while (dgtRx.on) {
+        active = 0;
         pthread_mutex_lock(&receiveMutex);
-        if ( (*i2cSlaveFR&0x20) != 0 || (*i2cSlaveFR&2) == 0 ) {
+        fr = RD(REG_SLV_FR);
+        if ( (fr&0x20) != 0 || (fr&2) == 0 ) {
+            active = 1;
+            rxFifoLevel((fr&0xf800)>>11);
 
             e=i2cReceive(rm);
+            if (e!=0) {
+                // an error returns no length, keep what was read
+                captureAdd(CAPTURE_RX, rm[0]>>1, e>0 ? 0 : e, rm, e>0 ? e : rxLength);
+                if (e<0)
+                    captureError();
+            }
 
             #ifdef debug2
             if (e>0) {
@@ -973,28 +1585,35 @@ void *dgt3000Receive(void *a) {
             #endif
 
             if (e>0) {
+                STAT_INC(stats.rxPackets);
                 switch (rm[3]) {
                     case 1:     // ack
-                        dgtRx.ack[0]=rm[4];
-                        dgtRx.ack[1]=rm[5];
-                        pthread_cond_signal(&receiveCond);
+                        // the clock runs the set and run from now on
+                        if (rm[4]==0x0a)
+                            __atomic_store_n(&clockState.shadowFrom, clockState.count, __ATOMIC_RELAXED);
+                        ackArrived(rm[0]>>1, rm[4], rm[5]);
                         #ifdef debug2
                         printf("= Ack %s\n",packetDescriptor[rm[4]-1]);
                         #endif
                         break;
                     case 2:     // hello
                         dgtRx.hello=1;
+                        displayState(DISPLAY_UNKNOWN);
+                        // a restarted clock has no program
+                        __atomic_store_n(&programShadow.length, 0, __ATOMIC_RELAXED);
+                        // just woke up, not in central control
+                        linkState(DGTPICOM_LINK_AWAKE);
                         #ifdef debug2
                         printf("= Hello\n");
                         #endif
                         break;
                     case 4:     // time
-                        dgtRx.time[0]=rm[5]&0x0f;
-                        dgtRx.time[1]=rm[6];
-                        dgtRx.time[2]=rm[7];
-                        dgtRx.time[3]=rm[11]&0x0f;
-                        dgtRx.time[4]=rm[12];
-                        dgtRx.time[5]=rm[13];
+                        clockStatePublish(rm);
+                        dgtRx.flagTime = clockState.flagFall;
+                        tcFlag(rm);
+                        // only sent in mode 25
+                        if (linkGet()!=DGTPICOM_LINK_READY)
+                            linkState(DGTPICOM_LINK_READY);
                         // store (initial) lever state
                         if ((rm[19]&1) == 1)
                             dgtRx.lastButtonState |= 0x40;
@@ -1003,55 +1622,47 @@ void *dgt3000Receive(void *a) {
                         #ifdef debug2
                         printf("= Time: %02x:%02x.%02x %02x:%02x.%02x\n",rm[5]&0xf,rm[6],rm[7],rm[11]&0xf,rm[12],rm[13]);
                         #endif
-                        if (rm[20]==1) ; // no update
+                        clockEventSignal();
                         break;
                     case 5:     // button
                         // new button pressed
                         if (rm[4]&0x1f) {
                             dgtRx.buttonState |= rm[4]&0x1f;
                             dgtRx.lastButtonState = rm[4];
-                            dgtRx.buttonRepeatTime = *timer() + DGTPICOM_KEY_DELAY;
+                            dgtRx.buttonRepeatTime = timer() + DGTPICOM_KEY_DELAY;
                             dgtRx.buttonCount = 0;
 
                             // buffer full?
-                            if ((dgtRx.buttonEnd+1)%DGTRX_BUTTON_BUFFER_SIZE == dgtRx.buttonStart) {
+                            if (buttonPush(dgtRx.buttonState, dgtRx.buttonCount)) {
                                 #ifdef debug
-                                printf("%.3f ",(float)*timer()/1000000);
+                                printf("%.3f ",(float)timer()/1000000);
                                 printf("Button buffer full, buttons ignored\n");
                                 #endif
-                            } else {
-                                dgtRx.buttonPres[dgtRx.buttonEnd] = dgtRx.buttonState;
-                                dgtRx.buttonTime[dgtRx.buttonEnd] = dgtRx.buttonCount;
-                                dgtRx.buttonEnd = (dgtRx.buttonEnd+1)%DGTRX_BUTTON_BUFFER_SIZE;
                             }
                         }
                         // turned off/on
                         if((rm[4]&0x20) != (rm[5]&0x20)) {
+                            displayState(DISPLAY_UNKNOWN);
+                            linkState(rm[4]&0x20 ? DGTPICOM_LINK_OFF : DGTPICOM_LINK_AWAKE);
+                            __atomic_store_n(&programShadow.length, 0, __ATOMIC_RELAXED);
                             // buffer full?
-                            if ((dgtRx.buttonEnd+1)%DGTRX_BUTTON_BUFFER_SIZE == dgtRx.buttonStart) {
+                            if (buttonPush(0x20 | ((rm[5]&0x20)<<2), 0)) {
                                 #ifdef debug
-                                printf("%.3f ",(float)*timer()/1000000);
+                                printf("%.3f ",(float)timer()/1000000);
                                 printf("Button buffer full, on/off ignored\n");
                                 #endif
-                            } else {
-                                dgtRx.buttonPres[dgtRx.buttonEnd] = 0x20 | ((rm[5]&0x20)<<2);
-                                dgtRx.buttonTime[dgtRx.buttonEnd] = 0;
-                                dgtRx.buttonEnd = (dgtRx.buttonEnd+1)%DGTRX_BUTTON_BUFFER_SIZE;
                             }
                         }
 
                         // lever change?
                         if((rm[4]&0x40) != (rm[5]&0x40)) {
+                            tcLever(rm[4]&0x40 ? 1 : 0);
                             // buffer full?
-                            if ((dgtRx.buttonEnd+1)%DGTRX_BUTTON_BUFFER_SIZE == dgtRx.buttonStart) {
+                            if (buttonPush(0x40 | ((rm[4]&0x40)<<1), 0)) {
                                 #ifdef debug
-                                printf("%.3f ",(float)*timer()/1000000);
+                                printf("%.3f ",(float)timer()/1000000);
                                 printf("Button buffer full, lever change ignored\n");
                                 #endif
-                            } else {
-                                dgtRx.buttonPres[dgtRx.buttonEnd] = 0x40 | ((rm[4]&0x40)<<1);
-                                dgtRx.buttonTime[dgtRx.buttonEnd] = 0;
-                                dgtRx.buttonEnd = (dgtRx.buttonEnd+1)%DGTRX_BUTTON_BUFFER_SIZE;
                             }
                         }
 
@@ -1067,7 +1678,7 @@ void *dgt3000Receive(void *a) {
                         #ifdef debug
                     default:
                         ERROR_PIN_HI;
-                        printf("%.3f ",(float)*timer()/1000000);
+                        printf("%.3f ",(float)timer()/1000000);
                         printf("Receive Error: Unknown message from clock\n");
                         ERROR_PIN_LO;
                         #endif
@@ -1076,34 +1687,42 @@ void *dgt3000Receive(void *a) {
                 #ifdef debug2
                 printf(" = Error: %d\n",e);
                 #endif
-                dgtRx.error=e;
+                __atomic_store_n(&dgtRx.error, e, __ATOMIC_RELEASE);
+                buttonNotify();
             }
         } else {
-            if (dgtRx.buttonRepeatTime != 0 && dgtRx.buttonRepeatTime < *timer()) {
+            // the ack we listen for is lost, the clock can't reach us
+            // on the broadcast adress until we listen to it again
+            if (RD(REG_SLV_SLV) != 0 && ackListen() == 0)
+                WR(REG_SLV_SLV, 0x00);
+
+            if (dgtRx.buttonRepeatTime != 0 && dgtRx.buttonRepeatTime < timer()) {
                 dgtRx.buttonRepeatTime += DGTPICOM_KEY_REPEAT;
                 dgtRx.buttonCount++;
 
                 // buffer full?
-                if ((dgtRx.buttonEnd+1)%DGTRX_BUTTON_BUFFER_SIZE == dgtRx.buttonStart) {
+                if (buttonPush(dgtRx.buttonState, dgtRx.buttonCount)) {
                     #ifdef debug
-                    printf("%.3f ",(float)*timer()/1000000);
+                    printf("%.3f ",(float)timer()/1000000);
                     printf("Button buffer full, repeated buttons ignored\n");
                     #endif
-                } else {
-                    dgtRx.buttonPres[dgtRx.buttonEnd] = dgtRx.buttonState;
-                    dgtRx.buttonTime[dgtRx.buttonEnd] = dgtRx.buttonCount;
-                    dgtRx.buttonEnd = (dgtRx.buttonEnd+1)%DGTRX_BUTTON_BUFFER_SIZE;
                 }
             }
+
+            // the clock tells us a bit later, the flag falls now
+            if (dgtRx.flagTime != 0 && dgtRx.flagTime <= timer()) {
+                dgtRx.flagTime = 0;
+                clockEventSignal();
+            }
             #ifdef debug
             RECEIVE_THREAD_RUNNING_PIN_LO;
-            usleep(400);
+            clockSleep(400);
             RECEIVE_THREAD_RUNNING_PIN_HI;
             #endif
 
         }
         pthread_mutex_unlock(&receiveMutex);
-        usleep(400);
+        rxWait(active);
     }
     #ifdef debug
     RECEIVE_THREAD_RUNNING_PIN_LO;
@@ -1112,65 +1731,909 @@ void *dgt3000Receive(void *a) {
     return ERROR_OK;
 }
 
-// wait for an Ack message
-int dgt3000GetAck(char adr, char cmd, u_int64_t timeOut) {
-    struct timespec receiveTimeOut;
+// adapt the poll ceiling to the fifo level found when we got to it
+void rxFifoLevel(int level) {
+    if (level>rxSched.maxFifo)
+        rxSched.maxFifo=level;
+    rxSched.level=level;
+
+    // too late, bytes piled up
+    if (level>=RX_FIFO_TARGET) {
+        rxSched.ceiling=rxSched.ceiling*3/4;
+        if (rxSched.ceiling<RX_POLL_MIN)
+            rxSched.ceiling=RX_POLL_MIN;
+    } else if (rxSched.ceiling<RX_POLL_MAX) {
+        rxSched.ceiling+=RX_POLL_MIN/5;
+    }
+}
 
-    pthread_mutex_lock(&receiveMutex);
+// sleep until the bus is active or a button needs repeating
+void rxWait(int active) {
+    u_int64_t timeOut = RX_IDLE_TIMEOUT;
+    u_int64_t now = timer();
 
-    // listen to given adress
-    *i2cSlaveSLV=adr;
+    if (dgtRx.buttonRepeatTime != 0) {
+        if (dgtRx.buttonRepeatTime <= now)
+            return;
+        if (dgtRx.buttonRepeatTime - now < timeOut)
+            timeOut = dgtRx.buttonRepeatTime - now;
+    }
+    if (dgtRx.flagTime != 0) {
+        if (dgtRx.flagTime <= now)
+            return;
+        if (dgtRx.flagTime - now < timeOut)
+            timeOut = dgtRx.flagTime - now;
+    }
 
-    // check until timeout
-    timeOut+=*timer();
-    receiveTimeOut.tv_sec=timeOut/1000000;
-    receiveTimeOut.tv_nsec=timeOut%1000000;
+    if (receiveMode == DGTPICOM_RX_EVENT) {
+        if (backend->wait(timeOut) >= 0)
+            return;
 
-    while (*timer()<timeOut) {
-        if (dgtRx.ack[0]==cmd) {
-            pthread_mutex_unlock(&receiveMutex);
-            return ERROR_OK;
-        }
-        pthread_cond_timedwait(&receiveCond, &receiveMutex, &receiveTimeOut);
+        // no bus events from this backend, poll from now on
+        #ifdef debug
+        printf("%.3f ",(float)timer()/1000000);
+        printf("No bus events available, adaptive polling\n");
+        #endif
+        receiveMode = DGTPICOM_RX_ADAPTIVE;
     }
 
-    // listen for broadcast again
-    *i2cSlaveSLV=0x00;
-    pthread_mutex_unlock(&receiveMutex);
+    if (receiveMode == DGTPICOM_RX_POLL) {
+        clockSleep(RX_POLL_INTERVAL);
+        return;
+    }
 
-    if (dgtRx.ack[0]==cmd)
-        return ERROR_OK;
-    else
-        return ERROR_NOACK;
+    // the fifo fills up, come back fast whatever else is going on
+    if (rxSched.level >= RX_FIFO_TARGET) {
+        rxSched.interval=RX_POLL_MIN;
+    } else if (active || now < rxSched.burstUntil) {
+        // traffic, more may follow and a reply may be due
+        if (active)
+            rxSched.burstUntil=now+RX_BURST_TIME;
+        rxSched.interval=rxSched.ceiling<RX_POLL_INTERVAL ? rxSched.ceiling : RX_POLL_INTERVAL;
+    } else {
+        rxSched.interval*=2;
+        if (rxSched.interval>rxSched.ceiling)
+            rxSched.interval=rxSched.ceiling;
+    }
+    if (rxSched.interval>timeOut)
+        rxSched.interval=timeOut;
+    rxSched.level=0;
+
+    rxSched.polls++;
+    rxSched.sleepTotal+=rxSched.interval;
+    clockSleep(rxSched.interval);
 }
 
-// send message using I2CMaster
-int i2cSend(char message[], char ackAdr) {
-    int i, n;
-    u_int64_t timeOut;
+// put a button message in the ring, only called by the receive thread
+int buttonPush(char buttons, char time) {
+    unsigned end=buttonRing.end;
 
-    // set length
-    *i2cMasterDLEN = message[2]-1;
+    if (end-__atomic_load_n(&buttonRing.start, __ATOMIC_ACQUIRE) >= DGTRX_BUTTON_BUFFER_SIZE)
+        return ERROR_SWB_FULL;
 
-    // clear buffer
-    *i2cMaster = 0x10;
+    buttonRing.event[end%DGTRX_BUTTON_BUFFER_SIZE].buttons=buttons;
+    buttonRing.event[end%DGTRX_BUTTON_BUFFER_SIZE].time=time;
+    __atomic_store_n(&buttonRing.end, end+1, __ATOMIC_RELEASE);
+    buttonNotify();
+    return ERROR_OK;
+}
 
-    #ifdef debug2
-    printf("-> %02x ", message[0]);
+// wake a reader waiting for buttons or errors
+void buttonNotify() {
+    __atomic_add_fetch(&buttonRing.seq, 1, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&buttonRing.waiters, __ATOMIC_SEQ_CST))
+        futexWake(&buttonRing.seq);
+    clockEventSignal();
+}
+
+// make the clock event fd readable, it is non blocking so a consumer
+// that never reads it can't stall the receive thread
+void clockEventSignal() {
+    u_int64_t one=1;
+
+    if (clockEventFd<0)
+        return;
+    if (write(clockEventFd, &one, sizeof(one)) < 0) {
+        // counter full, still readable
+    }
+}
+
+// set what we know about the display
+void displayState(char state) {
+    __atomic_store_n(&displayShadow.state, state, __ATOMIC_RELEASE);
+}
+
+// set what we know about the link to the clock
+void linkState(int state) {
+    __atomic_store_n(&linkShadow, state, __ATOMIC_RELEASE);
+}
+
+// add to what we know about the link
+void linkAdd(int bits) {
+    __atomic_fetch_and(&linkShadow, ~DGTPICOM_LINK_OFF, __ATOMIC_RELAXED);
+    __atomic_fetch_or(&linkShadow, bits, __ATOMIC_RELEASE);
+}
+
+// what we know about the link to the clock
+int linkGet() {
+    return __atomic_load_n(&linkShadow, __ATOMIC_ACQUIRE);
+}
+
+// decode a time message into the next history slot, only called by the
+// receive thread
+void clockStatePublish(char rm[]) {
+    dgtpicom_clock_state_t *state;
+    timeAnchor_t *a;
+    u_int64_t fall;
+    unsigned count=clockState.count;
+    int i;
+
+    // odd, readers retry until we're done
+    __atomic_store_n(&clockState.seq, clockState.seq+1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+
+    state=&clockState.history[count%DGTRX_TIME_HISTORY_SIZE];
+    state->seq=count+1;
+    state->timestamp=timer();
+    state->time[0]=rm[5]&0x0f;
+    state->time[1]=((rm[6]&0xf0)>>4)*10 + (rm[6]&0x0f);
+    state->time[2]=((rm[7]&0xf0)>>4)*10 + (rm[7]&0x0f);
+    state->time[3]=rm[11]&0x0f;
+    state->time[4]=((rm[12]&0xf0)>>4)*10 + (rm[12]&0x0f);
+    state->time[5]=((rm[13]&0xf0)>>4)*10 + (rm[13]&0x0f);
+    state->lever=rm[19]&1;
+    state->leftRun=(rm[19]>>1)&3;
+    state->rightRun=(rm[19]>>3)&3;
+    state->noUpdate=rm[20]&1;
+    state->leftFlag=(rm[20]>>1)&1;
+    state->rightFlag=(rm[20]>>2)&1;
+    clockState.count=count+1;
+
+    clockAnchor(0, state);
+    clockAnchor(1, state);
+    // the first side counting down to 0
+    clockState.flagFall=0;
+    for (i=0;i<2;i++) {
+        a=&clockState.anchor[i];
+        if (a->run!=1 || (i ? state->rightFlag : state->leftFlag))
+            continue;
+        fall=a->at+(u_int64_t)a->shown*1000;
+        if (clockState.flagFall==0 || fall<clockState.flagFall)
+            clockState.flagFall=fall;
+    }
+
+    __atomic_store_n(&clockState.seq, clockState.seq+1, __ATOMIC_RELEASE);
+}
+
+// a side's second starts where it shows a new time or starts to run,
+// time messages in between keep its phase
+void clockAnchor(int side, dgtpicom_clock_state_t *state) {
+    timeAnchor_t *a=&clockState.anchor[side];
+    char *time=&state->time[side*3];
+    char run=side ? state->rightRun : state->leftRun;
+    int shown=((time[0]*60 + time[1])*60 + time[2])*1000;
+
+    if (state->seq==1 || a->shown!=shown || a->run!=run) {
+        a->shown=shown;
+        a->run=run;
+        a->at=state->timestamp;
+    }
+}
+
+// time a side shows now, at most a second from what the clock showed so
+// a lost time message doesn't run away with it
+int clockTimeAt(timeAnchor_t *a, u_int64_t now) {
+    int elapsed;
+
+    if (now<=a->at)
+        return a->shown;
+    elapsed=now-a->at>=1000000 ? 1000 : (now-a->at)/1000;
+    if (a->run==1)
+        return a->shown>elapsed ? a->shown-elapsed : 0;
+    if (a->run==2)
+        return a->shown+elapsed;
+    return a->shown;
+}
+
+// is the clock already stopped like the set and run says
+int clockShadowMatch(char srm[]) {
+    dgtpicom_clock_state_t s;
+    char now[sizeof(setnrun)];
+
+    // not sure it is in mode 25, or ours are still on their way
+    if (linkGet()!=DGTPICOM_LINK_READY)
+        return 0;
+    if (dgtpicom_get_clock_state(&s)==0
+            || s.seq<=__atomic_load_n(&clockState.shadowFrom, __ATOMIC_RELAXED))
+        return 0;
+    // a set and run also lifts the flags
+    if (s.leftFlag || s.rightFlag)
+        return 0;
+    // a running side can be anywhere in the second the message shows,
+    // only sending it puts the side at the start of that second
+    if (s.leftRun || s.rightRun)
+        return 0;
+
+    setNRunPacket(now, s.leftRun, s.time[0], s.time[1], s.time[2],
+                  s.rightRun, s.time[3], s.time[4], s.time[5]);
+    return memcmp(now+4, srm+4, 7)==0;
+}
+
+// the side to move pressed the lever, it stops and the other side runs
+void tcLever(int rightDown) {
+    dgtpicom_tc_move_t *m;
+    u_int64_t now=timer();
+    int used, t, side=rightDown;
+    unsigned end=timeControl.end;
+
+    if (timeControl.mode==DGTPICOM_TC_OFF || timeControl.over
+            || side!=timeControl.toMove)
+        return;
+
+    used=(now-timeControl.moveStart)/1000;
+    // the clock shows whole seconds rounded up, it decides about the flag
+    t=timeControl.time[side]-used;
+    if (t<0)
+        t=0;
+    if (timeControl.mode==DGTPICOM_TC_FISCHER)
+        t+=timeControl.increment;
+    else if (timeControl.mode==DGTPICOM_TC_BRONSTEIN)
+        t+=used<timeControl.increment ? used : timeControl.increment;
+    if (t>TC_MAX_TIME*1000)
+        t=TC_MAX_TIME*1000;
+    // whole seconds like the clock, rounding up every move would add up
+    t=(t+500)/1000*1000;
+
+    timeControl.time[side]=t;
+    timeControl.toMove=!side;
+    timeControl.moveStart=now;
+
+    // the worker queues it, queueing here would wait for commandMutex
+    tcSetAndRun(timeControl.post);
+    __atomic_store_n(&timeControl.posted, 1, __ATOMIC_RELAXED);
+    commandKick();
+
+    // a reader that fell behind loses the oldest
+    if (end-__atomic_load_n(&timeControl.start, __ATOMIC_ACQUIRE) >= DGTRX_TC_MOVES) {
+        #ifdef debug
+        printf("%.3f ",(float)timer()/1000000);
+        printf("Move buffer full, move not reported\n");
+        #endif
+        return;
+    }
+    m=&timeControl.move[end%DGTRX_TC_MOVES];
+    m->side=side;
+    m->moveTime=used;
+    m->time[0]=timeControl.time[0];
+    m->time[1]=timeControl.time[1];
+    m->at=now;
+    __atomic_store_n(&timeControl.end, end+1, __ATOMIC_RELEASE);
+    clockEventSignal();
+}
+
+// a flag after our last set and run ends the game
+void tcFlag(char rm[]) {
+    if (timeControl.mode==DGTPICOM_TC_OFF || (rm[20]&6)==0
+            || clockState.count<=__atomic_load_n(&clockState.shadowFrom, __ATOMIC_RELAXED))
+        return;
+    timeControl.over=1;
+    timeControl.time[(rm[20]&2) ? 0 : 1]=0;
+}
+
+// the side to move counts down, the other one waits
+void tcSetAndRun(char srm[]) {
+    int s[2], i;
+
+    for (i=0;i<2;i++)
+        s[i]=timeControl.time[i]/1000;
+    setNRunPacket(srm, timeControl.toMove==0, s[0]/3600, s[0]/60%60, s[0]%60,
+                  timeControl.toMove==1, s[1]/3600, s[1]/60%60, s[1]%60);
+}
+
+// queue the set and run of the last lever press
+void tcQueue() {
+    char srm[TC_SETNRUN_LENGTH];
+    int posted;
+
+    // in the order they were made, without the receive thread waiting
+    pthread_mutex_lock(&tcMutex);
+    pthread_mutex_lock(&receiveMutex);
+    posted=timeControl.posted;
+    if (posted) {
+        timeControl.posted=0;
+        memcpy(srm, timeControl.post, TC_SETNRUN_LENGTH);
+    }
+    pthread_mutex_unlock(&receiveMutex);
+    if (posted && commandSubmit(CMD_SET_AND_RUN, srm, TC_SETNRUN_LENGTH, 0)<0) {
+        #ifdef debug
+        printf("%.3f ",(float)timer()/1000000);
+        printf("Time control set and run not queued\n");
+        #endif
+    }
+    pthread_mutex_unlock(&tcMutex);
+}
+
+// start reading the clock state, wait for a write in progress
+unsigned clockStateBegin() {
+    unsigned seq;
+
+    while ((seq=__atomic_load_n(&clockState.seq, __ATOMIC_ACQUIRE)) & 1)
+        sched_yield();
+    return seq;
+}
+
+// did the receive thread write while we copied?
+int clockStateRetry(unsigned seq) {
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    return __atomic_load_n(&clockState.seq, __ATOMIC_RELAXED) != seq;
+}
+
+// queue a command for the worker
+int commandSubmit(int type, char data[], int length, u_int64_t deadline) {
+    command_t *c;
+    int i, prio, slot=-1;
+
+    pthread_mutex_lock(&commandMutex);
+    if (!commandQueue.on) {
+        pthread_mutex_unlock(&commandMutex);
+        return ERROR_MEM;
+    }
+    recordCommand(type, data, length);
+
+    // latest wins, a display update that did not reach the bus yet is
+    // replaced and its caller gets the result of the new one
+    if ((type==CMD_TEXT || type==CMD_END_TEXT) && commandQueue.display>=0) {
+        slot=commandQueue.display;
+        c=&commandQueue.cmd[slot];
+        c->type=type;
+        c->deadline=deadline;
+        c->queued=timer();
+        if (length)
+            memcpy(c->data, data, length);
+        commandQueue.coalesced++;
+        pthread_mutex_unlock(&commandMutex);
+        return c->gen*COMMAND_QUEUE_SIZE + slot + 1;
+    }
+
+    // free slot or the oldest finished one
+    for (i=0; i<COMMAND_QUEUE_SIZE; i++) {
+        c=&commandQueue.cmd[i];
+        if (c->state==CMD_FREE) {
+            slot=i;
+            break;
+        }
+        if (c->state==CMD_DONE && (slot<0 || c->ticket<commandQueue.cmd[slot].ticket))
+            slot=i;
+    }
+    if (slot<0) {
+        pthread_mutex_unlock(&commandMutex);
+        return ERROR_SWB_FULL;
+    }
+
+    c=&commandQueue.cmd[slot];
+    c->type=type;
+    c->deadline=deadline;
+    c->queued=timer();
+    if (length)
+        memcpy(c->data, data, length);
+    c->gen=c->gen%COMMAND_GEN_MAX + 1;
+    c->ticket=commandQueue.tickets++;
+    c->next=-1;
+    __atomic_store_n(&c->state, CMD_QUEUED, __ATOMIC_RELEASE);
+
+    // append to the queue of its class
+    prio=commandPriority(type);
+    if (commandQueue.tail[prio]<0)
+        commandQueue.head[prio]=slot;
+    else
+        commandQueue.cmd[commandQueue.tail[prio]].next=slot;
+    commandQueue.tail[prio]=slot;
+    if (type==CMD_TEXT || type==CMD_END_TEXT)
+        commandQueue.display=slot;
+
+    commandKick();
+    pthread_mutex_unlock(&commandMutex);
+
+    return c->gen*COMMAND_QUEUE_SIZE + slot + 1;
+}
+
+// wait for a command to finish
+int commandWait(int handle, int timeOut) {
+    command_t *c;
+    int state, e;
+    u_int64_t now, end=0;
+
+    // submit failed
+    if (handle<=0)
+        return handle;
+
+    c=&commandQueue.cmd[(handle-1)%COMMAND_QUEUE_SIZE];
+    if (timeOut>0)
+        end=timer()+timeOut;
+
+    while (1) {
+        pthread_mutex_lock(&commandMutex);
+        if (c->gen != (handle-1)/COMMAND_QUEUE_SIZE) {
+            // slot reused, the result is gone
+            pthread_mutex_unlock(&commandMutex);
+            return ERROR_SWB_FULL;
+        }
+        state=c->state;
+        e=c->result;
+        pthread_mutex_unlock(&commandMutex);
+
+        if (state==CMD_DONE)
+            return e;
+        if (timeOut==0)
+            return DGTPICOM_PENDING;
+        if (timeOut<0) {
+            futexWait(&c->state, state, -1);
+        } else {
+            now=timer();
+            if (now>=end)
+                return DGTPICOM_PENDING;
+            futexWait(&c->state, state, end-now);
+        }
+    }
+}
+
+// queue a command with a deadline budget us from now and wait for it
+int commandTimed(int type, char data[], int length, int budget) {
+    int e;
+
+    if (budget<=0)
+        return ERROR_DEADLINE;
+
+    e=commandWait(commandSubmit(type, data, length, timer()+budget), budget);
+    if (e==DGTPICOM_PENDING)
+        return ERROR_DEADLINE;
+    return e;
+}
+
+// send the queued commands one by one, owns the I2C master
+void *commandWorker(void *a) {
+    int kick, recording;
+
+    pthread_mutex_lock(&commandMutex);
+    while (1) {
+        // a kick from now on ends the sleep below
+        kick=__atomic_load_n(&commandQueue.kick, __ATOMIC_ACQUIRE);
+
+        // a lever press the receive thread answered
+        if (__atomic_load_n(&timeControl.posted, __ATOMIC_RELAXED)) {
+            pthread_mutex_unlock(&commandMutex);
+            tcQueue();
+            pthread_mutex_lock(&commandMutex);
+        }
+
+        // file io is slow, only between commands
+        if (__atomic_load_n(&capture.errorPending, __ATOMIC_ACQUIRE)) {
+            __atomic_store_n(&capture.errorPending, 0, __ATOMIC_RELAXED);
+            pthread_mutex_unlock(&commandMutex);
+            captureWrite(capturePath);
+            pthread_mutex_lock(&commandMutex);
+        }
+        if (recordPending()>RECORD_BUFFER_SIZE/4) {
+            pthread_mutex_unlock(&commandMutex);
+            recordFlush();
+            pthread_mutex_lock(&commandMutex);
+        }
+        if (commandRunNext(PRIO_COUNT))
+            continue;
+        if (!commandQueue.on)
+            break;
+        // on the library clock, so virtual time knows the worker sleeps
+        pthread_mutex_unlock(&commandMutex);
+        recording=recordFlush();
+        futexWait(&commandQueue.kick, kick, recording ? RECORD_FLUSH_INTERVAL : -1);
+        pthread_mutex_lock(&commandMutex);
+    }
+    pthread_mutex_unlock(&commandMutex);
+
+    return NULL;
+}
+
+// wake the command worker, the receive thread does so without a lock
+void commandKick() {
+    __atomic_fetch_add(&commandQueue.kick, 1, __ATOMIC_RELEASE);
+    futexWake(&commandQueue.kick);
+}
+
+// run the first command of the highest class below classes, called with
+// commandMutex locked
+int commandRunNext(int classes) {
+    command_t *c;
+    char data[COMMAND_DATA_LENGTH];
+    int prio, slot=-1, type, running, e;
+    unsigned sent;
+    u_int64_t deadline;
+
+    for (prio=0; prio<classes; prio++) {
+        slot=commandQueue.head[prio];
+        if (slot>=0)
+            break;
+    }
+    if (slot<0)
+        return 0;
+
+    // take it from the queue, from now on it can't be replaced
+    commandTake(prio);
+    c=&commandQueue.cmd[slot];
+    type=c->type;
+    memcpy(data, c->data, COMMAND_DATA_LENGTH);
+    pthread_mutex_unlock(&commandMutex);
+
+    // a preempting command has its own deadline
+    deadline=commandDeadline;
+    commandDeadline=c->deadline;
+    running=commandRunning;
+    commandRunning=type;
+    sent=commandSent;
+    commandSent=0;
+    e=commandRun(type, data);
+
+    pthread_mutex_lock(&commandMutex);
+    commandDone(slot, e);
+    pthread_mutex_unlock(&commandMutex);
+
+    commandRunning=running;
+    commandSent=sent;
+    commandDeadline=deadline;
+
+    pthread_mutex_lock(&commandMutex);
+    return 1;
+}
+
+// take the first command of a class from the queue
+int commandTake(int prio) {
+    int slot=commandQueue.head[prio];
+    command_t *c=&commandQueue.cmd[slot];
+
+    commandQueue.head[prio]=c->next;
+    if (commandQueue.head[prio]<0)
+        commandQueue.tail[prio]=-1;
+    if (commandQueue.display==slot)
+        commandQueue.display=-1;
+    __atomic_store_n(&c->state, CMD_BUSY, __ATOMIC_RELEASE);
+    return slot;
+}
+
+// store the result of a command and wake its waiters
+void commandDone(int slot, int result) {
+    command_t *c=&commandQueue.cmd[slot];
+    dgtpicom_command_stats_t *s=&stats.command[c->type-1];
+
+    STAT_INC(s->done);
+    if (result<=0 && result>-DGTPICOM_STATS_ERRORS)
+        STAT_INC(s->results[-result]);
+    STAT_INC(s->latency[statsBucket(timer()-c->queued)]);
+    if (result<0 && captureDue())
+        __atomic_store_n(&capture.errorPending, 1, __ATOMIC_RELEASE);
+
+    c->result=result;
+    __atomic_store_n(&c->state, CMD_DONE, __ATOMIC_RELEASE);
+    futexWake(&c->state);
+}
+
+// let queued clock commands go first, called by the worker between the
+// steps of a display command
+void commandPreempt() {
+    // a lever press during the display command is queued first
+    if (__atomic_load_n(&timeControl.posted, __ATOMIC_RELAXED))
+        tcQueue();
+    pthread_mutex_lock(&commandMutex);
+    while (commandRunNext(PRIO_CLOCK+1))
+        commandQueue.preempted++;
+    pthread_mutex_unlock(&commandMutex);
+}
+
+// is there time for something that takes cost us?
+int commandAfford(u_int64_t cost) {
+    return commandDeadline==0 || timer()+cost <= commandDeadline;
+}
+
+// limit a wait to what is left of the budget
+u_int64_t commandBudget(u_int64_t timeOut) {
+    u_int64_t now;
+
+    if (commandDeadline==0)
+        return timeOut;
+    now=timer();
+    if (now>=commandDeadline)
+        return 0;
+    if (commandDeadline-now<timeOut)
+        return commandDeadline-now;
+    return timeOut;
+}
+
+// decide if a command should be tried (again) after error e, backs off
+// after a collision. Without a deadline a command is tried three times,
+// with one as long as the budget allows.
+int commandRetry(int e, int tries, u_int64_t cost) {
+    u_int64_t backoff=0;
+
+    if (commandDeadline==0)
+        return tries<=3;
+
+    if (tries>1) {
+        switch (e) {
+            case ERROR_TIMEOUT:
+                // hardware fault, needs a reset first
+                return 0;
+            case ERROR_SILENT:
+                // probably off, one more try in case of noise
+                if (tries>2)
+                    return 0;
+                break;
+            case ERROR_CST:
+            case ERROR_LINES:
+                // collision, let the clock finish its message
+                backoff=RETRY_BACKOFF*(tries-1);
+                break;
+            default:
+                // lost or negative ack, try again right away
+                break;
+        }
+    }
+
+    if (!commandAfford(backoff+cost))
+        return 0;
+    if (backoff)
+        clockSleep(backoff);
+    return 1;
+}
+
+// priority class of a command
+int commandPriority(int type) {
+    switch (type) {
+        case CMD_CONFIGURE:
+        case CMD_SET_AND_RUN:
+        case CMD_PROGRAM:
+            return PRIO_CLOCK;
+        case CMD_TEXT:
+        case CMD_END_TEXT:
+            return PRIO_DISPLAY;
+    }
+    return PRIO_HOUSEKEEPING;
+}
+
+// the first command after attaching, the clock is probably still in
+// mode 25 from the run before. Configure sends nothing, when another
+// command finds the clock is not, configure for real and try again
+int commandAttached(int type, char data[]) {
+    int e;
+
+    if (type==CMD_CONFIGURE)
+        return ERROR_OK;
+    attached=0;
+    e=commandRun(type, data);
+    if (e!=ERROR_NACK && e!=ERROR_NOACK && e!=ERROR_SILENT)
+        return e;
+    #ifdef debug
+    printf("%.3f ",(float)timer()/1000000);
+    printf("attached clock is not in mode 25, configuring\n");
+    #endif
+    e=commandConfigure();
+    if (e<0)
+        return e;
+    return commandRun(type, data);
+}
+
+// run one command on the bus
+int commandRun(int type, char data[]) {
+    int e=ERROR_NACK;
+
+    if (attached)
+        return commandAttached(type, data);
+    switch (type) {
+        case CMD_CONFIGURE:
+            e=commandConfigure();
+            break;
+        case CMD_SET_AND_RUN:
+            e=commandSetNRun(data);
+            break;
+        case CMD_TEXT:
+            e=commandText(data);
+            break;
+        case CMD_END_TEXT:
+            e=commandEndText();
+            break;
+        case CMD_OFF:
+            e=commandOff(data[0]);
+            break;
+        case CMD_PROGRAM:
+            e=commandProgram(data);
+            break;
+    }
+
+    // a clock that did not answer at all may be in any state now
+    if (e==ERROR_SILENT || e==ERROR_NOACK || e==ERROR_TIMEOUT)
+        linkState(0);
+    return e;
+}
+
+// wait for an Ack message
+int dgt3000GetAck(char adr, char cmd, u_int64_t timeOut, char *status) {
+    ackWaiter_t *w=ackFind(cmd);
+    dgtpicom_message_stats_t *s=statsMessage(cmd);
+    u_int64_t start=timer();
+    unsigned ticket;
+    int e;
+
+    if (w==NULL)
+        return ERROR_NOACK;
+
+    pthread_mutex_lock(&receiveMutex);
+    // the ack of the last send
+    ticket=w->sent;
+    // listen to given adress
+    WR(REG_SLV_SLV, adr);
+    __atomic_store_n(&w->adr, adr, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&receiveMutex);
+
+    if (ticket==0)
+        return ERROR_NOACK;
+
+    e=ackWait(w, ticket, timeOut, status);
+
+    if (e<0) {
+        // listen for broadcast again
+        pthread_mutex_lock(&receiveMutex);
+        WR(REG_SLV_SLV, ackListen());
+        pthread_mutex_unlock(&receiveMutex);
+    }
+
+    if (s!=NULL) {
+        if (e==ERROR_OK) {
+            STAT_INC(s->acked);
+            STAT_INC(s->ackTime[statsBucket(timer()-start)]);
+        } else {
+            STAT_INC(s->noAck);
+        }
+    }
+    return e;
+}
+
+// sleep until the ack of a ticket arrived
+int ackWait(ackWaiter_t *w, unsigned ticket, u_int64_t timeOut, char *status) {
+    u_int64_t now;
+    int seq;
+
+    timeOut+=timer();
+    while (1) {
+        seq=__atomic_load_n(&w->seq, __ATOMIC_ACQUIRE);
+        if ((int)(__atomic_load_n(&w->arrived, __ATOMIC_ACQUIRE)-ticket)>=0) {
+            *status=w->status[(ticket-1)%ACK_DEPTH];
+            return ERROR_OK;
+        }
+        now=timer();
+        if (now>=timeOut)
+            return ERROR_NOACK;
+        futexWait(&w->seq, seq, timeOut-now);
+    }
+}
+
+// take a ticket for the ack of a command that is sent
+unsigned ackExpect(char adr, char cmd) {
+    ackWaiter_t *w=ackFind(cmd);
+    u_int64_t now=timer();
+    int i;
+
+    if (w==NULL) {
+        for (i=0; i<ACK_WAITERS; i++)
+            if (ackTable[i].cmd==0) {
+                w=&ackTable[i];
+                break;
+            }
+        if (w==NULL)
+            return 0;
+    }
+
+    // acks that did not come by now are lost, don't count on them
+    if (now>w->until)
+        __atomic_store_n(&w->arrived, w->sent, __ATOMIC_RELEASE);
+
+    w->until=now+ACK_OUTSTANDING;
+    __atomic_store_n(&w->adr, adr, __ATOMIC_RELEASE);
+    __atomic_store_n(&w->cmd, cmd, __ATOMIC_RELEASE);
+    return __atomic_add_fetch(&w->sent, 1, __ATOMIC_RELEASE);
+}
+
+// find the waiter for a command
+ackWaiter_t *ackFind(char cmd) {
+    int i;
+
+    for (i=0; i<ACK_WAITERS; i++)
+        if (__atomic_load_n(&ackTable[i].cmd, __ATOMIC_ACQUIRE)==cmd)
+            return &ackTable[i];
+    return NULL;
+}
+
+// adress the slave should listen to
+char ackListen() {
+    u_int64_t now=timer();
+    int i;
+
+    for (i=0; i<ACK_WAITERS; i++)
+        if (ackTable[i].cmd && ackTable[i].adr
+                && ackTable[i].arrived!=ackTable[i].sent && now<ackTable[i].until)
+            return ackTable[i].adr;
+    return 0x00;
+}
+
+// hand an ack to its waiter, called by the receive thread
+void ackArrived(char adr, char cmd, char status) {
+    ackWaiter_t *w=ackFind(cmd);
+
+    if (w==NULL || __atomic_load_n(&w->adr, __ATOMIC_ACQUIRE)!=adr
+            || w->arrived==w->sent) {
+        #ifdef debug
+        printf("%.3f ",(float)timer()/1000000);
+        printf("Ack for %02x on %02x nobody waits for\n",cmd,adr);
+        #endif
+        return;
+    }
+
+    w->status[w->arrived%ACK_DEPTH]=status;
+    __atomic_add_fetch(&w->arrived, 1, __ATOMIC_RELEASE);
+    __atomic_add_fetch(&w->seq, 1, __ATOMIC_RELEASE);
+    futexWake(&w->seq);
+
+    WR(REG_SLV_SLV, ackListen());
+}
+
+// send message using I2CMaster and count it
+int i2cSend(char message[], char ackAdr) {
+    dgtpicom_message_stats_t *s=statsMessage(message[3]);
+    u_int64_t start=timer();
+    int e;
+
+    // the same message again for a command is a retry
+    if (commandRunning>0 && message[3]<32) {
+        if (commandSent & 1u<<message[3])
+            STAT_INC(stats.command[commandRunning-1].retries);
+        commandSent |= 1u<<message[3];
+    }
+
+    e=i2cTransmit(message, ackAdr);
+    captureAdd(CAPTURE_TX, message[0]>>1, e, message, message[2]);
+
+    if (s!=NULL) {
+        STAT_INC(s->sent);
+        if (e<0 && e>-DGTPICOM_STATS_ERRORS)
+            STAT_INC(s->sendErrors[-e]);
+        STAT_INC(s->sendTime[statsBucket(timer()-start)]);
+    }
+    return e;
+}
+
+// send message using I2CMaster
+int i2cTransmit(char message[], char ackAdr) {
+    int i, n;
+    u_int64_t timeOut;
+
+    // set length
+    WR(REG_MST_DLEN, message[2]-1);
+
+    // clear buffer
+    WR(REG_MST_C, 0x10);
+
+    #ifdef debug2
+    printf("-> %02x ", message[0]);
     #endif
 
     // fill the buffer
-    for (n=1;n<message[2] && *i2cMasterS&0x10;n++) {
+    for (n=1;n<message[2] && RD(REG_MST_S)&0x10;n++) {
         #ifdef debug2
         printf("%02x ", message[n]);
         if(n == message[2]-1)
             printf("= %s\n",packetDescriptor[message[3]-1]);
         #endif
-        *i2cMasterFIFO=message[n];
+        WR(REG_MST_FIFO, message[n]);
     }
 
     // check 256 times if the bus is free. At least for 50us because the clock will send waiting messages 50 us after the previeus one.
-    timeOut=*timer() + 10000;   // bus should be free in 10ms
+    timeOut=timer() + 10000;   // bus should be free in 10ms
     #ifdef debug
     WAIT_FOR_FREE_BUS_PIN_HI;
     #endif
@@ -1179,21 +2642,21 @@ int i2cSend(char message[], char ackAdr) {
         if ((SCL1IN==0) || (SDA1IN==0)) {
             i=0;
         }
-        if ( ((*i2cSlaveFR&0x20)!=0) || ((*i2cSlaveFR&2)==0) ) {
+        if ( ((RD(REG_SLV_FR)&0x20)!=0) || ((RD(REG_SLV_FR)&2)==0) ) {
             i=0;
         }
         // timeout waiting for bus free, I2C Error (or someone pushes 500 buttons/seccond)
-        if (*timer()>timeOut) {
+        if (timer()>timeOut) {
             #ifdef debug
-            printf("%.3f ",(float)*timer()/1000000);
+            printf("%.3f ",(float)timer()/1000000);
             printf("    Send error: Bus free timeout, waited more then 10ms for bus to be free\n");
             if(SCL1IN==0)
                 printf("                SCL low. Remove jack?\n");
             if(SDA1IN==0)
                 printf("                SDA low. Remove jack?\n");
-            if((*i2cSlaveFR&0x20) != 0)
+            if((RD(REG_SLV_FR)&0x20) != 0)
                 printf("                I2C Slave receive busy, is the receive thread running?\n");
-            if((*i2cSlaveFR&2) == 0)
+            if((RD(REG_SLV_FR)&2) == 0)
                 printf("                I2C Slave receive fifo not emtpy, is the receive thread running?\n");
             #endif
             return ERROR_TIMEOUT;
@@ -1204,58 +2667,60 @@ int i2cSend(char message[], char ackAdr) {
     WAIT_FOR_FREE_BUS_PIN_LO;
     #endif
 
-    // clear ack and hello so we can receive a new ack or hello
-    dgtRx.ack[0]=0;
+    // clear hello so we can receive a new hello
     dgtRx.hello=0;
 
+    // replies come within 10ms, keep polling fast
+    rxSched.burstUntil=timer()+RX_BURST_TIME;
+
     // dont let the slave listen to 0 (wierd errors)?
     // listen to ack adress
-    *i2cSlaveSLV = ackAdr;
+    WR(REG_SLV_SLV, ackAdr);
 
     // start sending
-    *i2cMasterS = 0x302;
-    *i2cMaster = 0x8080;
+    WR(REG_MST_S, 0x302);
+    WR(REG_MST_C, 0x8080);
 
     // write the rest of the message
     for (; n<message[2]; n++) {
         // wait for space in the buffer
-        timeOut=*timer() + 10000;   // should be done in 10ms
-        while((*i2cMasterS&0x10)==0) {
-            if (*i2cMasterS&2) {
-                *i2cSlaveSLV = 0x00;
+        timeOut=timer() + 10000;   // should be done in 10ms
+        while((RD(REG_MST_S)&0x10)==0) {
+            if (RD(REG_MST_S)&2) {
+                WR(REG_SLV_SLV, 0x00);
                 #ifdef debug
-                printf("%.3f ",(float)*timer()/1000000);
+                printf("%.3f ",(float)timer()/1000000);
                 printf("    Send error: done before complete send\n");
                 #endif
                 break;
             }
-            if (*timer()>timeOut) {
-                *i2cSlaveSLV = 0x00;
+            if (timer()>timeOut) {
+                WR(REG_SLV_SLV, 0x00);
                 #ifdef debug
-                printf("%.3f ",(float)*timer()/1000000);
+                printf("%.3f ",(float)timer()/1000000);
                 printf("    Send error: Buffer free timeout, waited more then 10ms for space in the buffer\n");
                 #endif
                 pthread_mutex_unlock(&receiveMutex);
                 return ERROR_TIMEOUT;
             }
         }
-        if (*i2cMasterS&2)
+        if (RD(REG_MST_S)&2)
             break;
         #ifdef debug2
         printf("%02x ", message[n]);
         if(n == message[2]-1)
             printf("= %s\n",packetDescriptor[message[3]-1]);
         #endif
-        *i2cMasterFIFO=message[n];
+        WR(REG_MST_FIFO, message[n]);
     }
 
     // wait for done
-    timeOut=*timer() + 10000;   // should be done in 10ms
-    while ((*i2cMasterS&2)==0)
-        if (*timer()>timeOut) {
-            *i2cSlaveSLV = 0x00;
+    timeOut=timer() + 10000;   // should be done in 10ms
+    while ((RD(REG_MST_S)&2)==0)
+        if (timer()>timeOut) {
+            WR(REG_SLV_SLV, 0x00);
             #ifdef debug
-            printf("%.3f ",(float)*timer()/1000000);
+            printf("%.3f ",(float)timer()/1000000);
             printf("    Send error: done timeout, waited more then 10ms for message to be finished sending\n");
             #endif
             pthread_mutex_unlock(&receiveMutex);
@@ -1263,27 +2728,29 @@ int i2cSend(char message[], char ackAdr) {
         }
 
     // succes?
-    if ((*i2cMasterS&0x300)==0) {
+    if ((RD(REG_MST_S)&0x300)==0) {
+        // the ack can't be handled before we unlock
+        ackExpect(ackAdr, message[3]);
         pthread_mutex_unlock(&receiveMutex);
         return ERROR_OK;
     }
 
-    *i2cSlaveSLV = 0x00;
+    WR(REG_SLV_SLV, 0x00);
 
     // collision or clock off
-    if (*i2cMasterS&0x100) {
+    if (RD(REG_MST_S)&0x100) {
         // reset error flags
-        *i2cMasterS=0x100;
+        WR(REG_MST_S, 0x100);
         #ifdef debug
-        printf("%.3f ",(float)*timer()/1000000);
+        printf("%.3f ",(float)timer()/1000000);
         printf("    Send error: byte not Acked\n");
         #endif
     }
-    if (*i2cMasterS&0x200) {
+    if (RD(REG_MST_S)&0x200) {
         // reset error flags
-        *i2cMasterS=0x200;
+        WR(REG_MST_S, 0x200);
         #ifdef debug
-        printf("%.3f ",(float)*timer()/1000000);
+        printf("%.3f ",(float)timer()/1000000);
         printf("    Send error: collision, clock stretch timeout\n");
         #endif
 
@@ -1293,11 +2760,11 @@ int i2cSend(char message[], char ackAdr) {
     }
 
     // clear fifo
-    *i2cMaster|=0x10;
+    WR(REG_MST_C, RD(REG_MST_C) | 0x10);
 
-    if ((SCL1IN==0) || (SDA1IN==0) || ((*i2cSlaveFR&0x20)!=0) || ((*i2cSlaveFR&2)==0)) {
+    if ((SCL1IN==0) || (SDA1IN==0) || ((RD(REG_SLV_FR)&0x20)!=0) || ((RD(REG_SLV_FR)&2)==0)) {
         #ifdef debug
-        printf("%.3f ",(float)*timer()/1000000);
+        printf("%.3f ",(float)timer()/1000000);
         printf("    Send error: collision, lines busy after send.\n");
         #endif
 
@@ -1317,49 +2784,51 @@ int i2cReceive(char m[]) {
     int i=1;
     u_int64_t timeOut;
 
-    m[0]=*i2cSlaveSLV*2;
+    m[0]=RD(REG_SLV_SLV)*2;
+    rxLength=1;
 
     // a message should be finished receiving in 10ms
-    timeOut=*timer()+10000;
+    timeOut=timer()+10000;
 
     #ifdef debug
-    if (bug.rxMaxBuf<(*i2cSlaveFR&0xf800)>>11)
-        bug.rxMaxBuf=(*i2cSlaveFR&0xf800)>>11;
+    if (bug.rxMaxBuf<(RD(REG_SLV_FR)&0xf800)>>11)
+        bug.rxMaxBuf=(RD(REG_SLV_FR)&0xf800)>>11;
     #endif
 
     // while I2CSlave is receiving or byte availible
-    while( ((*i2cSlaveFR&0x20) != 0) || ((*i2cSlaveFR&2) == 0) ) {
+    while( ((RD(REG_SLV_FR)&0x20) != 0) || ((RD(REG_SLV_FR)&2) == 0) ) {
 
         // timeout
-        if (timeOut<*timer()) {
+        if (timeOut<timer()) {
             #ifdef debug
             ERROR_PIN_HI;
-            printf("%.3f ",(float)*timer()/1000000);
+            printf("%.3f ",(float)timer()/1000000);
             printf("    Receive error: Timeout, hardware stays in receive mode for more then 10ms\n");
-            bug.rxTimeout++;
             hexPrint(m,i);
             ERROR_PIN_LO;
             #endif
+            STAT_INC(stats.rxTimeouts);
             pthread_mutex_unlock(&receiveMutex);
             return ERROR_TIMEOUT;
         }
 
         // when a byte is availible, store it
-        if((*i2cSlaveFR&2) == 0) {
-            m[i]=*i2cSlave & 0xff;
+        if((RD(REG_SLV_FR)&2) == 0) {
+            m[i]=RD(REG_SLV_DR) & 0xff;
             i++;
+            rxLength=i;
             // complete packet
             if (i>2 && i>=m[2])
                 break;
             if (i >= RECEIVE_BUFFER_LENGTH) {
                 #ifdef debug
                 ERROR_PIN_HI;
-                bug.rxWrongAdr++;
-                printf("%.3f ",(float)*timer()/1000000);
+                printf("%.3f ",(float)timer()/1000000);
                 printf("    Receive error: Buffer overrun, size to large for the supplied buffer %d bytes.\n",i);
                 hexPrint(m,i);
                 ERROR_PIN_LO;
                 #endif
+                STAT_INC(stats.rxTooLarge);
                 return ERROR_SWB_FULL;
             }
         } else {
@@ -1367,7 +2836,7 @@ int i2cReceive(char m[]) {
             #ifdef debug
             RECEIVE_THREAD_RUNNING_PIN_LO;
             #endif
-            usleep(10);
+            clockSleep(RX_BYTE_WAIT);
             #ifdef debug
             RECEIVE_THREAD_RUNNING_PIN_HI;
             #endif
@@ -1375,7 +2844,7 @@ int i2cReceive(char m[]) {
     }
 
     // listen for broadcast again
-    *i2cSlaveSLV=0x00;
+    WR(REG_SLV_SLV, 0x00);
 
     m[i]=-1;
 
@@ -1391,145 +2860,254 @@ int i2cReceive(char m[]) {
     if (m[1]!=16) {
         #ifdef debug
         ERROR_PIN_HI;
-        bug.rxWrongAdr++;
-        printf("%.3f ",(float)*timer()/1000000);
+        printf("%.3f ",(float)timer()/1000000);
         printf("    Receive error: Wrong adress, Received message not from clock (16) but from %d.\n",m[1]);
         hexPrint(m,i);
         ERROR_PIN_LO;
         #endif
+        STAT_INC(stats.rxWrongAdr);
         return ERROR_NACK;
     }
 
     // errors?
-    if (*i2cSlaveRSR&1 || i<5 || i!=m[2] )  {
+    if (RD(REG_SLV_RSR)&1 || i<5 || i!=m[2] )  {
         #ifdef debug
         ERROR_PIN_HI;
-        printf("%.3f ",(float)*timer()/1000000);
-        if(*i2cSlaveRSR&1) {
+        printf("%.3f ",(float)timer()/1000000);
+        if(RD(REG_SLV_RSR)&1) {
             printf("    Receive error: Hardware buffer full.\n");
-            bug.rxBufferFull++;
         } else {
             if (i<5)
                 printf("    Receive Error: Packet to small, %d bytes.\n",i);
             else
                 printf("    Receive Error: Size mismatch, packet length is %d bytes but received %d bytes.\n",m[2],i);
-            bug.rxSizeMismatch++;
         }
         hexPrint(m,i);
         ERROR_PIN_LO;
         #endif
-        *i2cSlaveRSR=0;
+        if (RD(REG_SLV_RSR)&1) {
+            STAT_INC(stats.rxBufferFull);
+            STAT_INC(stats.rxOverruns);
+        } else
+            STAT_INC(stats.rxSizeMismatch);
+        WR(REG_SLV_RSR, 0);
         return ERROR_HWB_FULL;
     }
 
     if (crc_calc(m)) {
         #ifdef debug
         ERROR_PIN_HI;
-        bug.rxCRCFault++;
-        printf("%.3f ",(float)*timer()/1000000);
+        printf("%.3f ",(float)timer()/1000000);
         printf("    Receive error: CRC Error\n");
         hexPrint(m,i);
         ERROR_PIN_LO;
         #endif
+        STAT_INC(stats.rxCRCFaults);
         return ERROR_CRC;
     }
 
     return i;
 }
 
-// read register
-static unsigned int dummyRead(volatile unsigned int *addr) {
-    return *addr;
+// check the wiring before the I2C hardware is taken
+int i2cCheckWiring() {
+    // configured as an output? probably in use for something else
+    if ((RD(REG_GPFSEL0) & 0x1c0) == 0x40) {
+        #ifdef debug
+        printf("Error, GPIO02 configured as output, in use? We asume not a DGTPI\n");
+        #endif
+        return ERROR_LINES;
+    }
+    if ((RD(REG_GPFSEL0) & 0xe00) == 0x200) {
+        #ifdef debug
+        printf("Error, GPIO03 configured as output, in use? We asume not a DGTPI\n");
+        #endif
+        return ERROR_LINES;
+    }
+    if  (piModel==4)
+    {
+        if ((RD(REG_GPFSEL1) & 0x07) == 0x01) {
+            #ifdef debug
+            printf("Error, GPIO10 configured as output, in use? We asume not a DGTPI\n");
+            #endif
+            return ERROR_LINES;
+        }
+        if ((RD(REG_GPFSEL1) & 0x38) == 0x08) {
+            #ifdef debug
+            printf("Error, GPIO11 configured as output, in use? We asume not a DGTPI\n");
+            #endif
+            return ERROR_LINES;
+        }
+    }
+    else
+    {
+        if ((RD(REG_GPFSEL1) & 0x07000000) == 0x01000000) {
+            #ifdef debug
+            printf("Error, GPIO18 configured as output, in use? We asume not a DGTPI\n");
+            #endif
+            return ERROR_LINES;
+        }
+        if ((RD(REG_GPFSEL1) & 0x38000000) == 0x08000000) {
+            #ifdef debug
+            printf("Error, GPIO19 configured as output, in use? We asume not a DGTPI\n");
+            #endif
+            return ERROR_LINES;
+        }
+    }
+    // pinmode GPIO2,GPIO3=input
+    WR(REG_GPFSEL0, RD(REG_GPFSEL0) & 0xfffff03f);
+    if  (piModel==4)
+    {
+        // pinmode GPIO10,GPIO11=input
+        WR(REG_GPFSEL1, RD(REG_GPFSEL1) & 0xffffffc0);
+    }
+    else
+    {
+        // pinmode GPIO18,GPIO19=input
+        WR(REG_GPFSEL1, RD(REG_GPFSEL1) & 0xc0ffffff);
+    }
+    clockSleep(1);
+    // all pins hi through pullup?
+    if  (piModel==4)
+    {
+        if ((RD(REG_GPLEV0) & 0x0c0c)!=0x0c0c) {
+            #ifdef debug
+            printf("Error, pin(s) low, shortcircuit, or no connection?\n");
+            #endif
+            return ERROR_LINES;
+        }
+    }
+    else
+    {
+        if ((RD(REG_GPLEV0) & 0xc000c)!=0xc000c) {
+            #ifdef debug
+            printf("Error, pin(s) low, shortcircuit, or no connection?\n");
+            #endif
+            return ERROR_LINES;
+        }
+    }
+
+    return ERROR_OK;
+}
+
+// take over I2C hardware an earlier run left set up
+int i2cAttach() {
+    // GPIO2,GPIO3 ALT0 and the slave pins ALT3
+    if ((RD(REG_GPFSEL0) & 0xfc0) != 0x900)
+        return 0;
+    if (piModel==4) {
+        if ((RD(REG_GPFSEL1) & 0x3f) != 0x3f)
+            return 0;
+    } else {
+        if ((RD(REG_GPFSEL1) & 0x3f000000) != 0x3f000000)
+            return 0;
+    }
+    // slave receiving, master enabled, divider for this core clock
+    if ((RD(REG_SLV_CR) & 0x205) != 0x205 || (RD(REG_MST_C) & 0x8000) == 0)
+        return 0;
+    if (RD(REG_MST_DIV) != 1000*backend->coreFreq()/95)
+        return 0;
+    // nobody on the bus
+    if (SDA1IN==0 || SCL1IN==0)
+        return 0;
+
+    // forget what came in before we were there
+    while((RD(REG_SLV_FR)&2) == 0)
+        RD(REG_SLV_DR);
+    WR(REG_SLV_RSR, 0);
+    WR(REG_SLV_SLV, 0x0);
+    WR(REG_MST_S, 0x302);
+    return 1;
 }
 
 // configure IO pins and I2C Master and Slave
 void i2cReset() {
     int freq;
 
-    *i2cSlaveCR = 0;
-    *i2cMaster = 0x10;
-    *i2cMaster = 0x0000;
+    WR(REG_SLV_CR, 0);
+    WR(REG_MST_C, 0x10);
+    WR(REG_MST_C, 0x0000);
 
     // pinmode GPIO2,GPIO3=input (togle via input to reset i2C master(sometimes hangs))
-    *gpio &= 0xfffff03f;
+    WR(REG_GPFSEL0, RD(REG_GPFSEL0) & 0xfffff03f);
     if (piModel==4)
     {
         // pinmode GPIO10,GPIO11=input (togle via input to reset)
-        *(gpio+1) &= 0xffffffc0;
+        WR(REG_GPFSEL1, RD(REG_GPFSEL1) & 0xffffffc0);
     }
     else
     {
         // pinmode GPIO18,GPIO19=input (togle via input to reset)
-        *(gpio+1) &= 0xc0ffffff;
+        WR(REG_GPFSEL1, RD(REG_GPFSEL1) & 0xc0ffffff);
     }
     // send something in case master hangs
-    *i2cMasterDLEN = 0;
-    while((*i2cSlaveFR&2) == 0) {
-        dummyRead(i2cSlave);
-    }
-    usleep(2000);   // not tested! some delay maybe needed
-    *i2cSlaveCR = 0x285;
-    *i2cMasterS = 0x302;
-    *i2cMaster = 0x8010;
+    WR(REG_MST_DLEN, 0);
+    while((RD(REG_SLV_FR)&2) == 0) {
+        RD(REG_SLV_DR);
+    }
+    clockSleep(2000);   // not tested! some delay maybe needed
+    WR(REG_SLV_CR, 0x285);
+    WR(REG_MST_S, 0x302);
+    WR(REG_MST_C, 0x8010);
     // pinmode GPIO2,GPIO3=ALT0
-    *gpio |= 0x900;
+    WR(REG_GPFSEL0, RD(REG_GPFSEL0) | 0x900);
     if (piModel==4)
     {
         // pinmode GPIO10,GPIO11=ALT3
-        *(gpio+1) |= 0x0000003f;
+        WR(REG_GPFSEL1, RD(REG_GPFSEL1) | 0x0000003f);
     }
     else
     {
         // pinmode GPIO18,GPIO19=ALT3
-        *(gpio+1) |= 0x3f000000;
+        WR(REG_GPFSEL1, RD(REG_GPFSEL1) | 0x3f000000);
     }
 
-    usleep(1000);   // not tested! some delay maybe needed
+    clockSleep(1000);   // not tested! some delay maybe needed
 
     #ifdef debug
     if ((SDA1IN==0) || (SCL1IN==0)) {
         printf("I2C Master might be stuck in transfer?\n");
-        printf("FIFO=%x\n",*i2cMasterFIFO);
-        printf("C   =%x\n",*i2cMaster);
-        printf("S   =%x\n",*i2cMasterS);
-        printf("DLEN=%x\n",*i2cMasterDLEN);
-        printf("A   =%x\n",*i2cMasterA);
-        printf("FIFO=%x\n",*i2cMasterFIFO);
-        printf("DIV =%x\n",*i2cMasterDiv);
-        printf("Del =%x\n",*i2cMasterDel);
+        printf("FIFO=%x\n",RD(REG_MST_FIFO));
+        printf("C   =%x\n",RD(REG_MST_C));
+        printf("S   =%x\n",RD(REG_MST_S));
+        printf("DLEN=%x\n",RD(REG_MST_DLEN));
+        printf("A   =%x\n",RD(REG_MST_A));
+        printf("FIFO=%x\n",RD(REG_MST_FIFO));
+        printf("DIV =%x\n",RD(REG_MST_DIV));
+        printf("Del =%x\n",RD(REG_MST_DEL));
 
         printf("I2C Slave might be stuck in transfer?\n");
-        printf("DR  =%x\n",*i2cSlave);
-        printf("RSR =%x\n",*i2cSlaveRSR);
-        printf("SLV =%x\n",*i2cSlaveSLV);
-        printf("CR  =%x\n",*i2cSlaveCR);
-        printf("FR  =%x\n",*i2cSlaveFR);
+        printf("DR  =%x\n",RD(REG_SLV_DR));
+        printf("RSR =%x\n",RD(REG_SLV_RSR));
+        printf("SLV =%x\n",RD(REG_SLV_SLV));
+        printf("CR  =%x\n",RD(REG_SLV_CR));
+        printf("FR  =%x\n",RD(REG_SLV_FR));
 
         printf("SDA=%x\n",SDA1IN);
         printf("SCL=%x\n",SCL1IN);
     }
     // pinmode GPIO17,GPIO27,GPIO22=output for debugging
-    *(gpio+1) = (*(gpio+1)&0xff1fffff) | 0x00200000;    // GIO17
-    *(gpio+2) = (*(gpio+2)&0xff1fffff) | 0x00200000;    // GIO27
-    *(gpio+2) = (*(gpio+2)&0xfffffe3f) | 0x00000040;    // GIO22
+    WR(REG_GPFSEL1, (RD(REG_GPFSEL1)&0xff1fffff) | 0x00200000);    // GIO17
+    WR(REG_GPFSEL2, (RD(REG_GPFSEL2)&0xff1fffff) | 0x00200000);    // GIO27
+    WR(REG_GPFSEL2, (RD(REG_GPFSEL2)&0xfffffe3f) | 0x00000040);    // GIO22
     #endif
 
     // set i2c slave control register to break and off
-    *i2cSlaveCR = 0x80;
+    WR(REG_SLV_CR, 0x80);
     // set i2c slave control register to enable: receive, i2c, device
-    *i2cSlaveCR = 0x205;
+    WR(REG_SLV_CR, 0x205);
     // set i2c slave address 0x00 to listen to broadcasts
-    *i2cSlaveSLV = 0x0;
+    WR(REG_SLV_SLV, 0x0);
     // reset errors
-    *i2cSlaveRSR = 0;
+    WR(REG_SLV_RSR, 0);
 
-    freq = checkCoreFreq();
+    freq = backend->coreFreq();
     #ifdef debug
     printf("Reset I2C device, core freq = %i MHz\n", freq);
     #endif
-    *i2cMasterDiv = 1000*freq/95;
+    WR(REG_MST_DIV, 1000*freq/95);
     if ( freq > 300 )
-        *i2cMasterDel = 0x600060;
+        WR(REG_MST_DEL, 0x600060);
 }
 
 // print hex values
@@ -1556,11 +3134,157 @@ char crc_calc(char *buffer) {
     return ERROR_CRC;
 }
 
-u_int64_t * timer()
-{
-    static u_int64_t i;
-    i = ((u_int64_t)*timerl << 32) + *timerh;
-    return &i;
+// fill a set and run message
+void setNRunPacket(char srm[], char lr, char lh, char lm, char ls,
+                   char rr, char rh, char rm, char rs) {
+    memcpy(srm, setnrun, sizeof(setnrun));
+    srm[4]=lh;
+    srm[5]=((lm/10)<<4) | (lm%10);
+    srm[6]=((ls/10)<<4) | (ls%10);
+    srm[7]=rh;
+    srm[8]=((rm/10)<<4) | (rm%10);
+    srm[9]=((rs/10)<<4) | (rs%10);
+    srm[10]=lr | (rr<<2);
+
+    crc_calc(srm);
+}
+
+// fill a program message
+void programPacket(char pm[], char program[], int length) {
+    memcpy(pm, setProgram, 4);
+    pm[2]=5+length;
+    memcpy(pm+4, program, length);
+    crc_calc(pm);
+}
+
+// fill a display message
+void textPacket(char dm[], char text[], char beep, char ld, char rd) {
+    int i;
+
+    memcpy(dm, display, sizeof(display));
+    for (i=0;i<11;i++) {
+        if(text[i]==0) break;
+        dm[i+4]=text[i];
+    }
+
+    for (;i<11;i++) {
+        dm[i+4]=32;
+    }
+
+    dm[16]=beep;
+    dm[18]=ld;
+    dm[19]=rd;
+
+    crc_calc(dm);
+}
+
+// real time comes from the backend
+static u_int64_t realNow() {
+    return backend->time();
+}
+
+static void realSleep(u_int64_t us) {
+    usleep(us);
+}
+
+static int realWait(int *addr, int val, long long timeOut) {
+    struct timespec t;
+
+    if (timeOut<0)
+        return syscall(SYS_futex, addr, FUTEX_WAIT_PRIVATE, val, NULL, NULL, 0);
+
+    t.tv_sec=timeOut/1000000;
+    t.tv_nsec=(timeOut%1000000)*1000;
+    return syscall(SYS_futex, addr, FUTEX_WAIT_PRIVATE, val, &t, NULL, 0);
+}
+
+static void realWake(int *addr) {
+    syscall(SYS_futex, addr, FUTEX_WAKE_PRIVATE, INT_MAX, NULL, NULL, 0);
+}
+
+static void realSpawn() {
+}
+
+const dgtClock_t dgtClockReal = {
+    "real",
+    realNow,
+    realSleep,
+    realWait,
+    realWake,
+    realSpawn
+};
+
+// sleep on the library clock
+void clockSleep(u_int64_t us) {
+    dgtClock->sleep(us);
+}
+
+// sleep while *addr==val
+int futexWait(int *addr, int val, long long timeOut) {
+    return dgtClock->wait(addr, val, timeOut);
+}
+
+// wake all threads sleeping on addr
+void futexWake(int *addr) {
+    dgtClock->wake(addr);
+}
+
+u_int64_t timer() {
+    return dgtClock->now();
+}
+
+// ns one look at a time source takes, best of a few rounds
+static int timerCost(u_int64_t (*source)(void)) {
+    struct timespec a, b;
+    long long ns, best = LLONG_MAX;
+    int i, r;
+
+    for (r = 0; r < 5; r++) {
+        clock_gettime(CLOCK_MONOTONIC, &a);
+        for (i = 0; i < 1000; i++)
+            source();
+        clock_gettime(CLOCK_MONOTONIC, &b);
+        ns = (b.tv_sec - a.tv_sec) * 1000000000LL + b.tv_nsec - a.tv_nsec;
+        if (ns < best)
+            best = ns;
+    }
+    return best / 1000;
+}
+
+// a time source should never go back, count how often it does
+static int timerBackwards(u_int64_t (*source)(void)) {
+    u_int64_t t, last;
+    int i, back = 0;
+
+    last = source();
+    for (i = 0; i < 1000000; i++) {
+        t = source();
+        if (t < last)
+            back++;
+        last = t;
+    }
+    return back;
+}
+
+static u_int64_t timerMonotonic() {
+    struct timespec t;
+
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return (u_int64_t)t.tv_sec * 1000000 + t.tv_nsec / 1000;
+}
+
+static u_int64_t timerMonotonicRaw() {
+    struct timespec t;
+
+    clock_gettime(CLOCK_MONOTONIC_RAW, &t);
+    return (u_int64_t)t.tv_sec * 1000000 + t.tv_nsec / 1000;
+}
+
+static u_int64_t timerMonotonicCoarse() {
+    struct timespec t;
+
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &t);
+    return (u_int64_t)t.tv_sec * 1000000 + t.tv_nsec / 1000;
 }
 
 // find out wich pi
@@ -1568,11 +3292,12 @@ int checkPiModel() {
     FILE *cpuFd ;
     char line [120] ;
 
-    if ((cpuFd = fopen ("/proc/cpuinfo", "r")) == NULL)
+    if ((cpuFd = fopen ("/proc/cpuinfo", "r")) == NULL) {
         #ifdef debug
-        printf("Unable to open /proc/cpuinfo")
+        printf("Unable to open /proc/cpuinfo\n");
         #endif
-        ;
+        return 0;
+    }
 
     // looking for the revision....
     while (fgets (line, 120, cpuFd) != NULL)
@@ -1595,9 +3320,71 @@ int checkPiModel() {
     return 0;
 }
 
+// board model and core clock of an earlier run
+int boardCacheLoad() {
+    FILE *f;
+    boardCache_t b;
+
+    f = fopen(BOARD_CACHE, "r");
+    if (f == NULL)
+        return 0;
+    if (fscanf(f, "model=%d core=%d", &b.piModel, &b.coreFreq) != 2
+            || b.piModel < 1 || b.piModel > 4 || b.coreFreq < 0) {
+        fclose(f);
+        return 0;
+    }
+    fclose(f);
+    boardCache = b;
+    return 1;
+}
+
+// keep the board model and core clock for the next run
+void boardCacheSave() {
+    FILE *f;
+
+    if (boardCache.piModel == 0)
+        return;
+    f = fopen(BOARD_CACHE, "w");
+    if (f == NULL)
+        return;
+    fprintf(f, "model=%d core=%d\n", boardCache.piModel, boardCache.coreFreq);
+    fclose(f);
+}
+
+// ask the firmware for the measured core clock, what vcgencmd does
+// without the fork and exec
+int mailboxCoreFreq() {
+    u_int32_t m[8] __attribute__((aligned(16)));
+    int fd, e;
+
+    fd = open("/dev/vcio", O_RDWR | O_CLOEXEC);
+    if (fd < 0)
+        return 0;
+    m[0] = sizeof(m);
+    m[1] = 0;                       // request
+    m[2] = MBOX_TAG_CLOCK_MEASURED;
+    m[3] = 8;                       // value buffer size
+    m[4] = 4;                       // request size
+    m[5] = MBOX_CLOCK_CORE;
+    m[6] = 0;                       // Hz
+    m[7] = 0;                       // end tag
+    e = ioctl(fd, _IOWR(100, 0, char *), m);
+    close(fd);
+    if (e < 0 || m[1] != 0x80000000 || m[5] != MBOX_CLOCK_CORE)
+        return 0;
+    return m[6] / 1000000;
+}
+
 int checkCoreFreq() {
     FILE *fp;
     char line[100];
+    int freq;
+
+    freq = mailboxCoreFreq();
+    if (freq > 0)
+        return freq;
+    if (boardCache.coreFreq > 0)
+        return boardCache.coreFreq;
 
     /* Open the command for reading. */
     fp = popen("vcgencmd measure_clock core", "r");
@@ -1609,10 +3396,523 @@ int checkCoreFreq() {
     }
 
     /* Read the output a line at a time - output it. */
-    fgets(line, sizeof(line), fp);
+    if (fgets(line, sizeof(line), fp) == NULL)
+        line[0] = 0;
 
     /* close */
     pclose(fp);
 
-    return atoi(line+13)/1000000;
+    freq = strlen(line) > 13 ? atoi(line+13)/1000000 : 0;
+    if (freq <= 0)
+        return 250;
+    boardCache.coreFreq = freq;
+    boardCacheSave();
+    return freq;
+}
+
+// the system timer, the high word is read again to see a carry from
+// the low word between the reads
+static u_int64_t hwTimeMmio() {
+    u_int32_t hi, lo;
+
+    do {
+        hi = *timerHi;
+        lo = *timerLo;
+    } while (hi != *timerHi);
+    return ((u_int64_t)hi << 32) | lo;
+}
+
+// the cheaper of the system timer and the vDSO clock, an uncached bus
+// read can cost more than a clock_gettime that never enters the kernel
+static u_int64_t (*hwTimeRead)(void) = timerMonotonic;
+
+static void hwTimeSelect() {
+    int mmio, mono;
+
+    mmio = timerCost(hwTimeMmio);
+    mono = timerCost(timerMonotonic);
+    hwTimeRead = mmio < mono ? hwTimeMmio : timerMonotonic;
+    #ifdef debug
+    printf("time from %s, system timer %dns, CLOCK_MONOTONIC %dns\n",
+           mmio < mono ? "system timer" : "CLOCK_MONOTONIC", mmio, mono);
+    #endif
+}
+
+// get SDA falling edges from the gpiochip character device, edge
+// detection keeps working when the pin is switched back to its old mode
+static void hwEventOpen() {
+    struct gpioevent_request req;
+    int fd;
+    unsigned fsel;
+
+    gpioEventFd = -1;
+    fd = open("/dev/gpiochip0", O_RDONLY);
+    if (fd < 0)
+        return;
+
+    memset(&req, 0, sizeof(req));
+    req.lineoffset = 2;     // SDA1 = GPIO 2
+    req.handleflags = GPIOHANDLE_REQUEST_INPUT;
+    req.eventflags = GPIOEVENT_REQUEST_FALLING_EDGE;
+    strcpy(req.consumer_label, "dgtpicom");
+    fsel = *hwReg[REG_GPFSEL0];
+    if (ioctl(fd, GPIO_GET_LINEEVENT_IOCTL, &req) == 0) {
+        gpioEventFd = req.fd;
+        *hwReg[REG_GPFSEL0] = fsel;
+    }
+    #ifdef debug
+    else
+        printf("No SDA edge events from /dev/gpiochip0, receive thread will poll\n");
+    #endif
+    close(fd);
+}
+
+// map the BCM2708/9 peripherals
+static int hwOpen(char *model) {
+    int memfd;
+    uint32_t base;
+    void *gpio_map, *timer_map, *i2c_slave_map, *i2c_master_map;
+    volatile unsigned *gpio, *i2cSlave, *i2cMaster;
+
+    // the board does not change until a reboot, /proc/cpuinfo is only
+    // read on the first start
+    if (boardCache.piModel==0 && !boardCacheLoad()) {
+        boardCache.piModel = checkPiModel();
+        boardCacheSave();
+    }
+    *model = boardCache.piModel;
+    if (*model==4)
+        base=0xfe000000;
+    else if (*model==1)
+        base=0x20000000;
+    else
+        base=0x3f000000;
+
+    memfd = open("/dev/mem",O_RDWR|O_SYNC);
+    if(memfd < 0) {
+        #ifdef debug
+        printf("/dev/mem open error, run as root\n");
+        #endif
+        return ERROR_MEM;
+    }
+
+    gpio_map = mmap(NULL, 4096, PROT_READ|PROT_WRITE, MAP_SHARED, memfd, GPIO_BASE+base);
+    timer_map = mmap(NULL, 4096, PROT_READ|PROT_WRITE, MAP_SHARED, memfd, TIMER_BASE+base);
+    i2c_slave_map = mmap(NULL, 4096, PROT_READ|PROT_WRITE, MAP_SHARED, memfd, I2C_SLAVE_BASE+base);
+    i2c_master_map = mmap(NULL, 4096, PROT_READ|PROT_WRITE, MAP_SHARED, memfd, I2C_MASTER_BASE+base);
+
+    close(memfd);
+
+    if( gpio_map == MAP_FAILED || timer_map == MAP_FAILED || i2c_slave_map == MAP_FAILED || i2c_master_map == MAP_FAILED) {
+        #ifdef debug
+        printf("Map failed\n");
+        #endif
+        return ERROR_MEM;
+    }
+
+    // GPIO pointers
+    gpio = (volatile unsigned *)gpio_map;
+    hwReg[REG_GPFSEL0] = gpio;
+    hwReg[REG_GPFSEL1] = gpio + 1;
+    hwReg[REG_GPFSEL2] = gpio + 2;
+    hwReg[REG_GPSET0] = gpio + 7;   // set bit register offset 28
+    hwReg[REG_GPCLR0] = gpio + 10;  // clr bit register
+    hwReg[REG_GPLEV0] = gpio + 13;  // read all bits register
+
+    // timer pointers
+    timerLo = (volatile u_int32_t *)((char *)timer_map + 4);
+    timerHi = (volatile u_int32_t *)((char *)timer_map + 8);
+    hwTimeSelect();
+
+    // i2c slave pointers
+    i2cSlave = (volatile unsigned *)i2c_slave_map;
+    hwReg[REG_SLV_DR] = i2cSlave;
+    hwReg[REG_SLV_RSR] = i2cSlave + 1;
+    hwReg[REG_SLV_SLV] = i2cSlave + 2;
+    hwReg[REG_SLV_CR] = i2cSlave + 3;
+    hwReg[REG_SLV_FR] = i2cSlave + 4;
+
+    // i2c master pointers
+    i2cMaster = (volatile unsigned *)i2c_master_map;
+    hwReg[REG_MST_C] = i2cMaster;
+    hwReg[REG_MST_S] = i2cMaster + 1;
+    hwReg[REG_MST_DLEN] = i2cMaster + 2;
+    hwReg[REG_MST_A] = i2cMaster + 3;
+    hwReg[REG_MST_FIFO] = i2cMaster + 4;
+    hwReg[REG_MST_DIV] = i2cMaster + 5;
+    hwReg[REG_MST_DEL] = i2cMaster + 6;
+
+    hwEventOpen();
+
+    return ERROR_OK;
+}
+
+static void hwClose() {
+    if (gpioEventFd >= 0)
+        close(gpioEventFd);
+    gpioEventFd = -1;
+}
+
+// sleep until an SDA edge or timeout
+static int hwWait(u_int64_t timeOut) {
+    struct pollfd p;
+    struct gpioevent_data events[16];
+
+    if (gpioEventFd < 0)
+        return ERROR_SILENT;
+
+    p.fd = gpioEventFd;
+    p.events = POLLIN;
+    if (poll(&p, 1, (timeOut+999)/1000) <= 0)
+        return 0;
+
+    // throw away all edges up to now, one wake per burst is enough
+    if (read(gpioEventFd, events, sizeof(events)) < 0)
+        return 0;
+    return 1;
+}
+
+static unsigned hwRead(int reg) {
+    return *hwReg[reg];
+}
+
+static void hwWrite(int reg, unsigned value) {
+    *hwReg[reg] = value;
+}
+
+static u_int64_t hwTime() {
+    return hwTimeRead();
+}
+
+const dgtBackend_t dgtBackendHw = {
+    "hw",
+    hwOpen,
+    hwClose,
+    hwRead,
+    hwWrite,
+    hwTime,
+    checkCoreFreq,
+    hwWait
+};
+
+static void timerBenchOne(const char *name, u_int64_t (*source)(void)) {
+    printf("%-24s %5dns  backwards %d\n", name, timerCost(source), timerBackwards(source));
+}
+
+// print what one look at each time source costs
+int timerBench() {
+    timerBenchOne("timer()", timer);
+    if (backend == &dgtBackendHw && timerLo != NULL)
+        timerBenchOne("system timer", hwTimeMmio);
+    timerBenchOne("CLOCK_MONOTONIC", timerMonotonic);
+    timerBenchOne("CLOCK_MONOTONIC_RAW", timerMonotonicRaw);
+    timerBenchOne("CLOCK_MONOTONIC_COARSE", timerMonotonicCoarse);
+    return ERROR_OK;
+}
+
+// log2 histogram bucket of a time
+int statsBucket(u_int64_t us) {
+    int b;
+
+    if (us==0)
+        return 0;
+    b=64-__builtin_clzll(us);
+    return b<DGTPICOM_STATS_BUCKETS ? b : DGTPICOM_STATS_BUCKETS-1;
+}
+
+// statistics of a message on the bus
+dgtpicom_message_stats_t *statsMessage(char cmd) {
+    switch (cmd) {
+        case 6:
+            return &stats.message[DGTPICOM_STATS_MSG_DISPLAY];
+        case 7:
+            return &stats.message[DGTPICOM_STATS_MSG_END_DISPLAY];
+        case 0x0b:
+            return &stats.message[DGTPICOM_STATS_MSG_CHANGE_STATE];
+        case 0x0f:
+            return &stats.message[DGTPICOM_STATS_MSG_SET_CC];
+        case 0x0a:
+            return &stats.message[DGTPICOM_STATS_MSG_SET_AND_RUN];
+        case 13:
+            return &stats.message[DGTPICOM_STATS_MSG_WAKE];
+        case 9:
+            return &stats.message[DGTPICOM_STATS_MSG_PROGRAM];
+    }
+    return NULL;
+}
+
+// start serving the statistics as text on a unix socket
+int statsOpen(const char *path) {
+    struct sockaddr_un a;
+    struct stat st;
+
+    if (strlen(path)>=sizeof(a.sun_path))
+        return -1;
+    memset(&a,0,sizeof(a));
+    a.sun_family=AF_UNIX;
+    strcpy(a.sun_path, path);
+
+    statsSocket=socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (statsSocket<0)
+        return -1;
+    // only an old socket is replaced, never a file someone pointed us at
+    if (lstat(path, &st)==0 && S_ISSOCK(st.st_mode))
+        unlink(path);
+    if (bind(statsSocket, (struct sockaddr *)&a, sizeof(a))<0
+            || listen(statsSocket, 4)<0) {
+        #ifdef debug
+        printf("Statistics socket %s failed\n",path);
+        #endif
+        close(statsSocket);
+        statsSocket=-1;
+        return -1;
+    }
+    strcpy(statsPath, path);
+    pthread_create(&statsThread, NULL, statsServe, NULL);
+    return 0;
+}
+
+// stop serving the statistics and remove the socket
+void statsClose() {
+    if (statsSocket<0)
+        return;
+
+    // wakes the thread from accept
+    shutdown(statsSocket, SHUT_RDWR);
+    pthread_join(statsThread, NULL);
+    close(statsSocket);
+    unlink(statsPath);
+    statsSocket=-1;
+}
+
+// thread answering statistics connections
+void *statsServe(void *a) {
+    dgtpicom_stats_t s;
+    struct timeval t = {1, 0};
+    FILE *f;
+    int fd;
+
+    while (1) {
+        fd=accept(statsSocket, NULL, NULL);
+        if (fd<0) {
+            if (errno==EINTR || errno==ECONNABORTED)
+                continue;
+            break;
+        }
+
+        // a reader that does not read can't keep us
+        setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &t, sizeof(t));
+        f=fdopen(fd, "w");
+        if (f==NULL) {
+            close(fd);
+            continue;
+        }
+        dgtpicom_get_stats(&s);
+        statsWrite(f, &s);
+        fclose(f);
+    }
+    return NULL;
+}
+
+// write a histogram as cumulative buckets
+void statsHistogram(FILE *f, const char *name, const char *label, unsigned h[]) {
+    unsigned total=0;
+    int i;
+
+    for (i=0; i<DGTPICOM_STATS_BUCKETS-1; i++) {
+        total+=h[i];
+        fprintf(f, "dgtpicom_%s_us_bucket{%s,le=\"%u\"} %u\n", name, label, (1u<<i)-1, total);
+    }
+    total+=h[i];
+    fprintf(f, "dgtpicom_%s_us_bucket{%s,le=\"+Inf\"} %u\n", name, label, total);
+    fprintf(f, "dgtpicom_%s_us_count{%s} %u\n", name, label, total);
+}
+
+// write statistics as text
+void statsWrite(FILE *f, dgtpicom_stats_t *s) {
+    char label[40];
+    int i, j;
+
+    for (i=0; i<DGTPICOM_STATS_COMMANDS; i++) {
+        dgtpicom_command_stats_t *c=&s->command[i];
+
+        snprintf(label, sizeof(label), "command=\"%s\"", statsCommandName[i]);
+        fprintf(f, "dgtpicom_command_done{%s} %u\n", label, c->done);
+        fprintf(f, "dgtpicom_command_retries{%s} %u\n", label, c->retries);
+        for (j=0; j<DGTPICOM_STATS_ERRORS; j++)
+            if (c->results[j])
+                fprintf(f, "dgtpicom_command_result{%s,result=\"%d\"} %u\n", label, -j, c->results[j]);
+        statsHistogram(f, "command_latency", label, c->latency);
+    }
+
+    for (i=0; i<DGTPICOM_STATS_MESSAGES; i++) {
+        dgtpicom_message_stats_t *m=&s->message[i];
+
+        snprintf(label, sizeof(label), "message=\"%s\"", statsMessageName[i]);
+        fprintf(f, "dgtpicom_message_sent{%s} %u\n", label, m->sent);
+        for (j=1; j<DGTPICOM_STATS_ERRORS; j++)
+            if (m->sendErrors[j])
+                fprintf(f, "dgtpicom_message_send_error{%s,error=\"%d\"} %u\n", label, -j, m->sendErrors[j]);
+        fprintf(f, "dgtpicom_message_acked{%s} %u\n", label, m->acked);
+        fprintf(f, "dgtpicom_message_no_ack{%s} %u\n", label, m->noAck);
+        statsHistogram(f, "message_send", label, m->sendTime);
+        statsHistogram(f, "message_ack", label, m->ackTime);
+    }
+
+    fprintf(f, "dgtpicom_rx_packets %u\n", s->rxPackets);
+    fprintf(f, "dgtpicom_rx_errors{error=\"timeout\"} %u\n", s->rxTimeouts);
+    fprintf(f, "dgtpicom_rx_errors{error=\"too_large\"} %u\n", s->rxTooLarge);
+    fprintf(f, "dgtpicom_rx_errors{error=\"wrong_adress\"} %u\n", s->rxWrongAdr);
+    fprintf(f, "dgtpicom_rx_errors{error=\"buffer_full\"} %u\n", s->rxBufferFull);
+    fprintf(f, "dgtpicom_rx_errors{error=\"size_mismatch\"} %u\n", s->rxSizeMismatch);
+    fprintf(f, "dgtpicom_rx_errors{error=\"crc\"} %u\n", s->rxCRCFaults);
+    fprintf(f, "dgtpicom_rx_overruns %u\n", s->rxOverruns);
+    fprintf(f, "dgtpicom_init_us %u\n", s->initTime);
+    fprintf(f, "dgtpicom_configure_skipped %u\n", s->configureSkipped);
+    fprintf(f, "dgtpicom_set_and_run_elided %u\n", s->setAndRunElided);
+}
+
+// add a packet to the capture ring
+void captureAdd(char dir, char adr, int result, char data[], int length) {
+    unsigned n=__atomic_fetch_add(&capture.head, 1, __ATOMIC_RELAXED);
+    capturePacket_t *p=&capture.packet[n%CAPTURE_SIZE];
+
+    __atomic_store_n(&p->seq, 0, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    p->dir=dir;
+    p->adr=adr;
+    p->result=result;
+    p->length=length;
+    p->time=timer();
+    memcpy(p->data, data, length<CAPTURE_DATA ? length : CAPTURE_DATA);
+    __atomic_store_n(&p->seq, n+1, __ATOMIC_RELEASE);
+}
+
+// Write the last packets on the bus to a file.
+int dgtpicom_capture_dump(const char *path) {
+    return captureWrite(path);
+}
+
+// write the capture ring to a file, little endian records of time (8),
+// dir, adr, result, length, number of data bytes and the data
+int captureWrite(const char *path) {
+    capturePacket_t p;
+    unsigned char r[13];
+    unsigned n, head, seq;
+    FILE *f;
+    int i;
+
+    f=fopen(path, "wb");
+    if (f==NULL)
+        return ERROR_MEM;
+    fputs(CAPTURE_MAGIC, f);
+
+    head=__atomic_load_n(&capture.head, __ATOMIC_RELAXED);
+    for (n=head>CAPTURE_SIZE ? head-CAPTURE_SIZE : 0; n!=head; n++) {
+        // skip packets that are being written or overwritten
+        seq=__atomic_load_n(&capture.packet[n%CAPTURE_SIZE].seq, __ATOMIC_ACQUIRE);
+        p=capture.packet[n%CAPTURE_SIZE];
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (seq!=n+1 || __atomic_load_n(&capture.packet[n%CAPTURE_SIZE].seq, __ATOMIC_RELAXED)!=seq)
+            continue;
+
+        for (i=0; i<8; i++)
+            r[i]=p.time>>(i*8);
+        r[8]=p.dir;
+        r[9]=p.adr;
+        r[10]=p.result;
+        r[11]=p.length;
+        r[12]=p.length<CAPTURE_DATA ? p.length : CAPTURE_DATA;
+        fwrite(r, 1, 13, f);
+        fwrite(p.data, 1, r[12], f);
+    }
+
+    if (fclose(f))
+        return ERROR_MEM;
+    return ERROR_OK;
+}
+
+// dump on error now? Starts the wait till the next one, the worker and
+// the receive thread can ask at the same time, only one gets it
+int captureDue() {
+    u_int64_t now=timer();
+    u_int64_t last=__atomic_load_n(&capture.lastDump, __ATOMIC_RELAXED);
+
+    if (capturePath[0]==0
+            || (last && now-last<CAPTURE_DUMP_INTERVAL))
+        return 0;
+    return __atomic_compare_exchange_n(&capture.lastDump, &last, now, 0,
+            __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+}
+
+// ask the worker to dump the capture after an error
+void captureError() {
+    if (!captureDue())
+        return;
+    // no lock, the receive thread must not wait for the worker
+    __atomic_store_n(&capture.errorPending, 1, __ATOMIC_RELEASE);
+    commandKick();
+}
+
+// decode a capture file and print it with a summary
+int captureDecode(const char *path) {
+    unsigned char r[13], d[CAPTURE_DATA];
+    char magic[sizeof(CAPTURE_MAGIC)];
+    int count[2][18], errors[2][DGTPICOM_STATS_ERRORS];
+    u_int64_t t=0, first=0;
+    int i, type, packets=0;
+    signed char result;
+    FILE *f;
+
+    f=fopen(path, "rb");
+    if (f==NULL)
+        return ERROR_MEM;
+    if (fread(magic, 1, sizeof(CAPTURE_MAGIC)-1, f)!=sizeof(CAPTURE_MAGIC)-1
+            || memcmp(magic, CAPTURE_MAGIC, sizeof(CAPTURE_MAGIC)-1)) {
+        printf("%s is not a capture\n", path);
+        fclose(f);
+        return ERROR_MEM;
+    }
+    memset(count, 0, sizeof(count));
+    memset(errors, 0, sizeof(errors));
+
+    while (fread(r, 1, 13, f)==13) {
+        if (r[12]>CAPTURE_DATA || fread(d, 1, r[12], f)!=r[12])
+            break;
+        t=0;
+        for (i=7; i>=0; i--)
+            t=t<<8 | r[i];
+        if (packets++==0)
+            first=t;
+        result=r[10];
+
+        // type is the 4th byte, 1..17 are known
+        type=r[12]>3 && d[3]>=1 && d[3]<=17 ? d[3] : 0;
+        printf("%10.6f %s %02x %-16s", (float)(t-first)/1000000,
+                r[8]==CAPTURE_TX ? "->" : "<-", r[9], type ? packetDescriptor[type-1] : "?");
+        if (result)
+            printf(" error%-3d", result);
+        else
+            printf(" ok      ");
+        for (i=0; i<r[12]; i++)
+            printf(" %02x", d[i]);
+        if (r[11]>r[12])
+            printf(" ..");
+        printf("\n");
+
+        count[r[8]&1][type]++;
+        if (result<=0 && result>-DGTPICOM_STATS_ERRORS)
+            errors[r[8]&1][-result]++;
+    }
+    fclose(f);
+
+    printf("\n%d packets in %.3fs\n", packets, packets ? (float)(t-first)/1000000 : 0);
+    printf("%-24s %6s %6s\n", "", "sent", "recv");
+    for (type=0; type<18; type++)
+        if (count[0][type] || count[1][type])
+            printf("%-24s %6d %6d\n", type ? packetDescriptor[type-1] : "?", count[0][type], count[1][type]);
+    for (i=1; i<DGTPICOM_STATS_ERRORS; i++)
+        if (errors[0][i] || errors[1][i])
+            printf("error%-19d %6d %6d\n", -i, errors[0][i], errors[1][i]);
+    return ERROR_OK;
 }
@@ -22,13 +22,250 @@
 #define	DGTPICOM_KEY_DELAY	800000
 #define DGTPICOM_KEY_REPEAT	400000
 
+/* dgtpicom_wait() result while a command is still queued or being sent
+ */
+#define DGTPICOM_PENDING	1
+
+/* backends for dgtpicom_set_backend()
+ */
+#define DGTPICOM_BACKEND_HW		0
+#define DGTPICOM_BACKEND_EMU	1
+
+/* time sources for dgtpicom_set_clock()
+ */
+#define DGTPICOM_CLOCK_REAL		0
+#define DGTPICOM_CLOCK_VIRTUAL	1
+
+/* start modes for dgtpicom_set_start()
+ */
+#define DGTPICOM_START_RESET	0
+#define DGTPICOM_START_ATTACH	1
+
+/* link state bits, see dgtpicom_get_link_state()
+ */
+#define DGTPICOM_LINK_AWAKE		1	// switched on and answering
+#define DGTPICOM_LINK_CC		2	// in central control
+#define DGTPICOM_LINK_MODE25	4	// in mode 25, ready for commands
+#define DGTPICOM_LINK_OFF		8	// switched off
+#define DGTPICOM_LINK_READY		7
+
+/* longest program for dgtpicom_set_program() in bytes
+ */
+#define DGTPICOM_PROGRAM_LENGTH	46
+
+/* time controls for dgtpicom_tc_start()
+ */
+#define DGTPICOM_TC_OFF			0
+#define DGTPICOM_TC_FISCHER		1	// increment added after every move
+#define DGTPICOM_TC_BRONSTEIN	2	// time used given back, up to the increment
+
+/* receive modes for dgtpicom_set_receive_mode()
+ */
+#define DGTPICOM_RX_POLL		0
+#define DGTPICOM_RX_ADAPTIVE	1
+#define DGTPICOM_RX_EVENT		2
+
+/* receive thread statistics, see dgtpicom_get_rx_stats()
+ */
+typedef struct {
+	int overruns;			// hardware fifo overruns (-8) since init
+	int maxFifoLevel;		// highest receive fifo level seen, 16 = full
+	int pollInterval;		// current sleep between polls in us, 0 = events
+	int avgPollInterval;	// average sleep between polls in us
+	unsigned polls;			// adaptive polls since init
+	long long pollTime;		// us slept in them
+	long long cpuTime;		// cpu time used by the receive thread in us
+} dgtpicom_rx_stats_t;
+
+/* display cache statistics, see dgtpicom_get_display_stats()
+ */
+typedef struct {
+	int hits;				// text already displayed, nothing sent
+	int misses;				// text sent to the clock
+	int endDisplaySkipped;	// end display not sent, display known idle
+	int coalesced;			// queued display updates replaced by a newer one
+	int preempted;			// clock commands sent in the middle of a display update
+} dgtpicom_display_stats_t;
+
+/* clock state from a time message, see dgtpicom_get_clock_state()
+ */
+typedef struct {
+	unsigned seq;					// number of the time message since init, 0 = none
+	unsigned long long timestamp;	// receive time in us, monotonic
+	char time[6];					// left h,m,s and right h,m,s
+	char leftRun;					// left run mode, 0=stop, 1=count down, 2=count up
+	char rightRun;					// right run mode
+	char lever;						// 1 = right side down
+	char leftFlag;					// left flag fallen
+	char rightFlag;					// right flag fallen
+	char noUpdate;					// clock sent the time without an update
+} dgtpicom_clock_state_t;
+
+/* clock time now, worked out from the last time messages, see
+ * dgtpicom_get_clock_time()
+ */
+typedef struct {
+	unsigned seq;					// newest time message it is based on, 0 = none
+	unsigned long long at;			// when it was worked out in us, same clock as timestamp
+	int time[2];					// left and right time in ms
+	char run[2];					// left and right run mode, as leftRun
+	char flag[2];					// flag fallen, reported by the clock or predicted
+	unsigned long long flagFall;	// predicted flag fall in us, 0 = no side counting down
+} dgtpicom_clock_time_t;
+
+/* a move timed by the time control, see dgtpicom_tc_get_move()
+ */
+typedef struct {
+	char side;					// side that pressed the lever, 0 = left, 1 = right
+	int moveTime;				// ms the move took
+	int time[2];				// left and right time in ms after the move
+	unsigned long long at;		// lever time in us, same clock as timestamp
+} dgtpicom_tc_move_t;
+
+/* statistics, see dgtpicom_get_stats(). Latency histograms have log2
+ * buckets: bucket 0 counts 0us, bucket n counts 2^(n-1) to 2^n-1 us and
+ * the last bucket everything longer. Results and errors are counted by
+ * return code, index 0 = ok, n = -n.
+ */
+#define DGTPICOM_STATS_BUCKETS	20
+#define DGTPICOM_STATS_ERRORS	12
+
+// commands, index of dgtpicom_stats_t.command
+#define DGTPICOM_STATS_CONFIGURE	0
+#define DGTPICOM_STATS_SET_AND_RUN	1
+#define DGTPICOM_STATS_TEXT			2
+#define DGTPICOM_STATS_END_TEXT		3
+#define DGTPICOM_STATS_OFF			4
+#define DGTPICOM_STATS_PROGRAM		5
+#define DGTPICOM_STATS_COMMANDS		6
+
+// messages on the bus, index of dgtpicom_stats_t.message
+#define DGTPICOM_STATS_MSG_DISPLAY		0
+#define DGTPICOM_STATS_MSG_END_DISPLAY	1
+#define DGTPICOM_STATS_MSG_CHANGE_STATE	2
+#define DGTPICOM_STATS_MSG_SET_CC		3
+#define DGTPICOM_STATS_MSG_SET_AND_RUN	4
+#define DGTPICOM_STATS_MSG_WAKE			5
+#define DGTPICOM_STATS_MSG_PROGRAM		6
+#define DGTPICOM_STATS_MESSAGES			7
+
+typedef struct {
+	unsigned done;			// commands finished
+	unsigned retries;		// messages sent again for the same command
+	unsigned results[DGTPICOM_STATS_ERRORS];		// by return code
+	unsigned latency[DGTPICOM_STATS_BUCKETS];	// queued to done
+} dgtpicom_command_stats_t;
+
+typedef struct {
+	unsigned sent;			// send tries
+	unsigned sendErrors[DGTPICOM_STATS_ERRORS];	// failed sends by error
+	unsigned acked;
+	unsigned noAck;			// no ack in time, includes the short end
+							// display wait when the display was busy
+	unsigned sendTime[DGTPICOM_STATS_BUCKETS];	// time on the bus
+	unsigned ackTime[DGTPICOM_STATS_BUCKETS];	// send done to ack
+} dgtpicom_message_stats_t;
+
+typedef struct {
+	dgtpicom_command_stats_t command[DGTPICOM_STATS_COMMANDS];
+	dgtpicom_message_stats_t message[DGTPICOM_STATS_MESSAGES];
+	unsigned rxPackets;		// packets received from the clock
+	unsigned rxTimeouts;	// slave busy for more than 10ms (-6)
+	unsigned rxTooLarge;	// packet larger than the buffer (-9)
+	unsigned rxWrongAdr;	// packet not from the clock
+	unsigned rxBufferFull;	// hardware fifo full (-8)
+	unsigned rxSizeMismatch;	// length byte does not match (-8)
+	unsigned rxCRCFaults;	// (-7)
+	unsigned rxOverruns;	// fifo overruns seen by the receive thread
+	unsigned initTime;		// us dgtpicom_init() took
+	unsigned configureSkipped;	// configures with nothing to send
+	unsigned setAndRunElided;	// set and runs the stopped clock already showed
+} dgtpicom_stats_t;
+
+
+/* result of dgtpicom_replay()
+ */
+typedef struct {
+	int commands;			// commands replayed
+	int failed;				// commands that returned an error
+	int latencyP50;			// command latency in us, upper bound of the
+	int latencyP99;			// histogram bucket
+	int retries;			// messages sent again
+	int rxPackets;
+	int rxErrors;
+	int unmatched;			// sends the recording has no outcome for
+	int skipped;			// recorded sends the library did not make
+	unsigned long long duration;	// us
+} dgtpicom_replay_report_t;
 
 
 /* Return codes for all funcitons are at the bottom of this doccument.
  * All functions try three times, the error is the reason why the third
  * try failed.
+ * Commands are sent by a worker thread, so they can be called from any
+ * thread. Clock commands (set and run, configure) go before display
+ * updates, even between the end display and display of a text, and
+ * display updates go before dgtpicom_off(). Within a class the order is
+ * kept. The _async versions queue the
+ * command and return a handle for dgtpicom_wait() (>0) or an error (<0)
+ * right away. A display update (text or end text) that is still queued
+ * is replaced by a newer one, both handles get the result of the newest.
+ * The _timed versions return within budget us. Instead of three tries
+ * they try as long as the budget allows, not at all when it is too short,
+ * and adapt to the error: back off after a collision (-4, -5), retry
+ * right away on a missing or negative ack (-2, -1), one more try when the
+ * clock seems off (-3) and none after a hardware timeout (-6). They
+ * return the last error, or -11 when there was no time to try. A command
+ * that was already on the bus when the budget ran out still finishes.
+ */
+
+
+/* Select where the BCM2708/9 registers come from.
+ *   backend = DGTPICOM_BACKEND_HW for the real chip (default),
+ *             DGTPICOM_BACKEND_EMU for a virtual DGT3000 on an emulated
+ *             I2C bus, see dgtpicom_emu.h
+ *   Run this before dgtpicom_init(). Setting DGTPICOM_BACKEND=emu in the
+ *   environment also selects the emulator.
+ */
+int dgtpicom_set_backend(int backend);
+
+/* Select the time source of the library.
+ *   clock = DGTPICOM_CLOCK_REAL (default), DGTPICOM_CLOCK_VIRTUAL for
+ *           virtual time on the emulator: time jumps ahead when all
+ *           threads using the library sleep, so long tests finish in
+ *           seconds. Sleep with dgtemu_sleep() to take part in it.
+ *   Run this before dgtpicom_init(). Setting DGTPICOM_CLOCK=virtual in the
+ *   environment also selects virtual time. dgtpicom_init() fails when
+ *   virtual time is selected without the emulator.
  */
+int dgtpicom_set_clock(int clock);
 
+/* Select how dgtpicom_init() and dgtpicom_stop() treat the hardware.
+ *   start = DGTPICOM_START_RESET reset the I2C hardware on init and
+ *           release the lines on stop (default),
+ *           DGTPICOM_START_ATTACH take over from a process that ran
+ *           before: when the I2C hardware is still set up the reset is
+ *           skipped, and dgtpicom_configure() sends nothing until a
+ *           command finds the clock is not in mode 25, then it
+ *           configures and tries again. On stop the hardware is left
+ *           set up for the next process.
+ *   Run this before dgtpicom_init(). Setting DGTPICOM_START=attach in the
+ *   environment also selects attaching.
+ */
+int dgtpicom_set_start(int start);
+
+/* Select how the receive thread finds new messages.
+ *   mode = DGTPICOM_RX_EVENT sleep until there is activity on the bus
+ *          (default, uses SDA edges from /dev/gpiochip0 and falls back
+ *          to adaptive polling when those are not available),
+ *          DGTPICOM_RX_ADAPTIVE poll fast during bursts and slow when
+ *          idle, based on traffic and the receive fifo level. Idle it
+ *          costs less cpu than polling every 400us, under heavy traffic
+ *          about the same, it polls faster when the fifo fills up,
+ *          DGTPICOM_RX_POLL poll the I2C slave every 400us
+ *   Run this before dgtpicom_init().
+ */
+int dgtpicom_set_receive_mode(int mode);
 
 /* Get direct access to BCM2708/9 chip.
  *   Run this first and only once (or again after a dgtpicom_stop())
@@ -36,12 +273,19 @@
 int dgtpicom_init(void);
 
 /* Configure the dgt3000: turn it on, set central control and set
- * mode 25. If neccesary reset the I2C hardware.
+ * mode 25. If neccesary reset the I2C hardware. Only what the link state
+ * says is needed is sent, nothing when the clock is known to be in
+ * mode 25.
  *   Run this before any command and if commands fail
  */
 int dgtpicom_configure();
+int dgtpicom_configure_timed(int budget);
 
-/* Send set and run command to the dgt3000.
+/* Send set and run command to the dgt3000. Nothing is sent when both
+ * sides stop and the newest time message shows the clock already stopped
+ * at these times, see setAndRunElided in dgtpicom_get_stats(). A running
+ * side is always set, a time message can be up to a second behind it.
+ * Refused with -12 while a time control runs, see dgtpicom_tc_stop().
  *   lr/rr = left/right run mode, 0=stop, 1=count down, 2=count up
  *   lh/rh = left/right hours
  *   lm/rm = left/right minutes
@@ -49,11 +293,66 @@ int dgtpicom_configure();
  */
 int dgtpicom_set_and_run(char lr, char lh, char lm, char ls,
 					char rr, char rh, char rm, char rs);
+int dgtpicom_set_and_run_async(char lr, char lh, char lm, char ls,
+					char rr, char rh, char rm, char rs);
+int dgtpicom_set_and_run_timed(char lr, char lh, char lm, char ls,
+					char rr, char rh, char rm, char rs, int budget);
 
 /* Send set and run command to the dgt3000 with current clock values.
+ * Refused with -12 while a time control runs.
  *   lr/rr = left/right run mode, 0=stop, 1=count down, 2=count up
  */
-int dgtpicom_run(char lr, char rr);				
+int dgtpicom_run(char lr, char rr);
+int dgtpicom_run_async(char lr, char rr);
+int dgtpicom_run_timed(char lr, char rr, int budget);
+
+/* Let the library run the time control. The receive thread answers
+ * every lever press of the side to move with a set and run, the
+ * increment included, without a round trip through the application.
+ * The clock counts whole seconds, it shows the time rounded up and only
+ * its own flag ends the game. The set and runs of the application are
+ * refused while it is on.
+ *   mode = DGTPICOM_TC_*
+ *   left/right = left/right time in s
+ *   increment = increment or delay in s
+ *   toMove = side that runs first, 0 = left, 1 = right
+ *   returns the set and run result, -12 for an other mode or a negative
+ *   time or increment
+ */
+int dgtpicom_tc_start(int mode, int left, int right, int increment, char toMove);
+
+/* Stop reacting to the lever, the clock keeps running as it is.
+ */
+void dgtpicom_tc_stop();
+
+/* Get a move timed by the time control, the event fd becomes readable
+ * when one is added. Up to 16 are kept until they are read. The move time
+ * is in ms, the times left are whole seconds like the clock keeps them,
+ * rounded to the nearest second after every move so the rounding evens
+ * out over a game instead of adding up.
+ *   move = filled with the side, move time and times after it
+ *   returns number of moves in the buffer including this one, 0 = none
+ */
+int dgtpicom_tc_get_move(dgtpicom_tc_move_t *move);
+
+/* Send a timing program to the dgt3000, the clock runs its increments
+ * and periods itself. The program is in the format of the clock
+ * firmware, the library only puts it in a program message.
+ *   program = program data
+ *   length = bytes in program, at most DGTPICOM_PROGRAM_LENGTH
+ *   returns the result, a longer program is refused with -12
+ */
+int dgtpicom_set_program(char program[], int length);
+int dgtpicom_set_program_async(char program[], int length);
+
+/* Get the last program the dgt3000 acknowledged. This is a local echo of
+ * what was sent, the clock is not asked. It is forgotten when the clock
+ * says hello or is switched off or on, a program set on the clock itself
+ * is not seen.
+ *   program = DGTPICOM_PROGRAM_LENGTH bytes for the program data
+ *   returns the length of the program, 0 = none or forgotten
+ */
+int dgtpicom_get_program(char program[]);
 
 /* Set a text message on the dgt3000.
  *   text = message to display
@@ -67,16 +366,64 @@ int dgtpicom_run(char lr, char rr);
  * 	   32=extra dot (left only)
  */
 int dgtpicom_set_text(char text[], char beep, char ld, char rd);
+int dgtpicom_set_text_async(char text[], char beep, char ld, char rd);
+int dgtpicom_set_text_timed(char text[], char beep, char ld, char rd, int budget);
 
 /* End a text message on the dgt3000 and return to clock mode.
  */
 int dgtpicom_end_text();
+int dgtpicom_end_text_async();
+int dgtpicom_end_text_timed(int budget);
 
-/* Put the last received time message in time[].
+/* Wait for a command queued with one of the _async functions.
+ *   handle = returned by the _async function
+ *   timeOut = max time to wait in us, 0 = don't wait, -1 = forever
+ *   returns the result of the command, DGTPICOM_PENDING when it is not
+ *   done yet or -9 when the handle is so old its result is gone (the
+ *   last 32 results are kept)
+ */
+int dgtpicom_wait(int handle, int timeOut);
+
+/* Get display cache statistics. dgtpicom_set_text() sends nothing when
+ * the same text, without a beep, is already displayed and skips the end
+ * display when the display is known to be idle.
+ *   stats = filled with hits, misses and skipped end displays
+ */
+void dgtpicom_get_display_stats(dgtpicom_display_stats_t *stats);
+
+/* Put the last received time message in time[], whole seconds as the
+ * clock sent them. dgtpicom_get_clock_time() has the time now in ms.
  *   time[] = 6 byte time descriptor
  */
 void dgtpicom_get_time(char time[]);
 
+/* Get a consistent copy of the clock state from the last time message.
+ * Never blocks the receive thread.
+ *   state = filled with times, run modes, lever, flags and receive time
+ *   returns the number of time messages since init, 0 = none yet
+ */
+int dgtpicom_get_clock_state(dgtpicom_clock_state_t *state);
+
+/* Get the clock time now in ms, without bus traffic. The clock only
+ * sends whole seconds once a second, each side's time is counted on from
+ * the time message where it last changed, but never more than a second
+ * past what the clock showed. A side counting down to 0 has a predicted
+ * flag before the clock reports it.
+ *   t = filled with times, run modes, flags and the predicted flag fall
+ *   returns the number of time messages since init, 0 = none yet
+ */
+int dgtpicom_get_clock_time(dgtpicom_clock_time_t *t);
+
+/* Get the time messages received after a given one, for consumers that
+ * can't keep up with every message. Only the last 16 are kept, a gap in
+ * the seq numbers means messages were lost.
+ *   since = seq of the last message the caller has seen, 0 = all
+ *   states = array for the messages, oldest first
+ *   max = size of states
+ *   returns number of messages put in states
+ */
+int dgtpicom_get_time_history(unsigned since, dgtpicom_clock_state_t states[], int max);
+
 /* Get a button message from the buffer and put it in buttons and time
  * returns number of messages in the buffer or an error code if a
  * receive error has occurd since you last check.
@@ -96,6 +443,64 @@ void dgtpicom_get_time(char time[]);
  */
 int dgtpicom_get_button_message(char *buttons, char *time);
 
+/* Wait for a button message, same as dgtpicom_get_button_message() but
+ * sleeps until a message or receive error arrives.
+ * Only one thread should read button messages.
+ *   timeOut = max time to wait in us, 0 = don't wait, -1 = forever
+ *   returns 0 on timeout, -10 when the receive thread is stopped
+ */
+int dgtpicom_wait_button_message(char *buttons, char *time, int timeOut);
+
+/* Get a file descriptor for select(), poll() or epoll that becomes
+ * readable when the receive thread gets a button, lever, on/off, time
+ * message or a receive error, and when a predicted flag falls. Read 8
+ * bytes from it to clear it, then get the messages with
+ * dgtpicom_get_button_message() and dgtpicom_get_clock_time().
+ * The fd is created by dgtpicom_init() and closed by dgtpicom_stop().
+ *   returns the file descriptor or -1 before dgtpicom_init()
+ */
+int dgtpicom_get_event_fd();
+
+/* Get receive thread statistics.
+ *   stats = filled with overruns, fifo level, poll intervals and cpu time
+ */
+void dgtpicom_get_rx_stats(dgtpicom_rx_stats_t *stats);
+
+/* Write the last packets on the bus to a file. Every sent and received
+ * packet is kept in memory with its time, direction, adress and result,
+ * the last 512 are written. When DGTPICOM_CAPTURE is set in the
+ * environment to a path, the capture is also written there after a
+ * failed command or receive error, at most once a second.
+ * Decode a capture with: dgtpicom -c file
+ *   path = file to write
+ *   returns 0 or -10 when the file could not be written
+ */
+int dgtpicom_capture_dump(const char *path);
+
+/* Replay a recorded session against a stand-in for the I2C hardware.
+ * Set DGTPICOM_RECORD to a path before dgtpicom_init() to record a
+ * session: the bytes the receive thread got, the outcome and timing of
+ * every send and the commands the application queued. The replay runs
+ * dgtpicom_init(), queues the recorded commands at their time and lets
+ * the library handle the recorded traffic, then stops. Replay the same
+ * recording with two builds to compare them, from the command line:
+ * dgtpicom -r file
+ *   path = recording
+ *   report = filled with latency and error counts
+ *   returns 0, -10 when path is not a recording or the init error
+ */
+int dgtpicom_replay(const char *path, dgtpicom_replay_report_t *report);
+
+/* Get statistics of commands, messages and receive errors since
+ * dgtpicom_init(). They are always kept, also without debug. When
+ * DGTPICOM_STATS_SOCKET is set in the environment dgtpicom_init() also
+ * listens on a unix socket with that path and writes them as text, one
+ * "name{labels} value" line per counter, to every connection:
+ *   socat - UNIX-CONNECT:/run/dgtpicom.sock
+ *   stats = filled with the counters
+ */
+void dgtpicom_get_stats(dgtpicom_stats_t *stats);
+
 /* Return current button state.
  *   returns:
  *     binary:
@@ -109,6 +514,13 @@ int dgtpicom_get_button_message(char *buttons, char *time);
  */
 int dgtpicom_get_button_state();
 
+/* Get what the library knows about the clock, from acks, hello messages,
+ * time messages and the on/off button.
+ *   returns DGTPICOM_LINK_* bits, 0 when unknown, DGTPICOM_LINK_READY
+ *   when commands can be sent without configuring
+ */
+int dgtpicom_get_link_state();
+
 /* Turn off the dgt3000.
  *   returnMode = timing method the clock will start in when turned on
  */
@@ -121,6 +533,8 @@ void dgtpicom_stop();
 
 
 /* return codes:
+ *   -12= invalid argument
+ *   -11= deadline, the command could not be done within the budget
  *   -10= no direct access to memory, run as root
  *   -9 = receive failed, software buffer overrun, should not happen
  *   -8 = receive failed, packet to small, hardware buffer overrun
@@ -0,0 +1,141 @@
+/* hardware backends for the DGT3000 I2C communication
+ * version 0.8
+ *
+ * Copyright (C) 2015 DGT
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef DGTPICOM_BACKEND_H
+#define DGTPICOM_BACKEND_H
+
+#include <sys/types.h>
+
+/* BCM2708/9 registers used by dgtpicom, a backend maps these to the
+ * real peripherals or to an emulation of them.
+ */
+enum {
+	REG_GPFSEL0,	// GPIO function select 0-9
+	REG_GPFSEL1,	// GPIO function select 10-19
+	REG_GPFSEL2,	// GPIO function select 20-29
+	REG_GPSET0,		// GPIO set bits
+	REG_GPCLR0,		// GPIO clear bits
+	REG_GPLEV0,		// GPIO pin levels
+	REG_SLV_DR,		// I2C slave data (read pops the receive fifo)
+	REG_SLV_RSR,	// I2C slave receive status, bit 0 = overrun
+	REG_SLV_SLV,	// I2C slave adress
+	REG_SLV_CR,		// I2C slave control
+	REG_SLV_FR,		// I2C slave flags
+	REG_MST_C,		// I2C master control
+	REG_MST_S,		// I2C master status
+	REG_MST_DLEN,	// I2C master data length
+	REG_MST_A,		// I2C master slave adress
+	REG_MST_FIFO,	// I2C master data fifo
+	REG_MST_DIV,	// I2C master clock divider
+	REG_MST_DEL,	// I2C master data delay
+	REG_COUNT
+};
+
+typedef struct {
+	const char *name;
+	/* get access to the peripherals
+		*piModel = detected pi model (see checkPiModel)
+		returns ERROR_OK or ERROR_MEM */
+	int (*open)(char *piModel);
+	void (*close)(void);
+	unsigned (*read)(int reg);
+	void (*write)(int reg, unsigned value);
+	/* free running microsecond counter */
+	u_int64_t (*time)(void);
+	/* core clock in MHz, used for the I2C master divider */
+	int (*coreFreq)(void);
+	/* sleep until there is new activity on the bus
+		timeOut = max time to wait in us
+		returns 1 on activity, 0 on timeout, <0 when the backend has
+		no bus events and the caller should poll */
+	int (*wait)(u_int64_t timeOut);
+} dgtBackend_t;
+
+extern const dgtBackend_t dgtBackendHw;
+extern const dgtBackend_t dgtBackendEmu;
+extern const dgtBackend_t dgtBackendReplay;
+
+/* time source of the library, every timestamp and sleep goes through it
+ * so an emulated bus can run on virtual time.
+ */
+typedef struct {
+	const char *name;
+	/* microseconds since some start */
+	u_int64_t (*now)(void);
+	/* sleep for us microseconds */
+	void (*sleep)(u_int64_t us);
+	/* sleep while *addr==val, like a futex
+		timeOut = max time to sleep in us, <0 = forever */
+	int (*wait)(int *addr, int val, long long timeOut);
+	/* wake all threads sleeping on addr */
+	void (*wake)(int *addr);
+	/* a thread that uses the clock is about to be created */
+	void (*spawn)(void);
+} dgtClock_t;
+
+extern const dgtClock_t dgtClockReal;
+extern const dgtClock_t dgtClockVirtual;
+
+// the clock in use, set by dgtpicom_init()
+extern const dgtClock_t *dgtClock;
+
+/* record and replay, see dgtpicom_replay.c
+ */
+#define REPLAY_DATA_LENGTH 51	// longest command data
+#define RECORD_BUFFER_SIZE 65536	// bytes of events kept until the worker writes them
+
+/* record a session on top of a backend
+	path = file to write the recording to
+	inner = backend that does the work
+	returns the recording backend, or inner when the file can't be made */
+const dgtBackend_t *recordStart(const char *path, const dgtBackend_t *inner);
+
+/* record a command the application queued, does nothing when not
+	recording
+	type = CMD_CONFIGURE..CMD_OFF
+	data = command data
+	length = bytes of data */
+void recordCommand(int type, char data[], int length);
+
+/* write the buffered events to the file, only the command worker does
+	so the receive thread never waits for file io
+	returns 1 while recording, 0 when not */
+int recordFlush(void);
+
+/* bytes of events waiting to be written
+	returns 0..RECORD_BUFFER_SIZE */
+int recordPending(void);
+
+/* load a recording for dgtBackendReplay
+	path = recording
+	returns 0 or -1 when it is not a recording */
+int replayLoad(const char *path);
+
+/* wait until the replay reaches the next recorded command
+	type = filled with the command type
+	data = filled with the command data
+	returns the length of the data or -1 at the end of the recording */
+int replayNextCommand(int *type, char data[]);
+
+/* sends that could not be matched with the recording
+	unmatched = sends the recording had no outcome for
+	skipped = recorded sends the library did not make */
+void replayCounts(int *unmatched, int *skipped);
+
+#endif
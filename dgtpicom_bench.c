@@ -0,0 +1,835 @@
+/* benchmarks for dgtpicom on the virtual DGT3000
+ * version 0.8
+ *
+ * Copyright (C) 2015 DGT
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/resource.h>
+
+#include "dgtpicom.h"
+#include "dgtpicom_emu.h"
+
+#define IDLE_TIME   2000000     // us
+#define PRESSES     50
+#define STORM       300         // button presses in a storm
+#define STORM_GAP   2000        // us between presses in a storm
+#define SET_AND_RUNS 50         // set and runs under display load
+#define ACKS        200         // commands to measure ack waiting
+#define TEXTS       100         // texts to measure display throughput
+#define CONFIGURES  5           // cold and warm configures
+#define REFRESHES   100         // set and runs that change nothing
+#define QUERIES     1000        // clock time queries
+#define COUNT_DOWN  4           // s on the clock to the flag
+#define MOVES       20          // lever presses per time control run
+#define MOVE_TIME   50000       // us a move takes
+#define TEXT_TIME   10000       // us a text takes on the bus
+#define PROGRAMS    20          // program uploads
+#define SOAK_TIME   600         // s of play on virtual time
+#define RESULTS     64
+
+// results for the json file
+typedef struct {
+    const char *name;
+    double value;
+    const char *unit;
+} result_t;
+
+static result_t results[RESULTS];
+static int resultCount;
+static int checksFailed;
+
+// monotonic time in us
+static long long now() {
+    struct timespec t;
+
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return (long long)t.tv_sec * 1000000 + t.tv_nsec / 1000;
+}
+
+// cpu time used by the process in us
+static long long cpuTime() {
+    struct rusage r;
+
+    getrusage(RUSAGE_SELF, &r);
+    return (long long)(r.ru_utime.tv_sec + r.ru_stime.tv_sec) * 1000000
+           + r.ru_utime.tv_usec + r.ru_stime.tv_usec;
+}
+
+static int compare(const void *a, const void *b) {
+    long long x = *(const long long *)a, y = *(const long long *)b;
+
+    return (x > y) - (x < y);
+}
+
+// percentile p (0-100) of n sorted values
+static long long percentile(long long v[], int n, int p) {
+    return v[(n - 1) * p / 100];
+}
+
+// keep a result for the json file, name is group.measurement
+static void result(const char *group, const char *name, double value, const char *unit) {
+    static char names[RESULTS][48];
+
+    if (resultCount == RESULTS)
+        return;
+    snprintf(names[resultCount], sizeof(names[0]), "%s.%s", group, name);
+    results[resultCount].name = names[resultCount];
+    results[resultCount].value = value;
+    results[resultCount].unit = unit;
+    resultCount++;
+}
+
+// a claim the numbers have to back, a failed one fails the bench
+static void check(int ok, const char *what) {
+    if (ok)
+        return;
+    printf("CHECK FAILED: %s\n", what);
+    checksFailed++;
+}
+
+// write all results as json
+static int writeJson(const char *path) {
+    FILE *f;
+    int i;
+
+    f = fopen(path, "w");
+    if (f == NULL)
+        return -1;
+    fprintf(f, "{\n  \"benchmark\": \"dgtpicom\",\n  \"version\": \"0.8\",\n");
+    fprintf(f, "  \"time\": %ld,\n  \"results\": [\n", (long)time(NULL));
+    for (i = 0; i < resultCount; i++)
+        fprintf(f, "    {\"name\": \"%s\", \"value\": %.2f, \"unit\": \"%s\"}%s\n",
+                results[i].name, results[i].value, results[i].unit,
+                i < resultCount - 1 ? "," : "");
+    fprintf(f, "  ]\n}\n");
+    return fclose(f);
+}
+
+// start the library on a fresh virtual clock
+static int start(int receiveMode) {
+    dgtpicom_set_backend(DGTPICOM_BACKEND_EMU);
+    dgtpicom_set_receive_mode(receiveMode);
+    if (dgtpicom_init())
+        return -1;
+    if (dgtpicom_configure()) {
+        dgtpicom_stop();
+        return -1;
+    }
+    return 0;
+}
+
+// press buttons as fast as the bus allows
+static void *storm(void *x) {
+    int i;
+
+    for (i = 0; i < STORM; i++) {
+        dgtemu_button(1 << (i % 5), STORM_GAP / 2);
+        dgtemu_sleep(STORM_GAP);
+    }
+    *(int *)x = 1;
+    return 0;
+}
+
+// storm while the display is updated, returns the texts sent
+static int stormText() {
+    int done = 0, texts = 0;
+    char but, tim;
+    pthread_t p;
+
+    pthread_create(&p, NULL, storm, &done);
+    while (!done) {
+        dgtpicom_set_text(texts & 1 ? "storm" : "STORM", 0, 0, 0);
+        texts++;
+        while (dgtpicom_get_button_message(&but, &tim));
+    }
+    pthread_join(p, NULL);
+    return texts;
+}
+
+// fifo overruns during a storm on virtual time, a host that does not run
+// us for a while can't fill the fifo there, only the receive mode can
+static void benchStormVirtual(int receiveMode, const char *name) {
+    dgtpicom_rx_stats_t rx;
+
+    dgtpicom_set_clock(DGTPICOM_CLOCK_VIRTUAL);
+    if (start(receiveMode)) {
+        dgtpicom_set_clock(DGTPICOM_CLOCK_REAL);
+        printf("%-8s virtual storm start failed\n", name);
+        return;
+    }
+    stormText();
+    dgtpicom_get_rx_stats(&rx);
+    dgtpicom_stop();
+    dgtpicom_set_clock(DGTPICOM_CLOCK_REAL);
+
+    printf("%-8s virtual storm  overruns %u  max fifo %2d\n", name, rx.overruns, rx.maxFifoLevel);
+    result(name, "virtual_storm_overruns", rx.overruns, "count");
+    check(rx.overruns == 0, "the fifo overran in a storm on virtual time");
+}
+
+// idle cpu usage, button to api latency and fifo overruns during a
+// button storm of a receive mode
+static void benchReceive(int receiveMode, const char *name) {
+    long long lat[PRESSES];
+    long long c, t, sc, st;
+    long long rc, rsc, pt;
+    unsigned polls;
+    char but, tim;
+    int i, texts, overruns;
+    dgtpicom_rx_stats_t rx;
+
+    if (start(receiveMode)) {
+        printf("%-6s start failed\n", name);
+        return;
+    }
+
+    dgtpicom_get_rx_stats(&rx);
+    rc = rx.cpuTime;
+    c = cpuTime();
+    t = now();
+    usleep(IDLE_TIME);
+    c = cpuTime() - c;
+    t = now() - t;
+    dgtpicom_get_rx_stats(&rx);
+    rc = rx.cpuTime - rc;
+
+    for (i = 0; i < PRESSES; i++) {
+        while (dgtpicom_get_button_message(&but, &tim));
+        lat[i] = now();
+        dgtemu_button(0x04, 1000);
+        dgtpicom_wait_button_message(&but, &tim, 100000);
+        lat[i] = now() - lat[i];
+        usleep(20000);
+    }
+
+    // storm while the display is updated
+    dgtpicom_get_rx_stats(&rx);
+    rsc = rx.cpuTime;
+    overruns = rx.overruns;
+    polls = rx.polls;
+    pt = rx.pollTime;
+    sc = cpuTime();
+    st = now();
+    texts = stormText();
+    sc = cpuTime() - sc;
+    st = now() - st;
+    dgtpicom_get_rx_stats(&rx);
+    rsc = rx.cpuTime - rsc;
+    overruns = rx.overruns - overruns;
+    // the storm only, not the idle time before it
+    if (rx.polls > polls)
+        rx.avgPollInterval = (rx.pollTime - pt) / (rx.polls - polls);
+    dgtpicom_stop();
+
+    qsort(lat, PRESSES, sizeof(long long), compare);
+    printf("%-8s idle cpu %5.2f%% (rx thread %5.2f%%)  button latency p50 %5lldus p99 %5lldus max %5lldus\n",
+           name, 100.0 * c / t, 100.0 * rc / t, percentile(lat, PRESSES, 50),
+           percentile(lat, PRESSES, 99), lat[PRESSES - 1]);
+    printf("%-8s storm cpu %5.1f%% (rx thread %5.1f%%)  overruns %d  max fifo %2d  avg poll %4dus  texts %d\n",
+           name, 100.0 * sc / st, 100.0 * rsc / st, overruns, rx.maxFifoLevel,
+           rx.avgPollInterval, texts);
+    result(name, "idle_cpu", 100.0 * c / t, "%");
+    result(name, "idle_rx_thread_cpu", 100.0 * rc / t, "%");
+    result(name, "button_latency_p50", percentile(lat, PRESSES, 50), "us");
+    result(name, "button_latency_p99", percentile(lat, PRESSES, 99), "us");
+    result(name, "storm_cpu", 100.0 * sc / st, "%");
+    result(name, "storm_rx_thread_cpu", 100.0 * rsc / st, "%");
+    result(name, "storm_overruns", overruns, "count");
+
+    benchStormVirtual(receiveMode, name);
+}
+
+// latency and cpu time of commands that wait for an ack
+static void benchAck() {
+    long long lat[ACKS];
+    long long c, t;
+    int i;
+
+    if (start(DGTPICOM_RX_EVENT)) {
+        printf("ack start failed\n");
+        return;
+    }
+
+    // after the time message that follows each set and run
+    c = 0;
+    for (i = 0; i < ACKS; i++) {
+        usleep(5000);
+        t = cpuTime();
+        lat[i] = now();
+        // a new time each time, the same would not be sent
+        dgtpicom_set_and_run(1, 0, 5, i % 60, 0, 0, 5, 0);
+        lat[i] = now() - lat[i];
+        c += cpuTime() - t;
+    }
+    dgtpicom_stop();
+
+    qsort(lat, ACKS, sizeof(long long), compare);
+    printf("setnrun  cpu %4lldus/command  latency p50 %5lldus p99 %5lldus\n",
+           c / ACKS, percentile(lat, ACKS, 50), percentile(lat, ACKS, 99));
+    result("set_and_run", "cpu", c / ACKS, "us");
+    result("set_and_run", "latency_p50", percentile(lat, ACKS, 50), "us");
+    result("set_and_run", "latency_p99", percentile(lat, ACKS, 99), "us");
+}
+
+// latency and throughput of texts back to back
+static void benchText() {
+    long long lat[TEXTS];
+    long long t;
+    char text[12];
+    int i, failed = 0;
+
+    if (start(DGTPICOM_RX_EVENT)) {
+        printf("text start failed\n");
+        return;
+    }
+
+    t = now();
+    for (i = 0; i < TEXTS; i++) {
+        snprintf(text, sizeof(text), "text %d", i);
+        lat[i] = now();
+        if (dgtpicom_set_text(text, 0, 0, 0))
+            failed++;
+        lat[i] = now() - lat[i];
+    }
+    t = now() - t;
+    dgtpicom_stop();
+
+    qsort(lat, TEXTS, sizeof(long long), compare);
+    printf("text     %5.1f/s  latency p50 %5lldus p99 %5lldus  failed %d\n",
+           1000000.0 * TEXTS / t, percentile(lat, TEXTS, 50),
+           percentile(lat, TEXTS, 99), failed);
+    result("set_text", "throughput", 1000000.0 * TEXTS / t, "1/s");
+    result("set_text", "latency_p50", percentile(lat, TEXTS, 50), "us");
+    result("set_text", "latency_p99", percentile(lat, TEXTS, 99), "us");
+    result("set_text", "failed", failed, "count");
+}
+
+// configure before every text like the demo loop, count what goes on
+// the bus for each text
+static void benchConfigureText() {
+    long long t;
+    char text[12];
+    int i, j, failed = 0;
+    unsigned sent = 0;
+    dgtpicom_stats_t s;
+
+    if (start(DGTPICOM_RX_EVENT)) {
+        printf("configure and text start failed\n");
+        return;
+    }
+    dgtpicom_get_stats(&s);
+    for (j = 0; j < DGTPICOM_STATS_MESSAGES; j++)
+        sent -= s.message[j].sent;
+
+    t = now();
+    for (i = 0; i < TEXTS; i++) {
+        snprintf(text, sizeof(text), "text %d", i);
+        if (dgtpicom_configure() || dgtpicom_set_text(text, 0, 0, 0))
+            failed++;
+    }
+    t = now() - t;
+    dgtpicom_get_stats(&s);
+    dgtpicom_stop();
+    for (j = 0; j < DGTPICOM_STATS_MESSAGES; j++)
+        sent += s.message[j].sent;
+
+    printf("conf+text %5.1f/s  %.2f messages a text  failed %d\n",
+           1000000.0 * TEXTS / t, (double)sent / TEXTS, failed);
+    result("configure_text", "throughput", 1000000.0 * TEXTS / t, "1/s");
+    result("configure_text", "messages", (double)sent / TEXTS, "1/text");
+    result("configure_text", "failed", failed, "count");
+}
+
+// configure on a clock that was just started and on one that runs
+static void benchConfigure() {
+    long long init[CONFIGURES], cold[CONFIGURES], warm[CONFIGURES];
+    int i;
+    dgtpicom_stats_t s;
+
+    for (i = 0; i < CONFIGURES; i++) {
+        dgtpicom_set_backend(DGTPICOM_BACKEND_EMU);
+        dgtpicom_set_receive_mode(DGTPICOM_RX_EVENT);
+        if (dgtpicom_init()) {
+            printf("configure start failed\n");
+            return;
+        }
+        dgtpicom_get_stats(&s);
+        init[i] = s.initTime;
+        cold[i] = now();
+        dgtpicom_configure();
+        cold[i] = now() - cold[i];
+        warm[i] = now();
+        dgtpicom_configure();
+        warm[i] = now() - warm[i];
+        dgtpicom_stop();
+    }
+
+    qsort(init, CONFIGURES, sizeof(long long), compare);
+    qsort(cold, CONFIGURES, sizeof(long long), compare);
+    qsort(warm, CONFIGURES, sizeof(long long), compare);
+    printf("init      p50 %6lldus max %6lldus\n",
+           percentile(init, CONFIGURES, 50), init[CONFIGURES - 1]);
+    printf("configure cold p50 %6lldus max %6lldus  warm p50 %6lldus max %6lldus\n",
+           percentile(cold, CONFIGURES, 50), cold[CONFIGURES - 1],
+           percentile(warm, CONFIGURES, 50), warm[CONFIGURES - 1]);
+    result("configure", "init_p50", percentile(init, CONFIGURES, 50), "us");
+    result("configure", "cold_p50", percentile(cold, CONFIGURES, 50), "us");
+    result("configure", "warm_p50", percentile(warm, CONFIGURES, 50), "us");
+}
+
+// init, configure and a set and run, what a process does to show a time
+static long long takeOver(int start, int *failed) {
+    long long t;
+
+    dgtpicom_set_backend(DGTPICOM_BACKEND_EMU);
+    dgtpicom_set_receive_mode(DGTPICOM_RX_EVENT);
+    dgtpicom_set_start(start);
+    t = now();
+    if (dgtpicom_init()) {
+        (*failed)++;
+        return 0;
+    }
+    if (dgtpicom_configure() || dgtpicom_set_and_run(1, 0, 5, 0, 0, 0, 5, 0))
+        (*failed)++;
+    t = now() - t;
+    dgtpicom_stop();
+    return t;
+}
+
+// a second process taking over a configured clock
+static void benchAttach() {
+    long long reset, attach, off;
+    int failed = 0;
+
+    dgtemu_keep(1);
+    takeOver(DGTPICOM_START_ATTACH, &failed);
+    reset = takeOver(DGTPICOM_START_RESET, &failed);
+    takeOver(DGTPICOM_START_ATTACH, &failed);
+    attach = takeOver(DGTPICOM_START_ATTACH, &failed);
+    // switched off in between, attaching has to find out and configure
+    dgtemu_power();
+    dgtemu_sleep(100000);   // nobody takes its power message, let it give up
+    off = takeOver(DGTPICOM_START_ATTACH, &failed);
+    dgtemu_keep(0);
+    dgtpicom_set_start(DGTPICOM_START_RESET);
+
+    printf("takeover reset %6lldus  attach %6lldus  attach to an off clock %6lldus  failed %d\n",
+           reset, attach, off, failed);
+    result("takeover", "reset", reset, "us");
+    result("takeover", "attach", attach, "us");
+    result("takeover", "attach_off", off, "us");
+    result("takeover", "failed", failed, "count");
+}
+
+// set and runs that would not change the clock, like an app that
+// refreshes the clock after every move
+static void benchRefresh() {
+    long long lat[REFRESHES];
+    int i, j, failed = 0;
+    unsigned sent = 0;
+    dgtpicom_stats_t s;
+
+    if (start(DGTPICOM_RX_EVENT)) {
+        printf("refresh start failed\n");
+        return;
+    }
+    if (dgtpicom_set_and_run(0, 0, 5, 0, 0, 0, 5, 0))
+        failed++;
+    // the time message after the ack
+    usleep(20000);
+    dgtpicom_get_stats(&s);
+    for (j = 0; j < DGTPICOM_STATS_MESSAGES; j++)
+        sent -= s.message[j].sent;
+
+    for (i = 0; i < REFRESHES; i++) {
+        lat[i] = now();
+        if (i % 2 ? dgtpicom_run(0, 0) : dgtpicom_set_and_run(0, 0, 5, 0, 0, 0, 5, 0))
+            failed++;
+        lat[i] = now() - lat[i];
+    }
+    dgtpicom_get_stats(&s);
+    dgtpicom_stop();
+    for (j = 0; j < DGTPICOM_STATS_MESSAGES; j++)
+        sent += s.message[j].sent;
+
+    qsort(lat, REFRESHES, sizeof(long long), compare);
+    printf("refresh  latency p50 %5lldus p99 %5lldus  sent %u  elided %u/%d  failed %d\n",
+           percentile(lat, REFRESHES, 50), percentile(lat, REFRESHES, 99),
+           sent, s.setAndRunElided, REFRESHES, failed);
+    result("refresh", "latency_p50", percentile(lat, REFRESHES, 50), "us");
+    result("refresh", "sent", sent, "count");
+    result("refresh", "elided", s.setAndRunElided, "count");
+}
+
+// what the clock time query costs and how far it is off when the next
+// time message comes in and when the flag falls
+static void benchInterpolate() {
+    long long lat[QUERIES], err, worst = 0, flagErr = 0, end;
+    dgtpicom_clock_time_t t, last;
+    dgtpicom_clock_state_t s;
+    int i, ticks = 0, failed = 0, flagged = 0, shown;
+
+    if (start(DGTPICOM_RX_EVENT)) {
+        printf("interpolate start failed\n");
+        return;
+    }
+    if (dgtpicom_set_and_run(1, 0, 0, COUNT_DOWN, 0, 0, 0, 0))
+        failed++;
+    usleep(20000);
+
+    for (i = 0; i < QUERIES; i++) {
+        lat[i] = now();
+        dgtpicom_get_clock_time(&t);
+        lat[i] = now() - lat[i];
+    }
+
+    // follow it every ms until the clock reports the flag
+    dgtpicom_get_clock_time(&last);
+    end = now() + (COUNT_DOWN + 2) * 1000000LL;
+    while (!flagged && now() < end) {
+        usleep(1000);
+        dgtpicom_get_clock_time(&t);
+        if (t.seq == last.seq || dgtpicom_get_clock_state(&s) != t.seq)
+            continue;
+        // what we said then, counted on to the new message
+        shown = ((s.time[0] * 60 + s.time[1]) * 60 + s.time[2]) * 1000;
+        if (shown != last.time[0]) {
+            err = last.time[0] - (long long)(s.timestamp - last.at) / 1000 - shown;
+            if (err < 0)
+                err = -err;
+            if (err > worst)
+                worst = err;
+            ticks++;
+        }
+        if (s.leftFlag) {
+            flagErr = (long long)(s.timestamp - last.flagFall);
+            flagged = 1;
+        }
+        last = t;
+    }
+    dgtpicom_stop();
+
+    if (!flagged || ticks == 0)
+        failed++;
+    qsort(lat, QUERIES, sizeof(long long), compare);
+    printf("interpolate  query p50 %5lldus p99 %5lldus  error worst %lldms over %d s  flag %+lldus from predicted  failed %d\n",
+           percentile(lat, QUERIES, 50), percentile(lat, QUERIES, 99),
+           worst, ticks, flagErr, failed);
+    result("interpolate", "query_p50", percentile(lat, QUERIES, 50), "us");
+    result("interpolate", "error_worst", worst, "ms");
+    result("interpolate", "flag_error", flagErr, "us");
+}
+
+// press the lever for a side and wait until the clock runs the other one
+static long long leverToRun(int side, long long *pressed) {
+    dgtpicom_clock_state_t s;
+    unsigned seq;
+    long long start, end;
+
+    seq = dgtpicom_get_clock_state(&s);
+    start = now();
+    *pressed = start;
+    end = start + 1000000;
+    dgtemu_lever(side);
+    while (now() < end) {
+        if (dgtpicom_get_clock_state(&s) != seq) {
+            seq = s.seq;
+            if ((side ? s.rightRun : s.leftRun) == 0 && (side ? s.leftRun : s.rightRun) == 1)
+                return now() - start;
+        }
+        usleep(100);
+    }
+    return -1;
+}
+
+// keep the display busy like a marquee
+static void *marquee(void *x) {
+    char text[12];
+    int i = 0;
+
+    while (!*(int *)x) {
+        snprintf(text, sizeof(text), "%*s", 1 + i++ % 11, "DGT");
+        dgtpicom_set_text(text, 0, 0, 0);
+    }
+    return 0;
+}
+
+// the application answering the lever with a set and run
+static void *leverAnswer(void *x) {
+    char buttons, time;
+
+    while (!*(int *)x) {
+        if (dgtpicom_wait_button_message(&buttons, &time, 100000) <= 0)
+            continue;
+        // the bit the clock sends is set with the right side down
+        if (buttons == 0xc0)
+            dgtpicom_set_and_run_async(1, 0, 5, 0, 0, 0, 5, 0);
+        else if (buttons == 0x40)
+            dgtpicom_set_and_run_async(0, 0, 5, 0, 1, 0, 5, 0);
+    }
+    return 0;
+}
+
+// lever to clock latency of the time control in the library against an
+// application answering lever messages, and the move times it reports
+static void benchTimeControl() {
+    long long native[MOVES], busy[MOVES], app[MOVES], pressed[MOVES], err, worst = 0;
+    dgtpicom_tc_move_t m;
+    char buttons, time;
+    int i, failed = 0, moves = 0, done = 0, expect;
+    pthread_t p;
+
+    if (start(DGTPICOM_RX_EVENT)) {
+        printf("time control start failed\n");
+        return;
+    }
+    // the lever is down on the left, right moves first
+    if (dgtpicom_tc_start(DGTPICOM_TC_FISCHER, 300, 300, 2, 1))
+        failed++;
+    for (i = 0; i < MOVES; i++) {
+        usleep(MOVE_TIME);
+        native[i] = leverToRun(!(i % 2), &pressed[i]);
+        if (native[i] < 0)
+            failed++;
+
+        // the move time against ours, the time left with 2s per move
+        while (dgtpicom_tc_get_move(&m) > 0) {
+            if (moves > 0) {
+                err = m.moveTime - (pressed[moves] - pressed[moves - 1]) / 1000;
+                if (err < 0)
+                    err = -err;
+                if (err > worst)
+                    worst = err;
+            }
+            // whole seconds, the 50ms moves round away
+            expect = 300000 + (moves / 2 + 1) * 2000;
+            if (m.side != !(moves % 2) || m.time[(int)m.side] != expect)
+                failed++;
+            moves++;
+        }
+    }
+    if (moves != MOVES)
+        failed++;
+
+    // with the display busy, the lever goes before the next text
+    pthread_create(&p, NULL, marquee, &done);
+    for (i = 0; i < MOVES; i++) {
+        usleep(MOVE_TIME);
+        busy[i] = leverToRun(!(i % 2), &pressed[i]);
+        if (busy[i] < 0)
+            failed++;
+    }
+    done = 1;
+    pthread_join(p, NULL);
+    done = 0;
+    while (dgtpicom_tc_get_move(&m) > 0);
+    dgtpicom_tc_stop();
+
+    // the lever messages the library answered
+    while (dgtpicom_get_button_message(&buttons, &time) > 0);
+    pthread_create(&p, NULL, leverAnswer, &done);
+    for (i = 0; i < MOVES; i++) {
+        usleep(MOVE_TIME);
+        app[i] = leverToRun(!(i % 2), &pressed[i]);
+        if (app[i] < 0)
+            failed++;
+    }
+    done = 1;
+    pthread_join(p, NULL);
+    dgtpicom_stop();
+
+    qsort(native, MOVES, sizeof(long long), compare);
+    qsort(busy, MOVES, sizeof(long long), compare);
+    qsort(app, MOVES, sizeof(long long), compare);
+    printf("tc       lever to clock p50 %5lldus p99 %5lldus  application p50 %5lldus p99 %5lldus  moves %d/%d  move time off %lldms  failed %d\n",
+           percentile(native, MOVES, 50), percentile(native, MOVES, 99),
+           percentile(app, MOVES, 50), percentile(app, MOVES, 99),
+           moves, MOVES, worst, failed);
+    printf("tc       lever to clock with a marquee p50 %5lldus p99 %5lldus max %5lldus\n",
+           percentile(busy, MOVES, 50), percentile(busy, MOVES, 99), busy[MOVES - 1]);
+    result("tc", "lever_p50", percentile(native, MOVES, 50), "us");
+    result("tc", "lever_marquee_p99", percentile(busy, MOVES, 99), "us");
+    // waiting for the whole display command takes more than a text
+    check(percentile(busy, MOVES, 50) < percentile(native, MOVES, 50) + TEXT_TIME / 2,
+          "the lever waited for the display");
+    result("tc", "application_p50", percentile(app, MOVES, 50), "us");
+    result("tc", "move_time_error", worst, "ms");
+}
+
+// program upload latency, and the clock and the library agree on it
+static void benchProgram() {
+    long long lat[PROGRAMS];
+    char program[DGTPICOM_PROGRAM_LENGTH], got[DGTPICOM_PROGRAM_LENGTH];
+    int i, j, failed = 0;
+
+    if (start(DGTPICOM_RX_EVENT)) {
+        printf("program start failed\n");
+        return;
+    }
+    for (i = 0; i < PROGRAMS; i++) {
+        for (j = 0; j < DGTPICOM_PROGRAM_LENGTH; j++)
+            program[j] = i + j;
+        lat[i] = now();
+        if (dgtpicom_set_program(program, DGTPICOM_PROGRAM_LENGTH))
+            failed++;
+        lat[i] = now() - lat[i];
+        if (dgtemu_get_program(got) != DGTPICOM_PROGRAM_LENGTH
+                || memcmp(got, program, DGTPICOM_PROGRAM_LENGTH))
+            failed++;
+        if (dgtpicom_get_program(got) != DGTPICOM_PROGRAM_LENGTH
+                || memcmp(got, program, DGTPICOM_PROGRAM_LENGTH))
+            failed++;
+    }
+    dgtpicom_stop();
+
+    qsort(lat, PROGRAMS, sizeof(long long), compare);
+    printf("program  latency p50 %5lldus p99 %5lldus  failed %d\n",
+           percentile(lat, PROGRAMS, 50), percentile(lat, PROGRAMS, 99), failed);
+    result("program", "latency_p50", percentile(lat, PROGRAMS, 50), "us");
+}
+
+// set and run latency on an idle bus and while the display is saturated
+static void benchPriority() {
+    long long idle[SET_AND_RUNS], load[SET_AND_RUNS];
+    int i, done = 0;
+    pthread_t p;
+    dgtpicom_display_stats_t ds;
+
+    if (start(DGTPICOM_RX_EVENT)) {
+        printf("priority start failed\n");
+        return;
+    }
+
+    for (i = 0; i < SET_AND_RUNS; i++) {
+        idle[i] = now();
+        dgtpicom_set_and_run(1, 0, 5, i % 60, 0, 0, 5, 0);
+        idle[i] = now() - idle[i];
+        usleep(10000);
+    }
+
+    pthread_create(&p, NULL, marquee, &done);
+    for (i = 0; i < SET_AND_RUNS; i++) {
+        // land somewhere in a display update
+        usleep(7000 + i * 331 % 5000);
+        load[i] = now();
+        dgtpicom_set_and_run(i & 1, 0, 5, 0, !(i & 1), 0, 5, 0);
+        load[i] = now() - load[i];
+    }
+    done = 1;
+    pthread_join(p, NULL);
+    dgtpicom_get_display_stats(&ds);
+    dgtpicom_stop();
+
+    qsort(idle, SET_AND_RUNS, sizeof(long long), compare);
+    qsort(load, SET_AND_RUNS, sizeof(long long), compare);
+    printf("setnrun  idle     p50 %5lldus p99 %5lldus max %5lldus\n",
+           percentile(idle, SET_AND_RUNS, 50), percentile(idle, SET_AND_RUNS, 99),
+           idle[SET_AND_RUNS - 1]);
+    printf("setnrun  marquee  p50 %5lldus p99 %5lldus max %5lldus  preempted %d\n",
+           percentile(load, SET_AND_RUNS, 50), percentile(load, SET_AND_RUNS, 99),
+           load[SET_AND_RUNS - 1], ds.preempted);
+    result("set_and_run", "idle_p99", percentile(idle, SET_AND_RUNS, 99), "us");
+    result("set_and_run", "marquee_p50", percentile(load, SET_AND_RUNS, 50), "us");
+    result("set_and_run", "marquee_p99", percentile(load, SET_AND_RUNS, 99), "us");
+}
+
+// a game on virtual time: a clock update every second, a text every
+// 10s and a button press every 3s
+static void benchSoak() {
+    long long t;
+    u_int64_t v;
+    char text[12], but, tim;
+    int i, failed = 0, pressed = 0, buttons = 0;
+    dgtpicom_stats_t s;
+
+    dgtpicom_set_clock(DGTPICOM_CLOCK_VIRTUAL);
+    if (start(DGTPICOM_RX_EVENT)) {
+        dgtpicom_set_clock(DGTPICOM_CLOCK_REAL);
+        printf("soak start failed\n");
+        return;
+    }
+
+    t = now();
+    v = dgtemu_time();
+    for (i = 0; i < SOAK_TIME; i++) {
+        if (dgtpicom_set_and_run(1, 0, 5, i % 60, 0, 0, 5, 0))
+            failed++;
+        if (i % 10 == 0) {
+            snprintf(text, sizeof(text), "move %d", i / 10);
+            if (dgtpicom_set_text(text, 0, 0, 0))
+                failed++;
+        }
+        if (i % 3 == 0) {
+            dgtemu_button(0x04, 50000);
+            pressed++;
+        }
+        dgtemu_sleep(1000000);
+        while (dgtpicom_get_button_message(&but, &tim) > 0)
+            buttons++;
+    }
+    v = dgtemu_time() - v;
+    t = now() - t;
+    dgtpicom_get_stats(&s);
+    dgtpicom_stop();
+    dgtpicom_set_clock(DGTPICOM_CLOCK_REAL);
+
+    printf("soak     %.0fs of play in %.2fs (%.0fx)  failed %d  buttons %d/%d  rx errors %u\n",
+           v / 1000000.0, t / 1000000.0, (double)v / t, failed, buttons, pressed,
+           s.rxTimeouts + s.rxCRCFaults + s.rxOverruns + s.rxSizeMismatch);
+    result("soak", "speedup", (double)v / t, "x");
+    result("soak", "failed", failed, "count");
+    result("soak", "buttons_lost", pressed - buttons, "count");
+}
+
+// dgtpicom_bench [results.json]
+int main(int argc, char *argv[]) {
+    printf("configure, wakes the clock and sets central control\n");
+    benchConfigure();
+    printf("takeover, init, configure and a set and run of a second process\n");
+    benchAttach();
+    printf("display, a text takes ~10ms on the bus\n");
+    benchText();
+    benchConfigureText();
+    printf("receive thread, a button message takes ~660us on the bus\n");
+    benchReceive(DGTPICOM_RX_POLL, "poll");
+    benchReceive(DGTPICOM_RX_ADAPTIVE, "adaptive");
+    benchReceive(DGTPICOM_RX_EVENT, "event");
+    printf("ack waiting, a set and run and its ack take ~2ms on the bus\n");
+    benchAck();
+    benchRefresh();
+    printf("clock time between time messages, %d s to the flag\n", COUNT_DOWN);
+    benchInterpolate();
+    printf("time control, a set and run and its time message take ~3ms on the bus\n");
+    benchTimeControl();
+    printf("program, %d bytes take ~5ms on the bus\n", DGTPICOM_PROGRAM_LENGTH + 5);
+    benchProgram();
+    printf("command priority, a text takes ~10ms on the bus\n");
+    benchPriority();
+    printf("virtual time, %d s of play\n", SOAK_TIME);
+    benchSoak();
+
+    if (argc == 2 && writeJson(argv[1])) {
+        printf("could not write %s\n", argv[1]);
+        return -1;
+    }
+    return checksFailed ? 1 : 0;
+}
@@ -0,0 +1,249 @@
+/* virtual time for dgtpicom on the emulated bus
+ * version 0.8
+ *
+ * Copyright (C) 2015 DGT
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Virtual time only moves when the threads using it let it. A thread
+ * joins the clock the first time it reads or sleeps on it and leaves
+ * when it exits. When every thread that joined sleeps on the clock, time
+ * jumps to the first wake up, so an idle bus costs nothing and hours of
+ * play take seconds.
+ *
+ * Threads the library creates are counted before they run. A thread that
+ * reads the time while all others sleep is polling, each read moves the
+ * time a little.
+ *
+ * A thread can block on something the clock does not know about, a
+ * mutex or a join. So time never stands still: when it did not move for
+ * VCLOCK_IDLE real us, it moves VCLOCK_IDLE us.
+ */
+
+#include <pthread.h>
+#include <stddef.h>
+#include <time.h>
+#include <sys/types.h>
+
+#include "dgtpicom_backend.h"
+
+#define VCLOCK_IDLE         1000    // real us before virtual time follows real time
+#define VCLOCK_POLL         1       // us a look at the time takes when polling
+#define VCLOCK_FOREVER      ((u_int64_t)-1)
+
+typedef struct vclockWaiter_s {
+    int *addr;              // NULL = plain sleep
+    u_int64_t until;        // virtual time to wake up, VCLOCK_FOREVER = none
+    int woken;
+    struct vclockWaiter_s *next;
+} vclockWaiter_t;
+
+typedef struct {
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    pthread_once_t once;
+    pthread_key_t key;
+
+    u_int64_t now;          // virtual time in us
+    u_int64_t lastMove;     // real time virtual time last moved in us
+    int threads;            // threads that joined or are about to
+    int starting;           // of those, created but not joined yet
+    int waiting;            // of those, sleeping on the clock
+    vclockWaiter_t *waiters;
+} vclock_t;
+
+static vclock_t vc = {
+    .mutex = PTHREAD_MUTEX_INITIALIZER,
+    .once = PTHREAD_ONCE_INIT
+};
+
+static u_int64_t vclockReal() {
+    struct timespec t;
+
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return (u_int64_t)t.tv_sec * 1000000 + t.tv_nsec / 1000;
+}
+
+// wake the sleepers that are due, called with vc.mutex locked
+static void vclockExpire() {
+    vclockWaiter_t *w;
+    int woken = 0;
+
+    for (w = vc.waiters; w != NULL; w = w->next) {
+        if (!w->woken && w->until <= vc.now) {
+            w->woken = 1;
+            vc.waiting--;
+            woken++;
+        }
+    }
+    vc.lastMove = vclockReal();
+    if (woken)
+        pthread_cond_broadcast(&vc.cond);
+}
+
+// move time when everybody sleeps or nobody moved it for a while,
+// called with vc.mutex locked
+static void vclockMove() {
+    vclockWaiter_t *w;
+    u_int64_t first = VCLOCK_FOREVER, real;
+
+    if (vc.waiting > 0 && vc.waiting >= vc.threads) {
+        for (w = vc.waiters; w != NULL; w = w->next)
+            if (!w->woken && w->until < first)
+                first = w->until;
+        if (first != VCLOCK_FOREVER) {
+            if (first > vc.now)
+                vc.now = first;
+            vclockExpire();
+            return;
+        }
+    }
+
+    // a step at a time, a host that did not run us for a while should
+    // not look like a bus that stalled
+    real = vclockReal();
+    if (real - vc.lastMove >= VCLOCK_IDLE) {
+        vc.now += VCLOCK_IDLE;
+        vclockExpire();
+    }
+}
+
+// a thread that exits leaves the clock
+static void vclockLeave(void *x) {
+    pthread_mutex_lock(&vc.mutex);
+    vc.threads--;
+    vclockMove();
+    pthread_mutex_unlock(&vc.mutex);
+}
+
+static void vclockKey() {
+    pthread_condattr_t attr;
+
+    pthread_key_create(&vc.key, vclockLeave);
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&vc.cond, &attr);
+    pthread_condattr_destroy(&attr);
+    vc.lastMove = vclockReal();
+}
+
+// the calling thread joins the clock, called with vc.mutex locked
+static void vclockJoin() {
+    if (pthread_getspecific(vc.key) == NULL) {
+        pthread_setspecific(vc.key, &vc);
+        if (vc.starting > 0)
+            vc.starting--;
+        else
+            vc.threads++;
+    }
+}
+
+// count a new thread before it runs, time must not jump ahead while it
+// starts up
+static void vclockSpawn() {
+    pthread_once(&vc.once, vclockKey);
+    pthread_mutex_lock(&vc.mutex);
+    vc.threads++;
+    vc.starting++;
+    pthread_mutex_unlock(&vc.mutex);
+}
+
+static u_int64_t vclockNow() {
+    u_int64_t t;
+
+    pthread_once(&vc.once, vclockKey);
+    pthread_mutex_lock(&vc.mutex);
+    vclockJoin();
+    // the only thread running looks at the time, it polls something that
+    // changes with time like the bus, every look takes some time
+    if (vc.waiting == vc.threads - 1) {
+        vc.now += VCLOCK_POLL;
+        vclockExpire();
+    } else {
+        vclockMove();
+    }
+    t = vc.now;
+    pthread_mutex_unlock(&vc.mutex);
+    return t;
+}
+
+static int vclockWait(int *addr, int val, long long timeOut) {
+    vclockWaiter_t w, **p;
+    struct timespec ts;
+    u_int64_t t;
+
+    pthread_once(&vc.once, vclockKey);
+    pthread_mutex_lock(&vc.mutex);
+    vclockJoin();
+    if ((addr != NULL && *addr != val) || timeOut == 0) {
+        pthread_mutex_unlock(&vc.mutex);
+        return -1;
+    }
+
+    w.addr = addr;
+    w.until = timeOut < 0 ? VCLOCK_FOREVER : vc.now + timeOut;
+    w.woken = 0;
+    w.next = vc.waiters;
+    vc.waiters = &w;
+    vc.waiting++;
+
+    while (1) {
+        vclockMove();
+        if (w.woken)
+            break;
+        // without a time out only a wake can end it
+        if (w.until == VCLOCK_FOREVER) {
+            pthread_cond_wait(&vc.cond, &vc.mutex);
+            continue;
+        }
+        t = vclockReal() + VCLOCK_IDLE;
+        ts.tv_sec = t / 1000000;
+        ts.tv_nsec = (t % 1000000) * 1000;
+        pthread_cond_timedwait(&vc.cond, &vc.mutex, &ts);
+    }
+
+    for (p = &vc.waiters; *p != &w; p = &(*p)->next);
+    *p = w.next;
+    pthread_mutex_unlock(&vc.mutex);
+    return 0;
+}
+
+static void vclockSleep(u_int64_t us) {
+    vclockWait(NULL, 0, us);
+}
+
+static void vclockWake(int *addr) {
+    vclockWaiter_t *w;
+
+    pthread_once(&vc.once, vclockKey);
+    pthread_mutex_lock(&vc.mutex);
+    for (w = vc.waiters; w != NULL; w = w->next) {
+        if (!w->woken && w->addr == addr) {
+            w->woken = 1;
+            vc.waiting--;
+        }
+    }
+    pthread_cond_broadcast(&vc.cond);
+    pthread_mutex_unlock(&vc.mutex);
+}
+
+const dgtClock_t dgtClockVirtual = {
+    "virtual",
+    vclockNow,
+    vclockSleep,
+    vclockWait,
+    vclockWake,
+    vclockSpawn
+};
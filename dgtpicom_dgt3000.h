@@ -19,7 +19,11 @@
  
 #include <pthread.h>
 
+#include "dgtpicom_backend.h"
+
 /* return codes:
+ *   -12= invalid argument
+ *   -11= deadline, the command could not be done within the budget
  *   -10= no direct access to memory, run as root
  *   -9 = receive failed, software buffer overrun, should not happen
  *   -8 = receive failed, Hardware buffer overrun, load to hi
@@ -34,6 +38,8 @@
  */
  
 
+#define	ERROR_ARG		-12
+#define	ERROR_DEADLINE	-11
 #define	ERROR_MEM		-10
 #define	ERROR_SWB_FULL	-9
 #define	ERROR_HWB_FULL	-8
@@ -53,9 +59,31 @@
 #define I2C_SLAVE_BASE 0x214000
 #define I2C_MASTER_BASE 0x804000
 
-#define SDA1IN ((*gpioin >> 2) & 1)    // SDA1 = GPIO 2
-#define SCL1IN ((*gpioin >> 3) & 1)    // SCL1 = GPIO 3
+// register access through the selected backend
+#define RD(reg) backend->read(reg)
+#define WR(reg,value) backend->write(reg,value)
+
+#define SDA1IN ((RD(REG_GPLEV0) >> 2) & 1)    // SDA1 = GPIO 2
+#define SCL1IN ((RD(REG_GPLEV0) >> 3) & 1)    // SCL1 = GPIO 3
+
+
+// receive thread, time between polls and max time to wait for a bus event
+#define RX_POLL_INTERVAL 400
+#define RX_IDLE_TIMEOUT 100000
+
+// adaptive polling sleeps between RX_POLL_MIN and a ceiling of at most
+// RX_POLL_MAX us. 16 bytes in the fifo take 1.5ms. A poll that finds
+// RX_FIFO_TARGET bytes or more comes back after RX_POLL_MIN and lowers
+// the ceiling. Up to RX_BURST_TIME after a send or a received packet it
+// sleeps no longer than RX_POLL_INTERVAL, only a quiet bus backs off to
+// the ceiling.
+#define RX_POLL_MIN 150
+#define RX_POLL_MAX 1000
+#define RX_FIFO_TARGET 4
+#define RX_BURST_TIME 12000
 
+// a packet is read as soon as it starts, a byte takes ~95us to come in
+#define RX_BYTE_WAIT 40
 
 // receive buffer length, longest package is program 51,
 // debug can be modified in the future to max length of 255
@@ -63,40 +91,62 @@
 
 // enable debug pins
 #ifdef debug
-#define WAIT_FOR_FREE_BUS_PIN_HI *gpioset = (1 << 17)  // GPIO 17
-#define WAIT_FOR_FREE_BUS_PIN_LO *gpioclr = (1 << 17)
-#define RECEIVE_THREAD_RUNNING_PIN_HI *gpioset = (1 << 27)  // GPIO 27
-#define RECEIVE_THREAD_RUNNING_PIN_LO *gpioclr = (1 << 27)
-#define ERROR_PIN_HI *gpioset = (1 << 22)  // GPIO 22
-#define ERROR_PIN_LO *gpioclr = (1 << 22)
+#define WAIT_FOR_FREE_BUS_PIN_HI WR(REG_GPSET0, 1 << 17)  // GPIO 17
+#define WAIT_FOR_FREE_BUS_PIN_LO WR(REG_GPCLR0, 1 << 17)
+#define RECEIVE_THREAD_RUNNING_PIN_HI WR(REG_GPSET0, 1 << 27)  // GPIO 27
+#define RECEIVE_THREAD_RUNNING_PIN_LO WR(REG_GPCLR0, 1 << 27)
+#define ERROR_PIN_HI WR(REG_GPSET0, 1 << 22)  // GPIO 22
+#define ERROR_PIN_LO WR(REG_GPCLR0, 1 << 22)
 #endif
 
-// pointers to BCM2708/9 registers
-volatile unsigned *gpio, *gpioset, *gpioclr, *gpioin;
-volatile unsigned *i2cSlave, *i2cSlaveRSR, *i2cSlaveSLV, *i2cSlaveCR, *i2cSlaveFR;
-volatile unsigned *i2cMaster, *i2cMasterS, *i2cMasterDLEN, *i2cMasterA, *i2cMasterFIFO, *i2cMasterDiv, *i2cMasterDel;
-u_int32_t *timerh;
-u_int32_t *timerl;
+// pointers to BCM2708/9 registers, used by the hardware backend
+volatile unsigned *hwReg[REG_COUNT];
+volatile u_int32_t *timerLo;	// system timer CLO
+volatile u_int32_t *timerHi;	// system timer CHI
+
+// what the board is does not change until a reboot, so it is kept in
+// /run between runs instead of asked again
+#define BOARD_CACHE "/run/dgtpicom.board"
+#define MBOX_TAG_CLOCK_MEASURED 0x00030047
+#define MBOX_CLOCK_CORE 4
+typedef struct {
+	int piModel;			// 0 = unknown
+	int coreFreq;			// MHz, 0 = unknown
+} boardCache_t;
+boardCache_t boardCache;
+
+// backend all register access goes through
+const dgtBackend_t *backend = &dgtBackendHw;
+
+// time source all timestamps and sleeps go through
+const dgtClock_t *dgtClock = &dgtClockReal;
+int clockMode = DGTPICOM_CLOCK_REAL;
+
+// adaptive poll scheduler
+typedef struct {
+	int interval;
+	int ceiling;
+	u_int64_t burstUntil;
+	int level;		// fifo level the last poll found, 0 = none
+	unsigned polls;
+	unsigned long long sleepTotal;
+	int maxFifo;
+} rxSchedule_t;
+
+rxSchedule_t rxSched;
+
+// SDA edge events for the hardware backend
+int gpioEventFd = -1;
+
+// how the receive thread finds new messages
+int receiveMode = DGTPICOM_RX_EVENT;
+
+// eventfd readable when there are new clock events, see dgtpicom_get_event_fd()
+int clockEventFd = -1;
 
 // variables for debug stats
 #ifdef debug
 typedef struct {
-	int displaySF;
-	int displayAF;
-	int endDisplaySF;
-	int endDisplayAF;
-	int changeStateSF;
-	int changeStateAF;
-	int setCCSF;
-	int setCCAF;
-	int setNRunSF;
-	int setNRunAF;
-
-	int rxTimeout;
-	int rxWrongAdr;
-	int rxBufferFull;
-	int rxSizeMismatch;
-	int rxCRCFault;
 	int rxMaxBuf;
 
 	int sendTotal;
@@ -106,30 +156,281 @@ debug_t bug;
 //int wakes, setccs, resets, clears, clears2, hellos, hellos2, totals, overflows, maxs;
 #endif
 
-#define DGTRX_BUTTON_BUFFER_SIZE 16
 typedef struct {
 	char on;
-	char ack[2];
 	char hello;
-	char buttonPres[DGTRX_BUTTON_BUFFER_SIZE];
-	char buttonTime[DGTRX_BUTTON_BUFFER_SIZE];
-	int buttonStart;
-	int buttonEnd;
 	long long int buttonRepeatTime;
+	long long int flagTime;		// predicted flag fall to signal, 0 = none
 	char buttonCount;
 	char buttonState;
 	char lastButtonState;
-	char time[6];
 	int error;
 } dgtReceive_t;
 
 dgtReceive_t dgtRx;
 
+// button messages from the receive thread to one reader, lock free.
+// The size can be set with -DDGTRX_BUTTON_BUFFER_SIZE, a power of 2.
+#ifndef DGTRX_BUTTON_BUFFER_SIZE
+#define DGTRX_BUTTON_BUFFER_SIZE 16
+#endif
+#if DGTRX_BUTTON_BUFFER_SIZE & (DGTRX_BUTTON_BUFFER_SIZE-1)
+#error DGTRX_BUTTON_BUFFER_SIZE must be a power of 2
+#endif
+#define CACHE_LINE 64
+typedef struct {
+	// written by the receive thread
+	_Alignas(CACHE_LINE) unsigned end;
+	int seq;	// futex, changes on every message and error
+	// written by the reader
+	_Alignas(CACHE_LINE) unsigned start;
+	int waiters;
+	_Alignas(CACHE_LINE) struct {
+		char buttons;
+		char time;
+	} event[DGTRX_BUTTON_BUFFER_SIZE];
+} buttonRing_t;
+
+buttonRing_t buttonRing;
+
+// time control run by the receive thread on lever presses, only changed
+// with receiveMutex locked. The moves go to one reader lock free, the
+// size can be set with -DDGTRX_TC_MOVES, a power of 2. The set and run
+// of a lever press waits in post for the worker, the newest wins.
+#ifndef DGTRX_TC_MOVES
+#define DGTRX_TC_MOVES 16
+#endif
+#if DGTRX_TC_MOVES & (DGTRX_TC_MOVES-1)
+#error DGTRX_TC_MOVES must be a power of 2
+#endif
+#define TC_MAX_TIME 35999	// s, 9:59:59 is all the clock can show
+#define TC_SETNRUN_LENGTH 12	// bytes of a set and run message
+typedef struct {
+	int mode;				// DGTPICOM_TC_*, 0 = off
+	int time[2];			// left and right time in ms
+	int increment;			// ms
+	char toMove;			// side running, 0 = left, 1 = right
+	char over;				// the clock reported a flag
+	u_int64_t moveStart;	// when the side to move started
+	unsigned end;			// written by the receive thread
+	unsigned start;			// written by the reader
+	dgtpicom_tc_move_t move[DGTRX_TC_MOVES];
+	int posted;				// post waits for the worker
+	char post[TC_SETNRUN_LENGTH];	// set and run of the last lever press
+} timeControl_t;
+
+timeControl_t timeControl;
+
+// echo of the program the clock acknowledged last, written by the
+// worker with commandMutex locked. The receive thread sets length to 0
+// when the clock may have lost it.
+typedef struct {
+	int length;		// 0 = none
+	char data[DGTPICOM_PROGRAM_LENGTH];
+} programShadow_t;
+
+programShadow_t programShadow;
+
+// what the clock displays according to the acks
+#define DISPLAY_UNKNOWN 0
+#define DISPLAY_IDLE 1
+#define DISPLAY_SHOWING 2
+typedef struct {
+	char state;			// DISPLAY_*, reset by the receive thread on hello and on/off
+	char packet[21];	// last acknowledged display message
+	dgtpicom_display_stats_t stats;
+} displayShadow_t;
+
+displayShadow_t displayShadow;
+
+// what state the link to the clock is in according to acks, hello, time
+// and on/off messages, DGTPICOM_LINK_* bits, 0 = unknown. Configure only
+// sends what this says is missing
+int linkShadow;
+
+// last time messages, written by the receive thread and read through a
+// seqlock so readers never block it. The size can be set with
+// -DDGTRX_TIME_HISTORY_SIZE, a power of 2.
+#ifndef DGTRX_TIME_HISTORY_SIZE
+#define DGTRX_TIME_HISTORY_SIZE 16
+#endif
+#if DGTRX_TIME_HISTORY_SIZE & (DGTRX_TIME_HISTORY_SIZE-1)
+#error DGTRX_TIME_HISTORY_SIZE must be a power of 2
+#endif
+// where a side's current second started on our clock
+typedef struct {
+	int shown;		// ms the clock showed
+	char run;		// run mode it showed
+	u_int64_t at;	// receive time of the message that first showed it
+} timeAnchor_t;
+
+typedef struct {
+	unsigned seq;	// odd while the receive thread writes
+	unsigned count;	// time messages since init, newest is count-1
+	unsigned shadowFrom;	// messages after this count show our last set
+						// and run, UINT_MAX while one is on its way
+	dgtpicom_clock_state_t history[DGTRX_TIME_HISTORY_SIZE];
+	timeAnchor_t anchor[2];	// left and right
+	u_int64_t flagFall;	// predicted flag fall, 0 = no side counting down
+} clockState_t;
+
+clockState_t clockState;
+
+// commands for the worker that owns the I2C master
+#define CMD_FREE 0
+#define CMD_QUEUED 1
+#define CMD_BUSY 2
+#define CMD_DONE 3
+
+#define CMD_CONFIGURE 1
+#define CMD_SET_AND_RUN 2
+#define CMD_TEXT 3
+#define CMD_END_TEXT 4
+#define CMD_OFF 5
+#define CMD_PROGRAM 6
+
+// priority classes, the worker always sends the highest class first and
+// a display command lets clock commands go between its steps
+#define PRIO_CLOCK 0			// set and run, program, mode 25, set central control
+#define PRIO_DISPLAY 1			// text, end text
+#define PRIO_HOUSEKEEPING 2		// off
+#define PRIO_COUNT 3
+
+// queued commands and the results of finished ones, a handle is
+// gen*COMMAND_QUEUE_SIZE + slot + 1
+#define COMMAND_QUEUE_SIZE 32
+#define COMMAND_GEN_MAX (INT_MAX/COMMAND_QUEUE_SIZE - 1)
+#define COMMAND_DATA_LENGTH 51	// program message
+
+// typical time of one try on the bus including the ack in us, a timed
+// command is not tried when the rest of its budget is shorter
+#define COST_SET_AND_RUN 3000
+#define COST_MODE25 3000
+#define COST_SET_CC 3000
+#define COST_WAKE 10000
+#define COST_END_DISPLAY 5000
+#define COST_DISPLAY 5000
+#define COST_PROGRAM 8000
+
+// first wait before trying again after a collision, grows every try
+#define RETRY_BACKOFF 500
+
+typedef struct {
+	int state;		// CMD_FREE..CMD_DONE, futex for waiters
+	int gen;		// changes every time the slot is used
+	int type;
+	int result;
+	int next;		// next slot in the queue, -1 = last
+	unsigned ticket;
+	u_int64_t queued;	// timer() value it was queued
+	u_int64_t deadline;	// timer() value it has to be done by, 0 = none
+	char data[COMMAND_DATA_LENGTH];	// message to send
+} command_t;
+
+typedef struct {
+	int on;
+	int head[PRIO_COUNT];	// first in the queue of each class, -1 = empty
+	int tail[PRIO_COUNT];
+	int display;	// queued display update that can be replaced, -1 = none
+	unsigned tickets;
+	int coalesced;
+	int preempted;	// clock commands sent in the middle of a display command
+	int kick;		// futex the worker sleeps on, changes on new work
+	command_t cmd[COMMAND_QUEUE_SIZE];
+} commandQueue_t;
+
+commandQueue_t commandQueue;
+
+// deadline of the command the worker is running, 0 = none
+u_int64_t commandDeadline;
+// messages sent for the running command, bit per message id
+unsigned commandSent;
+
+// type of the command the worker is running, 0 = none
+int commandRunning;
+pthread_t commandThread;
+pthread_mutex_t commandMutex = PTHREAD_MUTEX_INITIALIZER;
+
 pthread_t receiveThread;
 pthread_mutex_t receiveMutex = PTHREAD_MUTEX_INITIALIZER;
-pthread_cond_t receiveCond = PTHREAD_COND_INITIALIZER;
 
-char startMode = 0;
+// keeps the set and runs of the time control in order, taken before
+// receiveMutex and never by the receive thread
+pthread_mutex_t tcMutex = PTHREAD_MUTEX_INITIALIZER;
+
+// outstanding acks, one waiter per command. Every send of the command
+// takes a ticket, the clock acks them in order so the n-th ack that
+// arrives on the expected adress belongs to ticket n.
+#define ACK_WAITERS 8
+#define ACK_DEPTH 4				// statuses kept, acks of earlier tries can still come
+#define ACK_OUTSTANDING 10000	// us an ack can be late before it is lost
+typedef struct {
+	char cmd;		// command to ack, 0 = unused
+	char adr;		// adress the ack should arrive on
+	unsigned sent;		// tickets handed out
+	unsigned arrived;	// acks arrived
+	u_int64_t until;	// the last ticket is lost after this
+	char status[ACK_DEPTH];
+	int seq;		// futex, changes when an ack arrives
+} ackWaiter_t;
+
+ackWaiter_t ackTable[ACK_WAITERS];
+
+// always on statistics. Every counter has one writer thread, the worker
+// for commands and messages and the receive thread for rx, so a relaxed
+// load and store is enough.
+#define STAT_INC(x) __atomic_store_n(&(x), __atomic_load_n(&(x), __ATOMIC_RELAXED)+1, __ATOMIC_RELAXED)
+dgtpicom_stats_t stats;
+
+// ring of the last packets on the bus, see dgtpicom_capture_dump(). The
+// worker and the receive thread each claim a packet and write it, seq
+// tells a reader whether it is complete.
+#define CAPTURE_SIZE 512		// packets kept, power of 2
+#define CAPTURE_DATA 32			// bytes kept of a packet
+#define CAPTURE_TX 0
+#define CAPTURE_RX 1
+#define CAPTURE_DUMP_INTERVAL 1000000	// us between dumps on error
+#define CAPTURE_MAGIC "DGTCAP1\n"
+
+// the worker writes a recording when a quarter of the buffer is used and
+// this often while idle, see recordFlush()
+#define RECORD_FLUSH_INTERVAL 100000	// us
+typedef struct {
+	unsigned seq;		// number of the packet + 1, 0 while it is written
+	char dir;			// CAPTURE_TX or CAPTURE_RX
+	char adr;			// destination adress
+	signed char result;	// error code, 0 = ok
+	unsigned char length;	// length of the packet, data holds the first bytes
+	u_int64_t time;		// timer() when it was sent or received
+	char data[CAPTURE_DATA];
+} capturePacket_t;
+
+typedef struct {
+	unsigned head;			// packets captured since init
+	int errorPending;		// dump to capturePath, set on an error
+	u_int64_t lastDump;		// timer() of the last dump, set with a compare exchange
+	capturePacket_t packet[CAPTURE_SIZE];
+} capture_t;
+
+capture_t capture;
+char capturePath[256];		// dump on error, empty = don't
+int rxLength;				// bytes i2cReceive stored, also after an error
+
+// unix socket the statistics are served on, see dgtpicom_get_stats()
+int statsSocket = -1;
+char statsPath[108];
+pthread_t statsThread;
+
+const char *statsCommandName[DGTPICOM_STATS_COMMANDS] = {
+	"configure", "set_and_run", "text", "end_text", "off", "program" };
+const char *statsMessageName[DGTPICOM_STATS_MESSAGES] = {
+	"display", "end_display", "change_state", "set_cc", "set_and_run", "wake",
+	"program" };
+
+char startMode = DGTPICOM_START_RESET;
+// attached to hardware set up by an earlier run, the clock was not
+// asked yet whether it is still in mode 25
+int attached = 0;
 
 // I2C message descriptors
 char ping[] = {80,32,5, 13, 70};
@@ -139,6 +440,7 @@ char endDisplay[] = {16,32,5,7,112};
 char noAutoMessage[] = {16,32,6,3,209,135};
 char display[] = {16,32,21,6,32,32,32,32,32,32,32,32,32,32,32,255,0,3,0,0,0};
 char setnrun[] = {16,32,12,10,0,1,0,0,1,0,1,0};
+char setProgram[] = {16,32,5,9,0};
 
 const char* packetDescriptor[] = {"Ack","Hello","Debug","Time","Button","Display","End Display","Current Program","Program","Set And Run","Change State","Send Hello","Ping","Time Correlation","Set Central Control","Release Central Control","Trigger Boot Loader"};
 
@@ -188,10 +490,44 @@ const char crc_table[256] = {
 	2 = Pi 2 */
 int checkPiModel();
 
-u_int64_t * timer();
+/* board model and core clock of an earlier run, from BOARD_CACHE
+	returns 1 when there is a cache */
+int boardCacheLoad();
+
+/* keep the board model and core clock for the next run */
+void boardCacheSave();
+
+/* ask the firmware for the measured core clock through /dev/vcio
+	returns MHz or 0 when there is no mailbox */
+int mailboxCoreFreq();
+
+/* microseconds since some point in the past, never goes back, safe to
+	call from any thread */
+u_int64_t timer();
 
+/* print what one look at each time source costs
+	returns 0 */
+int timerBench();
+
+/* core clock in MHz, from the mailbox, the cache or vcgencmd, in that
+	order */
 int checkCoreFreq();
 
+/* fill a set and run message, see dgtpicom_set_and_run()
+	srm = buffer of sizeof(setnrun) bytes */
+void setNRunPacket(char srm[], char lr, char lh, char lm, char ls,
+                   char rr, char rh, char rm, char rs);
+
+/* fill a program message, see dgtpicom_set_program()
+	pm = buffer of COMMAND_DATA_LENGTH bytes
+	program = program data
+	length = bytes in program, at most DGTPICOM_PROGRAM_LENGTH */
+void programPacket(char pm[], char program[], int length);
+
+/* fill a display message, see dgtpicom_set_text()
+	dm = buffer of sizeof(display) bytes */
+void textPacket(char dm[], char text[], char beep, char ld, char rd);
+
 /* calculate checksum and put it in the last byte
 	*buffer = pointer to buffer */
 char crc_calc(char *buffer);
@@ -204,6 +540,19 @@ void hexPrint(char bytes[], int length);
 
 //*** Low level I2C communication ***//
 
+/* undo what dgtpicom_init() did after the backend opened
+	e = error to return
+	returns e */
+int initFail(int e);
+
+/* check the wiring before the I2C hardware is taken
+	returns 0 or ERROR_LINES */
+int i2cCheckWiring();
+
+/* take over I2C hardware an earlier run left set up, when it still is
+	returns 1 when attached, 0 when it needs a reset */
+int i2cAttach();
+
 /* configure IO pins and I2C Master and Slave
 	*/
 void i2cReset();
@@ -229,6 +578,101 @@ int i2cReceive(char m[]);
 	 0 = Succes */
 int i2cSend(char message[], char ackAdr);
 
+/* send message using I2CMaster, without statistics, see i2cSend */
+int i2cTransmit(char message[], char ackAdr);
+
+
+
+//*** command queue ***//
+
+/* queue a command for the worker
+	type = CMD_*
+	data = message to send, length bytes
+	deadline = timer() value to be done by, 0 = no deadline
+	returns:
+	-10 = not initialized
+	-9 = queue full
+	>0 = handle for commandWait() */
+int commandSubmit(int type, char data[], int length, u_int64_t deadline);
+
+/* wait for a queued command
+	handle = from commandSubmit(), errors are returned as is
+	timeOut = max time to wait in us, 0 = don't wait, -1 = forever
+	returns the result of the command or DGTPICOM_PENDING */
+int commandWait(int handle, int timeOut);
+
+/* queue a command with a deadline and wait for it
+	budget = time in us from now
+	returns the result of the command or -11 when the budget ran out */
+int commandTimed(int type, char data[], int length, int budget);
+
+/* worker thread, sends the queued commands one by one */
+void *commandWorker(void *);
+
+/* wake the worker for new work, needs no lock */
+void commandKick();
+
+/* take the first command of the highest class below classes from the
+	queue, run it and store its result. Called with commandMutex locked.
+	classes = PRIO_COUNT for all, PRIO_CLOCK+1 for clock commands only
+	returns 0 when nothing was queued */
+int commandRunNext(int classes);
+
+/* run queued clock commands, called by the worker between the steps of
+	a display command */
+void commandPreempt();
+
+/* take the first command of a class from the queue. Called with
+	commandMutex locked.
+	prio = class
+	returns the slot */
+int commandTake(int prio);
+
+/* store the result of a command and wake its waiters. Called with
+	commandMutex locked.
+	slot = slot of the command
+	result = its result */
+void commandDone(int slot, int result);
+
+/* check if the running command has time left
+	cost = time the next step takes in us
+	returns 1 when there is no deadline or it can be met */
+int commandAfford(u_int64_t cost);
+
+/* limit a wait to the time left for the running command
+	timeOut = wait in us
+	returns timeOut or less */
+u_int64_t commandBudget(u_int64_t timeOut);
+
+/* decide if the running command should be tried (again). Without a
+	deadline up to three tries. With one it depends on the error of the
+	last try and the time left, and waits a little after a collision.
+	e = error of the last try
+	tries = this try, 1 = first
+	cost = time a try takes in us
+	returns 1 to try */
+int commandRetry(int e, int tries, u_int64_t cost);
+
+/* get the priority class of a command
+	type = CMD_*
+	returns PRIO_* */
+int commandPriority(int type);
+
+/* run the first command after attaching, see dgtpicom_set_start()
+	type = CMD_*
+	returns the result of the command */
+int commandAttached(int type, char data[]);
+
+/* run one command on the bus, returns its result */
+int commandRun(int type, char data[]);
+
+/* the commands with their retries, run by the worker */
+int commandConfigure();
+int commandSetNRun(char srm[]);
+int commandText(char dm[]);
+int commandEndText();
+int commandOff(char returnMode);
+int commandProgram(char pm[]);
 
 
 //*** dgt3000 commands ***//
@@ -260,6 +704,14 @@ int dgt3000Mode25();
      */
 int dgt3000SetNRun(char srm[]);
 
+/* send a program to dgt3000
+	returns:
+	-3 = sending failed, clock off (or collision)
+	-2 = sending failed, I2C error
+	-1 = no (positive)ack received, not in CC
+	0 = succes */
+int dgt3000Program(char pm[]);
+
 /* send end display to dgt3000 to clear te display
 	returns:
 	-3 = sending failed, clock off (or collision)
@@ -284,12 +736,197 @@ int dgt3000Display(char dm[]);
 	2 = off button message is received */
 void *dgt3000Receive(void *);
 
-/* wait for an Ack message
+/* adapt the poll ceiling to the receive fifo level
+	level = bytes in the fifo when the receive thread got to it */
+void rxFifoLevel(int level);
+
+/* sleep until there is activity on the bus, a button needs repeating
+	or RX_IDLE_TIMEOUT. Falls back to adaptive polling when the backend
+	has no bus events.
+	active = something was received since the last call */
+void rxWait(int active);
+
+/* put a button message in the ring
+	returns:
+	-9 = ring full, message dropped
+	0 = succes */
+int buttonPush(char buttons, char time);
+
+/* wake a reader waiting in dgtpicom_wait_button_message() */
+void buttonNotify();
+
+/* set what we know about the display
+	state = DISPLAY_UNKNOWN, DISPLAY_IDLE or DISPLAY_SHOWING */
+void displayState(char state);
+
+/* set what we know about the link to the clock
+	state = DGTPICOM_LINK_* bits, 0 = unknown */
+void linkState(int state);
+
+/* add to what we know about the link, the clock is no longer off
+	bits = DGTPICOM_LINK_* bits */
+void linkAdd(int bits);
+
+/* what we know about the link to the clock
+	returns DGTPICOM_LINK_* bits */
+int linkGet();
+
+/* decode a time message and publish it as the new clock state
+	rm = received time message */
+void clockStatePublish(char rm[]);
+
+/* move a side's second to the newest time message when it shows a new
+	time or run mode, only called by the receive thread
+	side = 0 left, 1 right
+	state = the newest clock state */
+void clockAnchor(int side, dgtpicom_clock_state_t *state);
+
+/* time a side shows at a given moment, counted on from its anchor
+	a = the side's anchor
+	now = timer() value
+	returns time in ms */
+int clockTimeAt(timeAnchor_t *a, u_int64_t now);
+
+/* time the move when the side to move pressed the lever and hand the
+	set and run for the other side to the worker, only called by the
+	receive thread with receiveMutex locked. It leaves the queueing to the
+	worker so it never waits for commandMutex.
+	rightDown = 1 when the right side is down */
+void tcLever(int rightDown);
+
+/* stop the time control when the clock reports a flag after our last
+	set and run, only called by the receive thread
+	rm = received time message */
+void tcFlag(char rm[]);
+
+/* make a set and run with the side to move counting down, called with
+	receiveMutex locked
+	srm = filled with the set and run message */
+void tcSetAndRun(char srm[]);
+
+/* queue the set and run tcLever left, only called by the worker without
+	commandMutex or receiveMutex locked */
+void tcQueue();
+
+/* start reading the clock state
+	returns the seqlock sequence to pass to clockStateRetry() */
+unsigned clockStateBegin();
+
+/* check if the clock state changed while reading it
+	seq = value from clockStateBegin()
+	returns 1 when the copy is torn and must be read again */
+int clockStateRetry(unsigned seq);
+
+/* is the clock already stopped like a set and run that stops both sides
+	says, from its newest time message? Only called by the worker
+	srm = set and run message
+	returns 1 when sending it would not change the clock */
+int clockShadowMatch(char srm[]);
+
+/* make the clock event fd readable */
+void clockEventSignal();
+
+/* sleep on the library clock
+	us = time to sleep in us */
+void clockSleep(u_int64_t us);
+
+/* sleep while *addr==val
+	timeOut = max time to sleep in us, <0 = forever */
+int futexWait(int *addr, int val, long long timeOut);
+
+/* wake all threads sleeping on addr */
+void futexWake(int *addr);
+
+/* wait for an Ack message, sleeps until it arrives
 	adr = adress to listen for ack
 	cmd = command to ack
 	timeOut = time to wait for ack
+	status = filled with the status byte of the ack
 	returns:
-	-3 = no Ack
+	-2 = no Ack
 	0 = Ack */
-int dgt3000GetAck(char adr, char cmd, u_int64_t timeOut);
-
+int dgt3000GetAck(char adr, char cmd, u_int64_t timeOut, char *status);
+
+/* take a ticket for the ack of a command that is sent, called with
+	receiveMutex locked so the ack can't be handled before
+	adr = adress the ack will arrive on
+	cmd = command that will be acked
+	returns the ticket, 0 when the table is full */
+unsigned ackExpect(char adr, char cmd);
+
+/* sleep until the ack of a ticket arrived
+	w = waiter of the command
+	ticket = ticket from ackExpect
+	timeOut = time to wait for ack
+	status = filled with the status byte of the ack
+	returns:
+	-2 = no Ack
+	0 = Ack */
+int ackWait(ackWaiter_t *w, unsigned ticket, u_int64_t timeOut, char *status);
+
+/* adress the slave should listen to, our own while acks to it are
+	outstanding, else broadcast. Called with receiveMutex locked. */
+char ackListen();
+
+/* find the waiter for a command
+	returns NULL when nobody expects an ack for it */
+ackWaiter_t *ackFind(char cmd);
+
+/* hand an ack to its waiter, called by the receive thread
+	adr = adress the ack arrived on
+	cmd = acked command
+	status = status byte of the ack */
+void ackArrived(char adr, char cmd, char status);
+
+/* log2 histogram bucket of a time
+	us = time in us
+	returns the bucket, see dgtpicom_stats_t */
+int statsBucket(u_int64_t us);
+
+/* statistics of a message on the bus
+	cmd = message id, message[3]
+	returns NULL for messages that are not counted */
+dgtpicom_message_stats_t *statsMessage(char cmd);
+
+/* start serving the statistics as text on a unix socket
+	path = socket path, an old socket file is replaced, any other
+		file there is left alone and makes this fail
+	returns 0 or -1 when the socket could not be made */
+int statsOpen(const char *path);
+
+/* stop serving the statistics and remove the socket */
+void statsClose();
+
+/* thread answering statistics connections */
+void *statsServe(void *);
+
+/* write statistics as text
+	f = file to write to
+	s = statistics */
+void statsWrite(FILE *f, dgtpicom_stats_t *s);
+
+/* add a packet to the capture ring
+	dir = CAPTURE_TX or CAPTURE_RX
+	adr = destination adress
+	result = error code, 0 = ok
+	data = the packet
+	length = its length */
+void captureAdd(char dir, char adr, int result, char data[], int length);
+
+/* write the capture ring to a file
+	path = file to write
+	returns 0 or -10 when the file could not be written */
+int captureWrite(const char *path);
+
+/* should an error be dumped, at most once every CAPTURE_DUMP_INTERVAL
+	returns 1 when it should */
+int captureDue();
+
+/* ask the worker to dump the capture after an error, takes no lock so
+	the receive thread can call it */
+void captureError();
+
+/* decode a capture file and print it with a summary
+	path = file to read
+	returns 0 or -10 when it is not a capture file */
+int captureDecode(const char *path);
@@ -0,0 +1,803 @@
+/* virtual DGT3000 on an emulated BCM2708/9 I2C bus
+ * version 0.8
+ *
+ * Copyright (C) 2015 DGT
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* The BSC master and slave are emulated at register level and the bus
+ * is evaluated lazily: every register access first plays all bus events
+ * up to the current time, one byte at a time, in time order. Bytes take
+ * 9 SCL periods as set by the master divider, so fifo levels, overruns
+ * and ack timing behave like on the real bus.
+ *
+ * Time message layout used by the virtual clock:
+ *   rm[5..7]   left hours, minutes (BCD), seconds (BCD)
+ *   rm[11..13] right hours, minutes (BCD), seconds (BCD)
+ *   rm[19]     bit 0 lever (right side down), bit 1-2 left run mode,
+ *              bit 3-4 right run mode
+ *   rm[20]     bit 0 no update (time unchanged), bit 1 left flag,
+ *              bit 2 right flag
+ */
+
+#include <pthread.h>
+#include <stddef.h>
+#include <string.h>
+#include <time.h>
+#include <sys/types.h>
+
+#include "dgtpicom_backend.h"
+#include "dgtpicom_emu.h"
+
+#define EMU_FIFO_SIZE       16
+#define EMU_QUEUE_SIZE      64
+#define EMU_CORE_FREQ       250     // MHz
+#define EMU_PACKET_SIZE     64
+
+// DGT3000 timing in us
+#define EMU_BUS_IDLE        50      // wait after a packet before sending
+#define EMU_RETRY           1000    // resend delay of a not acked packet
+#define EMU_TRIES           20      // drop a packet after this many tries
+#define EMU_ACK_DELAY       400
+#define EMU_DISPLAY_DELAY   1000
+#define EMU_END_DISPLAY_DELAY 4000
+#define EMU_HELLO_DELAY     5000
+#define EMU_TICK            1000000
+
+// I2C master status bits
+#define S_TA    0x001
+#define S_DONE  0x002
+#define S_TXD   0x010
+#define S_TXE   0x040
+#define S_ERR   0x100
+#define S_CLKT  0x200
+
+// I2C slave flag bits
+#define FR_RXFE     0x002
+#define FR_RXFF     0x008
+#define FR_TXFE     0x010
+#define FR_RXBUSY   0x020
+
+typedef struct {
+    unsigned char b[EMU_PACKET_SIZE];
+    int adr;
+    int tries;
+    u_int64_t at;
+    unsigned seq;
+} emuPacket_t;
+
+typedef struct {
+    pthread_mutex_t mutex;
+    int changes;            // counts state changes, emuWait sleeps on it
+    int keep, opened;       // keep the state on the next open
+    struct timespec start;
+    u_int64_t virtualStart;
+
+    // plain registers
+    unsigned gpfsel[3];
+    unsigned div, del, a, dlen, mc, slv, scr, rsr;
+
+    // I2C master
+    unsigned ms;
+    unsigned char mFifo[EMU_FIFO_SIZE];
+    int mFifoStart, mFifoCount;
+    unsigned char mTx[EMU_PACKET_SIZE];
+    int mActive, mStalled, mSent;
+    u_int64_t mNext;
+
+    // I2C slave
+    unsigned char sFifo[EMU_FIFO_SIZE];
+    int sFifoStart, sFifoCount;
+
+    // transfers started on the bus, like SDA edges
+    unsigned edges, edgesSeen;
+    int waiting;
+
+    // DGT3000 transmitter
+    emuPacket_t queue[EMU_QUEUE_SIZE];
+    unsigned seq;
+    int cActive, cPacket, cAccepted, cSent;
+    u_int64_t cStart;
+    u_int64_t busFree;
+
+    // DGT3000 state
+    int on, cc, mode25, displayActive;
+    char text[12];
+    unsigned char program[EMU_PACKET_SIZE];
+    int programLength;
+    int time[2], run[2], flag[2];
+    int buttons;
+    u_int64_t releaseAt;
+    u_int64_t nextTick;
+} emu_t;
+
+static emu_t emu = { .mutex = PTHREAD_MUTEX_INITIALIZER };
+
+static u_int64_t emuNow() {
+    struct timespec t;
+
+    if (dgtClock == &dgtClockVirtual)
+        return dgtClock->now() - emu.virtualStart;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return (u_int64_t)(t.tv_sec - emu.start.tv_sec) * 1000000
+           + (t.tv_nsec - emu.start.tv_nsec) / 1000;
+}
+
+// time on the bus for one byte plus ack, 9 SCL periods
+static u_int64_t emuByteTime() {
+    if (emu.div == 0)
+        return 95;
+    return 9 * emu.div / EMU_CORE_FREQ;
+}
+
+// CRC ATM-8 over all but the last byte
+static unsigned char emuCrc(unsigned char *b) {
+    int i, j;
+    unsigned char crc = 0;
+
+    for (i = 0; i < b[2] - 1; i++) {
+        crc ^= b[i];
+        for (j = 0; j < 8; j++)
+            crc = crc & 0x80 ? (crc << 1) ^ 0x07 : crc << 1;
+    }
+    return crc;
+}
+
+// queue a packet for sending by the clock
+//   payload starts with the message type
+static void emuQueue(int adr, u_int64_t at, unsigned char *payload, int n) {
+    int i;
+    emuPacket_t *p = 0;
+
+    for (i = 0; i < EMU_QUEUE_SIZE; i++)
+        if (emu.queue[i].b[2] == 0) {
+            p = &emu.queue[i];
+            break;
+        }
+    // queue full, the real clock drops messages too
+    if (p == 0)
+        return;
+
+    p->b[0] = adr * 2;
+    p->b[1] = 16;
+    p->b[2] = n + 4;
+    memcpy(p->b + 3, payload, n);
+    p->b[n + 3] = emuCrc(p->b);
+    p->adr = adr;
+    p->tries = 0;
+    p->at = at;
+    p->seq = emu.seq++;
+}
+
+static void emuAck(int adr, u_int64_t at, int cmd, int status) {
+    unsigned char m[] = {1, cmd, status};
+
+    emuQueue(adr, at, m, sizeof(m));
+}
+
+static void emuButtonMessage(u_int64_t at, int new, int old) {
+    unsigned char m[] = {5, new, old};
+
+    emuQueue(0x00, at, m, sizeof(m));
+}
+
+static void emuTimeMessage(u_int64_t at, int noUpdate) {
+    unsigned char m[18];
+    int i, t;
+
+    memset(m, 0, sizeof(m));
+    m[0] = 4;
+    for (i = 0; i < 2; i++) {
+        t = emu.time[i];
+        m[2 + i * 6] = t / 3600;
+        m[3 + i * 6] = (((t / 60) % 60) / 10) << 4 | ((t / 60) % 60) % 10;
+        m[4 + i * 6] = ((t % 60) / 10) << 4 | (t % 60) % 10;
+    }
+    m[16] = ((emu.buttons & 0x40) ? 1 : 0) | emu.run[0] << 1 | emu.run[1] << 3;
+    m[17] = noUpdate | emu.flag[0] << 1 | emu.flag[1] << 2;
+    emuQueue(0x00, at, m, sizeof(m));
+}
+
+static void emuHello(u_int64_t at) {
+    unsigned char m[] = {2, 1};
+
+    emuQueue(0x00, at, m, sizeof(m));
+}
+
+static void emuTurnOn(u_int64_t t) {
+    emu.on = 1;
+    emu.cc = 0;
+    emu.mode25 = 0;
+    emu.displayActive = 0;
+    emu.buttons &= ~0x20;
+    emuHello(t + EMU_HELLO_DELAY);
+}
+
+static void emuTurnOff() {
+    emu.on = 0;
+    emu.cc = 0;
+    emu.mode25 = 0;
+    emu.displayActive = 0;
+    emu.buttons |= 0x20;
+}
+
+// the clock received a complete command from the master
+static void emuCommand(u_int64_t t, unsigned char *m, int len) {
+    int i;
+
+    if (len < 5 || len != m[2] || emuCrc(m) != m[len - 1])
+        return;
+
+    switch (m[3]) {
+        case 0x06:  // display
+            if (emu.displayActive) {
+                emuAck(0x00, t + EMU_DISPLAY_DELAY, 0x06, 0x23);
+                break;
+            }
+            for (i = 0; i < 11; i++)
+                emu.text[i] = m[4 + i];
+            emu.text[11] = 0;
+            emu.displayActive = 1;
+            emuAck(0x00, t + EMU_DISPLAY_DELAY, 0x06, 0x20);
+            break;
+        case 0x07:  // end display
+            if (emu.displayActive) {
+                emu.displayActive = 0;
+                emuAck(0x00, t + EMU_END_DISPLAY_DELAY, 0x07, 0x00);
+            } else {
+                emuAck(0x10, t + EMU_ACK_DELAY, 0x07, 0x05);
+            }
+            break;
+        case 0x09:  // program, kept as it is
+            if (!emu.cc) {
+                emuAck(0x10, t + EMU_ACK_DELAY, 0x09, 0x00);
+                break;
+            }
+            emu.programLength = len - 5;
+            memcpy(emu.program, m + 4, emu.programLength);
+            emuAck(0x10, t + EMU_ACK_DELAY, 0x09, 0x08);
+            break;
+        case 0x0a:  // set and run
+            if (!emu.mode25) {
+                emuAck(0x10, t + EMU_ACK_DELAY, 0x0a, 0x00);
+                break;
+            }
+            emu.time[0] = m[4] * 3600 + ((m[5] >> 4) * 10 + (m[5] & 0x0f)) * 60
+                          + (m[6] >> 4) * 10 + (m[6] & 0x0f);
+            emu.time[1] = m[7] * 3600 + ((m[8] >> 4) * 10 + (m[8] & 0x0f)) * 60
+                          + (m[9] >> 4) * 10 + (m[9] & 0x0f);
+            emu.run[0] = m[10] & 0x03;
+            emu.run[1] = (m[10] >> 2) & 0x03;
+            emu.flag[0] = emu.flag[1] = 0;
+            emu.nextTick = t + EMU_TICK;
+            emuAck(0x10, t + EMU_ACK_DELAY, 0x0a, 0x08);
+            emuTimeMessage(t + EMU_ACK_DELAY, 0);
+            break;
+        case 0x0b:  // change state
+            if (m[4] == 57) {
+                if (emu.cc) {
+                    if (!emu.mode25)
+                        emu.nextTick = t + EMU_TICK;
+                    emu.mode25 = 1;
+                    emuAck(0x10, t + EMU_ACK_DELAY, 0x0b, 0x08);
+                } else {
+                    emuAck(0x10, t + EMU_ACK_DELAY, 0x0b, 0x00);
+                }
+            } else {
+                emuTurnOff();
+            }
+            break;
+        case 0x0f:  // set central control
+            emu.cc = 1;
+            emuAck(0x10, t + EMU_ACK_DELAY, 0x0f, 0x08);
+            break;
+    }
+}
+
+// one second passed on the clock
+static void emuTick(u_int64_t t) {
+    int i, changed = 0;
+
+    for (i = 0; i < 2; i++) {
+        if (emu.run[i] == 1 && emu.time[i] > 0) {
+            emu.time[i]--;
+            if (emu.time[i] == 0)
+                emu.flag[i] = 1;
+            changed = 1;
+        } else if (emu.run[i] == 2) {
+            emu.time[i]++;
+            changed = 1;
+        }
+    }
+    emuTimeMessage(t, !changed);
+}
+
+// next packet the clock wants to send, -1 if none
+static int emuNextPacket() {
+    int i, n = -1;
+
+    for (i = 0; i < EMU_QUEUE_SIZE; i++) {
+        if (emu.queue[i].b[2] == 0)
+            continue;
+        if (n < 0 || emu.queue[i].at < emu.queue[n].at
+                || (emu.queue[i].at == emu.queue[n].at && emu.queue[i].seq < emu.queue[n].seq))
+            n = i;
+    }
+    return n;
+}
+
+// time of the next bus event, ~0 if nothing will happen
+static u_int64_t emuNextEvent() {
+    u_int64_t t, next = ~(u_int64_t)0;
+    int p;
+
+    if (emu.mActive && !emu.mStalled)
+        next = emu.mNext;
+
+    if (emu.cActive) {
+        t = emu.cStart + (emu.cSent + 1) * emuByteTime();
+        if (t < next)
+            next = t;
+    } else if (!emu.mActive && (p = emuNextPacket()) >= 0) {
+        t = emu.queue[p].at;
+        if (t < emu.busFree + EMU_BUS_IDLE)
+            t = emu.busFree + EMU_BUS_IDLE;
+        if (t < next)
+            next = t;
+    }
+
+    if (emu.releaseAt && emu.releaseAt < next)
+        next = emu.releaseAt;
+
+    if (emu.on && emu.mode25 && emu.nextTick < next)
+        next = emu.nextTick;
+
+    return next;
+}
+
+// master finished a byte at time t
+static void emuMasterStep(u_int64_t t) {
+    int len;
+
+    if (emu.mSent == 0) {
+        emu.mTx[0] = emu.a * 2;
+        // wake command, never acked
+        if (emu.a == 40) {
+            if (!emu.on)
+                emuTurnOn(t);
+            else
+                emuHello(t + EMU_HELLO_DELAY);
+        }
+        // someone else is using the bus
+        if (emu.cActive) {
+            emu.ms |= S_DONE | S_CLKT;
+            emu.mActive = 0;
+            return;
+        }
+        if (emu.a != 8 || !emu.on) {
+            emu.ms |= S_DONE | S_ERR;
+            emu.mActive = 0;
+            emu.busFree = t;
+            return;
+        }
+        emu.mSent = 1;
+        emu.mNext = t + emuByteTime();
+        return;
+    }
+
+    // clock stretching until software fills the fifo
+    if (emu.mFifoCount == 0) {
+        emu.mStalled = 1;
+        return;
+    }
+    emu.mTx[emu.mSent++] = emu.mFifo[emu.mFifoStart];
+    emu.mFifoStart = (emu.mFifoStart + 1) % EMU_FIFO_SIZE;
+    emu.mFifoCount--;
+
+    len = emu.mSent;
+    if (len > emu.dlen || len >= EMU_PACKET_SIZE) {
+        emu.ms |= S_DONE;
+        emu.mActive = 0;
+        emu.busFree = t;
+        emuCommand(t, emu.mTx, len);
+    } else {
+        emu.mNext = t + emuByteTime();
+    }
+}
+
+// clock transmitter event at time t
+static void emuClockStep(u_int64_t t) {
+    emuPacket_t *p;
+
+    if (!emu.cActive) {
+        emu.edges++;
+        emu.cPacket = emuNextPacket();
+        emu.cActive = 1;
+        emu.cStart = t;
+        emu.cSent = 0;
+        emu.cAccepted = (emu.scr & 1) && emu.slv == emu.queue[emu.cPacket].adr;
+        return;
+    }
+
+    p = &emu.queue[emu.cPacket];
+
+    // adress byte
+    if (emu.cSent == 0 && !emu.cAccepted) {
+        emu.cActive = 0;
+        emu.busFree = t;
+        if (++p->tries >= EMU_TRIES)
+            p->b[2] = 0;
+        else
+            p->at = t + EMU_RETRY;
+        return;
+    }
+
+    if (emu.cSent > 0) {
+        if (emu.sFifoCount == EMU_FIFO_SIZE) {
+            emu.rsr |= 1;
+        } else {
+            emu.sFifo[(emu.sFifoStart + emu.sFifoCount) % EMU_FIFO_SIZE] = p->b[emu.cSent];
+            emu.sFifoCount++;
+        }
+    }
+    emu.cSent++;
+
+    if (emu.cSent >= p->b[2]) {
+        emu.cActive = 0;
+        emu.busFree = t;
+        p->b[2] = 0;
+    }
+}
+
+// play all bus events up to now
+static void emuAdvance() {
+    u_int64_t now = emuNow();
+    u_int64_t t, tc;
+    int p;
+
+    while ((t = emuNextEvent()) <= now) {
+        if (emu.mActive && !emu.mStalled && emu.mNext == t) {
+            emuMasterStep(t);
+            continue;
+        }
+
+        if (emu.cActive)
+            tc = emu.cStart + (emu.cSent + 1) * emuByteTime();
+        else if (!emu.mActive && (p = emuNextPacket()) >= 0)
+            tc = emu.queue[p].at < emu.busFree + EMU_BUS_IDLE
+                 ? emu.busFree + EMU_BUS_IDLE : emu.queue[p].at;
+        else
+            tc = ~(u_int64_t)0;
+        if (tc == t) {
+            emuClockStep(t);
+            continue;
+        }
+
+        if (emu.releaseAt == t) {
+            emuButtonMessage(t, emu.buttons & 0x60, emu.buttons);
+            emu.buttons &= 0x60;
+            emu.releaseAt = 0;
+            continue;
+        }
+
+        emuTick(t);
+        emu.nextTick += EMU_TICK;
+    }
+}
+
+// let a waiting receive thread look at the new state
+static void emuNotify() {
+    emu.changes++;
+    if (emu.waiting)
+        dgtClock->wake(&emu.changes);
+}
+
+static int emuOpen(char *piModel) {
+    *piModel = 3;
+    pthread_mutex_lock(&emu.mutex);
+    // the pi and the clock outlive a process
+    if (emu.keep && emu.opened) {
+        pthread_mutex_unlock(&emu.mutex);
+        return 0;
+    }
+    emu.opened = 1;
+    memset(&emu.gpfsel, 0, sizeof(emu) - offsetof(emu_t, gpfsel));
+    clock_gettime(CLOCK_MONOTONIC, &emu.start);
+    emu.virtualStart = dgtClock == &dgtClockVirtual ? dgtClock->now() : 0;
+    // the clock starts switched off
+    emu.buttons = 0x20;
+    strcpy(emu.text, "           ");
+    pthread_mutex_unlock(&emu.mutex);
+    return 0;
+}
+
+static void emuClose() {
+}
+
+static unsigned emuRead(int reg) {
+    unsigned v = 0;
+
+    pthread_mutex_lock(&emu.mutex);
+    emuAdvance();
+    switch (reg) {
+        case REG_GPFSEL0:
+        case REG_GPFSEL1:
+        case REG_GPFSEL2:
+            v = emu.gpfsel[reg - REG_GPFSEL0];
+            break;
+        case REG_GPLEV0:
+            // all lines pulled up, SDA low while someone is sending
+            v = 0x000c0c0c;
+            if (emu.mActive || emu.cActive)
+                v &= ~4;
+            break;
+        case REG_SLV_DR:
+            if (emu.sFifoCount) {
+                v = emu.sFifo[emu.sFifoStart];
+                emu.sFifoStart = (emu.sFifoStart + 1) % EMU_FIFO_SIZE;
+                emu.sFifoCount--;
+            }
+            break;
+        case REG_SLV_RSR:
+            v = emu.rsr;
+            break;
+        case REG_SLV_SLV:
+            v = emu.slv;
+            break;
+        case REG_SLV_CR:
+            v = emu.scr;
+            break;
+        case REG_SLV_FR:
+            v = FR_TXFE | emu.sFifoCount << 11;
+            if (emu.sFifoCount == 0)
+                v |= FR_RXFE;
+            if (emu.sFifoCount == EMU_FIFO_SIZE)
+                v |= FR_RXFF;
+            if (emu.cActive && emu.cAccepted)
+                v |= FR_RXBUSY;
+            break;
+        case REG_MST_C:
+            v = emu.mc;
+            break;
+        case REG_MST_S:
+            v = emu.ms;
+            if (emu.mActive)
+                v |= S_TA;
+            if (emu.mFifoCount < EMU_FIFO_SIZE)
+                v |= S_TXD;
+            if (emu.mFifoCount == 0)
+                v |= S_TXE;
+            break;
+        case REG_MST_DLEN:
+            v = emu.dlen;
+            break;
+        case REG_MST_A:
+            v = emu.a;
+            break;
+        case REG_MST_DIV:
+            v = emu.div;
+            break;
+        case REG_MST_DEL:
+            v = emu.del;
+            break;
+    }
+    pthread_mutex_unlock(&emu.mutex);
+    return v;
+}
+
+static void emuWrite(int reg, unsigned v) {
+    pthread_mutex_lock(&emu.mutex);
+    emuAdvance();
+    switch (reg) {
+        case REG_GPFSEL0:
+        case REG_GPFSEL1:
+        case REG_GPFSEL2:
+            emu.gpfsel[reg - REG_GPFSEL0] = v;
+            break;
+        case REG_SLV_RSR:
+            emu.rsr = 0;
+            break;
+        case REG_SLV_SLV:
+            emu.slv = v;
+            break;
+        case REG_SLV_CR:
+            emu.scr = v;
+            break;
+        case REG_MST_C:
+            emu.mc = v & 0x8701;
+            // clear fifo
+            if (v & 0x30)
+                emu.mFifoCount = 0;
+            // start transfer
+            if ((v & 0x8080) == 0x8080 && !emu.mActive) {
+                emu.edges++;
+                emu.mActive = 1;
+                emu.mStalled = 0;
+                emu.mSent = 0;
+                emu.mNext = emuNow() + emuByteTime();
+            }
+            break;
+        case REG_MST_S:
+            emu.ms &= ~(v & (S_DONE | S_ERR | S_CLKT));
+            break;
+        case REG_MST_DLEN:
+            emu.dlen = v & 0xffff;
+            break;
+        case REG_MST_A:
+            emu.a = v & 0x7f;
+            break;
+        case REG_MST_FIFO:
+            if (emu.mFifoCount < EMU_FIFO_SIZE) {
+                emu.mFifo[(emu.mFifoStart + emu.mFifoCount) % EMU_FIFO_SIZE] = v;
+                emu.mFifoCount++;
+            }
+            if (emu.mStalled) {
+                emu.mStalled = 0;
+                emu.mNext = emuNow() + emuByteTime();
+            }
+            break;
+        case REG_MST_DIV:
+            emu.div = v & 0xffff;
+            break;
+        case REG_MST_DEL:
+            emu.del = v;
+            break;
+    }
+    emuNotify();
+    pthread_mutex_unlock(&emu.mutex);
+}
+
+static u_int64_t emuTime() {
+    u_int64_t t;
+
+    pthread_mutex_lock(&emu.mutex);
+    t = emuNow();
+    pthread_mutex_unlock(&emu.mutex);
+    return t;
+}
+
+static int emuCoreFreq() {
+    return EMU_CORE_FREQ;
+}
+
+// sleep until a transfer starts or data waits in the slave fifo
+static int emuWait(u_int64_t timeOut) {
+    u_int64_t deadline, now, t;
+    int r = 0, changes;
+
+    pthread_mutex_lock(&emu.mutex);
+    deadline = emuNow() + timeOut;
+    while (1) {
+        emuAdvance();
+        if (emu.sFifoCount || (emu.cActive && emu.cAccepted) || emu.edges != emu.edgesSeen) {
+            emu.edgesSeen = emu.edges;
+            r = 1;
+            break;
+        }
+        now = emuNow();
+        if (now >= deadline)
+            break;
+
+        // nothing changes before the next bus event
+        t = emuNextEvent();
+        if (t > deadline)
+            t = deadline;
+        changes = emu.changes;
+        emu.waiting++;
+        pthread_mutex_unlock(&emu.mutex);
+        dgtClock->wait(&emu.changes, changes, t > now ? t - now : 0);
+        pthread_mutex_lock(&emu.mutex);
+        emu.waiting--;
+    }
+    pthread_mutex_unlock(&emu.mutex);
+    return r;
+}
+
+const dgtBackend_t dgtBackendEmu = {
+    "emu",
+    emuOpen,
+    emuClose,
+    emuRead,
+    emuWrite,
+    emuTime,
+    emuCoreFreq,
+    emuWait
+};
+
+// Press buttons on the virtual clock.
+void dgtemu_button(int buttons, u_int32_t holdUs) {
+    int new;
+
+    pthread_mutex_lock(&emu.mutex);
+    emuAdvance();
+    new = (emu.buttons & 0x60) | (buttons & 0x1f);
+    emuButtonMessage(emuNow(), new, emu.buttons);
+    emu.buttons = new;
+    emu.releaseAt = emuNow() + holdUs;
+    emuNotify();
+    pthread_mutex_unlock(&emu.mutex);
+}
+
+// Move the lever of the virtual clock.
+void dgtemu_lever(int rightDown) {
+    int new;
+
+    pthread_mutex_lock(&emu.mutex);
+    emuAdvance();
+    new = rightDown ? emu.buttons | 0x40 : emu.buttons & ~0x40;
+    if (new != emu.buttons) {
+        emuButtonMessage(emuNow(), new, emu.buttons);
+        emu.buttons = new;
+    }
+    emuNotify();
+    pthread_mutex_unlock(&emu.mutex);
+}
+
+// Keep the virtual pi and clock when the library starts again.
+void dgtemu_keep(int keep) {
+    pthread_mutex_lock(&emu.mutex);
+    emu.keep = keep;
+    pthread_mutex_unlock(&emu.mutex);
+}
+
+// Press the on/off button of the virtual clock.
+void dgtemu_power() {
+    int old;
+
+    pthread_mutex_lock(&emu.mutex);
+    emuAdvance();
+    old = emu.buttons;
+    if (emu.on)
+        emuTurnOff();
+    else
+        emuTurnOn(emuNow());
+    emuButtonMessage(emuNow(), emu.buttons, old);
+    emuNotify();
+    pthread_mutex_unlock(&emu.mutex);
+}
+
+// Get the text on the virtual display.
+int dgtemu_get_display(char text[]) {
+    int active;
+
+    pthread_mutex_lock(&emu.mutex);
+    emuAdvance();
+    memcpy(text, emu.text, 12);
+    active = emu.displayActive;
+    pthread_mutex_unlock(&emu.mutex);
+    return active;
+}
+
+// Get the program the virtual clock got last.
+int dgtemu_get_program(char program[]) {
+    int length;
+
+    pthread_mutex_lock(&emu.mutex);
+    emuAdvance();
+    length = emu.programLength;
+    memcpy(program, emu.program, length);
+    pthread_mutex_unlock(&emu.mutex);
+    return length;
+}
+
+// Sleep on the library clock.
+void dgtemu_sleep(u_int32_t us) {
+    dgtClock->sleep(us);
+}
+
+// Get the time of the library clock.
+u_int64_t dgtemu_time(void) {
+    return dgtClock->now();
+}
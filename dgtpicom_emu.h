@@ -0,0 +1,76 @@
+/* virtual DGT3000 on an emulated BCM2708/9 I2C bus
+ * version 0.8
+ *
+ * Copyright (C) 2015 DGT
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* The emulator is selected with dgtpicom_set_backend(DGTPICOM_BACKEND_EMU)
+ * or DGTPICOM_BACKEND=emu in the environment before dgtpicom_init().
+ * These functions act on the virtual clock like a user would.
+ */
+
+#ifndef DGTPICOM_EMU_H
+#define DGTPICOM_EMU_H
+
+#include <sys/types.h>
+
+/* Press buttons on the virtual clock.
+ *   buttons = 0x01 back, 0x02 minus, 0x04 play/pause, 0x08 plus,
+ *             0x10 forward
+ *   holdUs = time before the buttons are released in us
+ */
+void dgtemu_button(int buttons, u_int32_t holdUs);
+
+/* Move the lever of the virtual clock.
+ *   rightDown = 1 right side down, 0 left side down
+ */
+void dgtemu_lever(int rightDown);
+
+/* Press the on/off button of the virtual clock.
+ */
+void dgtemu_power(void);
+
+/* Keep the virtual pi and clock as they are when the library stops and
+ * starts again, like the hardware a second process takes over (see
+ * dgtpicom_set_start()).
+ *   keep = 1 keep, 0 start with a switched off clock (default)
+ */
+void dgtemu_keep(int keep);
+
+/* Get the text on the virtual display.
+ *   text = 12 byte buffer, filled with the 11 characters and a 0
+ *   returns 1 when a text is displayed, 0 in clock mode
+ */
+int dgtemu_get_display(char text[]);
+
+/* Get the program the virtual clock got last, it is not run.
+ *   program = buffer for up to DGTPICOM_PROGRAM_LENGTH bytes
+ *   returns the length of the program, 0 = none
+ */
+int dgtemu_get_program(char program[]);
+
+/* Sleep on the library clock, on virtual time (see dgtpicom_set_clock())
+ * a test sleeping here lets the time jump ahead.
+ *   us = time to sleep in us
+ */
+void dgtemu_sleep(u_int32_t us);
+
+/* Get the time of the library clock.
+ *   returns the time in us
+ */
+u_int64_t dgtemu_time(void);
+
+#endif
@@ -0,0 +1,728 @@
+/* record and replay of DGT3000 bus sessions
+ * version 0.8
+ *
+ * Copyright (C) 2015 DGT
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* The recorder sits between dgtpicom and the real backend and writes
+ * what the library saw: every byte taken from the slave fifo, slave
+ * overruns, the start and outcome of every master send and the commands
+ * the application queued. Events are stored with the time since the
+ * previous one:
+ *   4 bytes little endian delta in us, 1 byte kind, 1 byte value,
+ *   commands add 1 byte type, 1 byte length and the data.
+ * The receive thread only buffers its events, the command worker writes
+ * them to the file.
+ *
+ * The replay backend is a register level stand-in for the BSC master and
+ * slave that plays the recording back. Slave bytes arrive at their
+ * recorded time, a send gets the recorded outcome after the recorded
+ * time. The time line waits at a recorded send until the library starts
+ * one, so acks stay behind the send they belong to even when the build
+ * under test is slower or faster. Shortly before a recorded packet the
+ * bus lines read busy, a full fifo holds the time line until the library
+ * reads from it.
+ */
+
+#include <pthread.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/types.h>
+
+#include "dgtpicom_backend.h"
+
+#define REPLAY_MAGIC "DGTREC1\n"
+#define REPLAY_FIFO_SIZE 16
+#define REPLAY_CORE_FREQ 250		// MHz
+#define REPLAY_SKEW 100000			// us a recorded send waits for the library
+#define REPLAY_SEND_TIMEOUT 5000	// us before a send without recording fails
+#define REPLAY_LINES_BUSY 1000		// us before a recorded packet the bus is busy
+#define REPLAY_FOREVER ((u_int64_t)-1)
+
+#define EV_COMMAND 'C'
+#define EV_START 'S'		// value = master adress
+#define EV_DONE 'D'			// value = master status bits 8-9
+#define EV_BYTE 'B'			// value = byte from the slave fifo
+#define EV_OVERRUN 'O'
+
+// I2C master status bits
+#define S_TA 0x001
+#define S_DONE 0x002
+#define S_TXD 0x010
+#define S_TXE 0x040
+#define S_ERR 0x100
+
+// I2C slave flag bits
+#define FR_RXFE 0x002
+#define FR_TXFE 0x010
+#define FR_RXBUSY 0x020
+
+typedef struct {
+    u_int32_t dt;
+    unsigned char kind;
+    unsigned char value;
+    unsigned char type;
+    unsigned char length;
+    unsigned char handed;   // command given to the library
+    unsigned char data[REPLAY_DATA_LENGTH];
+} replayEvent_t;
+
+// recorder, events go to one buffer while the worker writes the other
+typedef struct {
+    pthread_mutex_t mutex;      // buffers and registers
+    pthread_mutex_t fileMutex;  // f, held while writing
+    FILE *f;
+    const dgtBackend_t *inner;
+    u_int64_t last;
+    unsigned adr;
+    int sending, overrun;
+    int fill;                   // buffer the events go to
+    int length;                 // bytes in it
+    unsigned char buffer[2][RECORD_BUFFER_SIZE];
+} record_t;
+
+record_t recorder={ .mutex=PTHREAD_MUTEX_INITIALIZER, .fileMutex=PTHREAD_MUTEX_INITIALIZER };
+
+// replay
+typedef struct {
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    int condInit;
+    struct timespec start;
+
+    replayEvent_t *ev;
+    int count, cur;
+    u_int64_t last;     // time the previous event was played
+
+    // plain registers
+    unsigned gpfsel[3];
+    unsigned div, del, a, dlen, mc, slv, scr, rsr;
+
+    // I2C master
+    unsigned ms;
+    int mActive, started;
+    u_int64_t mStart;
+    int sends, sendsSeen;   // sends started, the ones a waiter saw
+
+    // I2C slave
+    unsigned char sFifo[REPLAY_FIFO_SIZE];
+    int sFifoStart, sFifoCount;
+    int rxPos, rxLength;
+
+    int commands;       // commands reached by the time line
+    int unmatched, skipped;
+} replay_t;
+
+replay_t replayer={ .mutex=PTHREAD_MUTEX_INITIALIZER };
+
+// buffer an event, commands add their type, length and data in more,
+// called with recorder.mutex locked
+void recordEvent(int kind, int value, unsigned char more[], int length) {
+    u_int64_t now=recorder.inner->time();
+    u_int32_t dt=now-recorder.last;
+    unsigned char *b;
+
+    // the worker fell behind, drop it rather than write from here
+    if (recorder.length+6+length>RECORD_BUFFER_SIZE)
+        return;
+    b=recorder.buffer[recorder.fill]+recorder.length;
+    recorder.last=now;
+    b[0]=dt;
+    b[1]=dt>>8;
+    b[2]=dt>>16;
+    b[3]=dt>>24;
+    b[4]=kind;
+    b[5]=value;
+    memcpy(b+6, more, length);
+    __atomic_store_n(&recorder.length, recorder.length+6+length, __ATOMIC_RELAXED);
+}
+
+// Write the buffered events to the file.
+int recordFlush() {
+    int b, length, recording;
+
+    pthread_mutex_lock(&recorder.fileMutex);
+    pthread_mutex_lock(&recorder.mutex);
+    b=recorder.fill;
+    length=recorder.length;
+    recorder.fill^=1;
+    __atomic_store_n(&recorder.length, 0, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&recorder.mutex);
+
+    // the receive thread fills the other buffer meanwhile
+    if (recorder.f!=NULL && length)
+        fwrite(recorder.buffer[b], 1, length, recorder.f);
+    recording=recorder.f!=NULL;
+    pthread_mutex_unlock(&recorder.fileMutex);
+    return recording;
+}
+
+// Bytes of events waiting to be written.
+int recordPending() {
+    return __atomic_load_n(&recorder.length, __ATOMIC_RELAXED);
+}
+
+int recordOpen(char *piModel) {
+    int e=recorder.inner->open(piModel);
+
+    if (e)
+        return e;
+    recorder.last=recorder.inner->time();
+    return 0;
+}
+
+void recordClose() {
+    recordFlush();
+    pthread_mutex_lock(&recorder.fileMutex);
+    pthread_mutex_lock(&recorder.mutex);
+    if (recorder.f!=NULL)
+        fclose(recorder.f);
+    recorder.f=NULL;
+    pthread_mutex_unlock(&recorder.mutex);
+    pthread_mutex_unlock(&recorder.fileMutex);
+    recorder.inner->close();
+}
+
+unsigned recordRead(int reg) {
+    unsigned v=recorder.inner->read(reg);
+
+    if (reg!=REG_SLV_DR && reg!=REG_SLV_RSR && reg!=REG_MST_S)
+        return v;
+
+    pthread_mutex_lock(&recorder.mutex);
+    if (recorder.f!=NULL) {
+        if (reg==REG_SLV_DR) {
+            recordEvent(EV_BYTE, v&0xff, NULL, 0);
+        } else if (reg==REG_SLV_RSR) {
+            // once per overrun, it is read more than once
+            if ((v&1) && !recorder.overrun)
+                recordEvent(EV_OVERRUN, 0, NULL, 0);
+            recorder.overrun=v&1;
+        } else if (recorder.sending && (v&S_DONE)) {
+            recordEvent(EV_DONE, (v>>8)&3, NULL, 0);
+            recorder.sending=0;
+        }
+    }
+    pthread_mutex_unlock(&recorder.mutex);
+    return v;
+}
+
+void recordWrite(int reg, unsigned v) {
+    if (reg==REG_MST_A) {
+        recorder.adr=v&0x7f;
+    } else if (reg==REG_MST_C && (v&0x8080)==0x8080) {
+        pthread_mutex_lock(&recorder.mutex);
+        if (recorder.f!=NULL) {
+            recordEvent(EV_START, recorder.adr, NULL, 0);
+            recorder.sending=1;
+        }
+        pthread_mutex_unlock(&recorder.mutex);
+    }
+    recorder.inner->write(reg, v);
+}
+
+u_int64_t recordTime() {
+    return recorder.inner->time();
+}
+
+int recordCoreFreq() {
+    return recorder.inner->coreFreq();
+}
+
+int recordWait(u_int64_t timeOut) {
+    return recorder.inner->wait(timeOut);
+}
+
+const dgtBackend_t dgtBackendRecord = {
+    "record",
+    recordOpen,
+    recordClose,
+    recordRead,
+    recordWrite,
+    recordTime,
+    recordCoreFreq,
+    recordWait
+};
+
+// Record a session on top of a backend.
+const dgtBackend_t *recordStart(const char *path, const dgtBackend_t *inner) {
+    FILE *f, *old;
+
+    // recording again, keep the real backend
+    if (inner==&dgtBackendRecord)
+        inner=recorder.inner;
+    f=fopen(path, "wb");
+    if (f==NULL)
+        return inner;
+    fputs(REPLAY_MAGIC, f);
+
+    // the rest of the last recording goes to its own file
+    recordFlush();
+    pthread_mutex_lock(&recorder.fileMutex);
+    pthread_mutex_lock(&recorder.mutex);
+    old=recorder.f;
+    recorder.f=f;
+    recorder.inner=inner;
+    recorder.sending=0;
+    recorder.overrun=0;
+    __atomic_store_n(&recorder.length, 0, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&recorder.mutex);
+    if (old!=NULL)
+        fclose(old);
+    pthread_mutex_unlock(&recorder.fileMutex);
+    return &dgtBackendRecord;
+}
+
+// Record a command the application queued.
+void recordCommand(int type, char data[], int length) {
+    unsigned char b[2+REPLAY_DATA_LENGTH];
+
+    pthread_mutex_lock(&recorder.mutex);
+    if (recorder.f!=NULL) {
+        if (length>REPLAY_DATA_LENGTH)
+            length=REPLAY_DATA_LENGTH;
+        b[0]=type;
+        b[1]=length;
+        memcpy(b+2, data, length);
+        recordEvent(EV_COMMAND, 0, b, length+2);
+    }
+    pthread_mutex_unlock(&recorder.mutex);
+}
+
+u_int64_t replayNow() {
+    struct timespec t;
+
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return (u_int64_t)(t.tv_sec-replayer.start.tv_sec)*1000000
+            +(t.tv_nsec-replayer.start.tv_nsec)/1000;
+}
+
+// a byte arrives in the slave fifo
+void replayByte(unsigned char b) {
+    if (replayer.sFifoCount==REPLAY_FIFO_SIZE) {
+        replayer.rsr|=1;
+    } else {
+        replayer.sFifo[(replayer.sFifoStart+replayer.sFifoCount)%REPLAY_FIFO_SIZE]=b;
+        replayer.sFifoCount++;
+    }
+
+    // keep track of the packet for the busy flag: source, length, ...
+    // the length counts the adress byte that is not in the fifo
+    replayer.rxPos++;
+    if (replayer.rxPos==2)
+        replayer.rxLength=b<3 ? 2 : b-1;
+    if (replayer.rxPos>=2 && replayer.rxPos>=replayer.rxLength)
+        replayer.rxPos=0;
+}
+
+// the recording has the clock send before our next send, keep the
+// lines busy so the library waits for it like it did when recording
+int replayClockTalks() {
+    u_int64_t due=replayer.last;
+    int i;
+
+    for (i=replayer.cur; i<replayer.count; i++) {
+        due+=replayer.ev[i].dt;
+        if (replayer.ev[i].kind!=EV_COMMAND)
+            return replayer.ev[i].kind==EV_BYTE
+                    && due<replayNow()+REPLAY_LINES_BUSY;
+    }
+    return 0;
+}
+
+// play all events up to now
+void replayAdvance() {
+    u_int64_t now=replayNow();
+    replayEvent_t *e;
+    u_int64_t due;
+
+    // a send the recording has no outcome for
+    if (replayer.mActive && now-replayer.mStart>REPLAY_SEND_TIMEOUT) {
+        replayer.ms|=S_DONE|S_ERR;
+        replayer.mActive=0;
+        replayer.started=0;
+        replayer.unmatched++;
+    }
+
+    while (replayer.cur<replayer.count) {
+        e=&replayer.ev[replayer.cur];
+        due=replayer.last+e->dt;
+
+        if (e->kind==EV_START) {
+            // the library started a send, the time line goes on from there
+            if (replayer.started) {
+                replayer.started=0;
+                // the bus was free, no packet is being received
+                replayer.rxPos=0;
+                replayer.last=replayer.mStart;
+                replayer.cur++;
+                continue;
+            }
+            if (now<due+REPLAY_SKEW)
+                break;
+            // the library did not make this send, skip it and its outcome
+            replayer.skipped++;
+            replayer.last=due;
+            replayer.cur++;
+            if (replayer.cur<replayer.count && replayer.ev[replayer.cur].kind==EV_DONE)
+                replayer.cur++;
+            continue;
+        }
+
+        if (now<due)
+            break;
+        // the recording read this byte, so it fitted in the fifo then,
+        // hold the time line until the library made room for it
+        if (e->kind==EV_BYTE && replayer.sFifoCount==REPLAY_FIFO_SIZE)
+            break;
+        replayer.last=due;
+        replayer.cur++;
+
+        switch (e->kind) {
+            case EV_DONE:
+                if (replayer.mActive) {
+                    replayer.ms|=S_DONE|e->value<<8;
+                    replayer.mActive=0;
+                }
+                break;
+            case EV_BYTE:
+                replayByte(e->value);
+                break;
+            case EV_OVERRUN:
+                // the rest of the packet was lost
+                replayer.rsr|=1;
+                replayer.rxPos=0;
+                break;
+            case EV_COMMAND:
+                replayer.commands++;
+                pthread_cond_broadcast(&replayer.cond);
+                break;
+        }
+    }
+    if (replayer.cur>=replayer.count)
+        pthread_cond_broadcast(&replayer.cond);
+}
+
+// time the time line can move next, called with replayer.mutex locked
+u_int64_t replayNextEvent() {
+    u_int64_t due=REPLAY_FOREVER;
+    replayEvent_t *e;
+
+    if (replayer.cur<replayer.count) {
+        e=&replayer.ev[replayer.cur];
+        due=replayer.last+e->dt;
+        // a send the library does not make is skipped later
+        if (e->kind==EV_START)
+            due+=REPLAY_SKEW;
+    }
+    if (replayer.mActive && replayer.mStart+REPLAY_SEND_TIMEOUT<due)
+        due=replayer.mStart+REPLAY_SEND_TIMEOUT;
+    return due;
+}
+
+// Load a recording for the replay backend.
+int replayLoad(const char *path) {
+    char magic[sizeof(REPLAY_MAGIC)];
+    unsigned char b[6];
+    replayEvent_t *ev=NULL, *n;
+    int count=0, size=0;
+    FILE *f;
+
+    f=fopen(path, "rb");
+    if (f==NULL)
+        return -1;
+    if (fread(magic, 1, sizeof(REPLAY_MAGIC)-1, f)!=sizeof(REPLAY_MAGIC)-1
+            || memcmp(magic, REPLAY_MAGIC, sizeof(REPLAY_MAGIC)-1)) {
+        fclose(f);
+        return -1;
+    }
+
+    while (fread(b, 1, 6, f)==6) {
+        if (count==size) {
+            size=size ? size*2 : 1024;
+            n=realloc(ev, size*sizeof(replayEvent_t));
+            if (n==NULL)
+                break;
+            ev=n;
+        }
+        memset(&ev[count], 0, sizeof(replayEvent_t));
+        ev[count].dt=b[0] | b[1]<<8 | b[2]<<16 | (u_int32_t)b[3]<<24;
+        ev[count].kind=b[4];
+        ev[count].value=b[5];
+        if (b[4]==EV_COMMAND) {
+            if (fread(b, 1, 2, f)!=2 || b[1]>REPLAY_DATA_LENGTH
+                    || fread(ev[count].data, 1, b[1], f)!=b[1])
+                break;
+            ev[count].type=b[0];
+            ev[count].length=b[1];
+        }
+        count++;
+    }
+    fclose(f);
+
+    pthread_mutex_lock(&replayer.mutex);
+    free(replayer.ev);
+    replayer.ev=ev;
+    replayer.count=count;
+    pthread_mutex_unlock(&replayer.mutex);
+    return 0;
+}
+
+// Wait until the time line reaches the next recorded command.
+int replayNextCommand(int *type, char data[]) {
+    replayEvent_t *e;
+    struct timespec ts;
+    int i, length=-1;
+
+    pthread_mutex_lock(&replayer.mutex);
+    while (1) {
+        replayAdvance();
+        // commands reached that were not handed out yet
+        if (replayer.commands) {
+            for (i=0; i<replayer.cur; i++) {
+                e=&replayer.ev[i];
+                if (e->kind==EV_COMMAND && !e->handed) {
+                    *type=e->type;
+                    memcpy(data, e->data, e->length);
+                    length=e->length;
+                    e->handed=1;
+                    replayer.commands--;
+                    break;
+                }
+            }
+            break;
+        }
+        if (replayer.cur>=replayer.count)
+            break;
+
+        // the receive thread moves the time line too
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        ts.tv_nsec+=1000000;
+        if (ts.tv_nsec>=1000000000) {
+            ts.tv_sec++;
+            ts.tv_nsec-=1000000000;
+        }
+        pthread_cond_timedwait(&replayer.cond, &replayer.mutex, &ts);
+    }
+    pthread_mutex_unlock(&replayer.mutex);
+    return length;
+}
+
+// Sends that could not be matched with the recording.
+void replayCounts(int *unmatched, int *skipped) {
+    pthread_mutex_lock(&replayer.mutex);
+    *unmatched=replayer.unmatched;
+    *skipped=replayer.skipped;
+    pthread_mutex_unlock(&replayer.mutex);
+}
+
+int replayOpen(char *piModel) {
+    pthread_condattr_t attr;
+    int i;
+
+    pthread_mutex_lock(&replayer.mutex);
+    if (!replayer.condInit) {
+        pthread_condattr_init(&attr);
+        pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+        pthread_cond_init(&replayer.cond, &attr);
+        pthread_condattr_destroy(&attr);
+        replayer.condInit=1;
+    }
+    memset(&replayer.gpfsel, 0, sizeof(replayer)-offsetof(replay_t, gpfsel));
+    // play it again from the start
+    for (i=0; i<replayer.count; i++)
+        replayer.ev[i].handed=0;
+    replayer.cur=0;
+    replayer.last=0;
+    clock_gettime(CLOCK_MONOTONIC, &replayer.start);
+    pthread_mutex_unlock(&replayer.mutex);
+
+    *piModel=3;
+    return replayer.ev==NULL ? -1 : 0;
+}
+
+void replayClose() {
+}
+
+unsigned replayRead(int reg) {
+    unsigned v=0;
+
+    pthread_mutex_lock(&replayer.mutex);
+    replayAdvance();
+    switch (reg) {
+        case REG_GPFSEL0:
+        case REG_GPFSEL1:
+        case REG_GPFSEL2:
+            v=replayer.gpfsel[reg-REG_GPFSEL0];
+            break;
+        case REG_GPLEV0:
+            // all lines pulled up, SDA low while we or the clock are sending
+            v=0x000c0c0c;
+            if (replayer.mActive || replayClockTalks())
+                v&=~4;
+            break;
+        case REG_SLV_DR:
+            if (replayer.sFifoCount) {
+                v=replayer.sFifo[replayer.sFifoStart];
+                replayer.sFifoStart=(replayer.sFifoStart+1)%REPLAY_FIFO_SIZE;
+                replayer.sFifoCount--;
+            }
+            break;
+        case REG_SLV_RSR:
+            v=replayer.rsr;
+            break;
+        case REG_SLV_SLV:
+            v=replayer.slv;
+            break;
+        case REG_SLV_CR:
+            v=replayer.scr;
+            break;
+        case REG_SLV_FR:
+            v=FR_TXFE | replayer.sFifoCount<<11;
+            if (replayer.sFifoCount==0)
+                v|=FR_RXFE;
+            if (replayer.rxPos)
+                v|=FR_RXBUSY;
+            break;
+        case REG_MST_C:
+            v=replayer.mc;
+            break;
+        case REG_MST_S:
+            v=replayer.ms | S_TXD | S_TXE;
+            if (replayer.mActive)
+                v|=S_TA;
+            break;
+        case REG_MST_DLEN:
+            v=replayer.dlen;
+            break;
+        case REG_MST_A:
+            v=replayer.a;
+            break;
+        case REG_MST_DIV:
+            v=replayer.div;
+            break;
+        case REG_MST_DEL:
+            v=replayer.del;
+            break;
+    }
+    pthread_mutex_unlock(&replayer.mutex);
+    return v;
+}
+
+void replayWrite(int reg, unsigned v) {
+    pthread_mutex_lock(&replayer.mutex);
+    replayAdvance();
+    switch (reg) {
+        case REG_GPFSEL0:
+        case REG_GPFSEL1:
+        case REG_GPFSEL2:
+            replayer.gpfsel[reg-REG_GPFSEL0]=v;
+            break;
+        case REG_SLV_RSR:
+            replayer.rsr=0;
+            break;
+        case REG_SLV_SLV:
+            replayer.slv=v;
+            break;
+        case REG_SLV_CR:
+            replayer.scr=v;
+            break;
+        case REG_MST_C:
+            replayer.mc=v&0x8701;
+            // start transfer, the outcome comes from the recording
+            if ((v&0x8080)==0x8080 && !replayer.mActive) {
+                replayer.mActive=1;
+                replayer.started=1;
+                replayer.mStart=replayNow();
+                // SDA moves, wake a waiting receive thread
+                replayer.sends++;
+                pthread_cond_broadcast(&replayer.cond);
+            }
+            break;
+        case REG_MST_S:
+            replayer.ms&=~(v&0x302);
+            break;
+        case REG_MST_DLEN:
+            replayer.dlen=v&0xffff;
+            break;
+        case REG_MST_A:
+            replayer.a=v&0x7f;
+            break;
+        case REG_MST_DIV:
+            replayer.div=v&0xffff;
+            break;
+        case REG_MST_DEL:
+            replayer.del=v;
+            break;
+    }
+    pthread_mutex_unlock(&replayer.mutex);
+}
+
+u_int64_t replayTime() {
+    return replayNow();
+}
+
+int replayCoreFreq() {
+    return REPLAY_CORE_FREQ;
+}
+
+// sleep until a send starts, a recorded packet comes in or timeout
+int replayWait(u_int64_t timeOut) {
+    u_int64_t deadline, t;
+    struct timespec ts;
+    int r=0;
+
+    pthread_mutex_lock(&replayer.mutex);
+    deadline=replayNow()+timeOut;
+    while (1) {
+        replayAdvance();
+        if (replayer.sFifoCount || replayer.rxPos || replayer.sends!=replayer.sendsSeen) {
+            replayer.sendsSeen=replayer.sends;
+            r=1;
+            break;
+        }
+        if (replayNow()>=deadline)
+            break;
+
+        // nothing changes before the next event or a send of the library
+        t=replayNextEvent();
+        if (t>deadline)
+            t=deadline;
+        ts.tv_sec=replayer.start.tv_sec+t/1000000;
+        ts.tv_nsec=replayer.start.tv_nsec+t%1000000*1000;
+        if (ts.tv_nsec>=1000000000) {
+            ts.tv_sec++;
+            ts.tv_nsec-=1000000000;
+        }
+        pthread_cond_timedwait(&replayer.cond, &replayer.mutex, &ts);
+    }
+    pthread_mutex_unlock(&replayer.mutex);
+    return r;
+}
+
+const dgtBackend_t dgtBackendReplay = {
+    "replay",
+    replayOpen,
+    replayClose,
+    replayRead,
+    replayWrite,
+    replayTime,
+    replayCoreFreq,
+    replayWait
+};